@@ -0,0 +1,226 @@
+/*
+ * PackageLicenseDeclared: Apache-2.0
+ * Copyright (c) 2018 ARM Limited
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "mbed.h"
+#include "FragmentationBlockDeviceWrapper.h"
+#include "FragmentationAes.h"
+#include "FragmentationAesCtr.h"
+#include "FragmentationSha256.h"
+#include "FragmentationSequentialWriter.h"
+#include "BDFile.h"
+#include "test_setup.h"
+#include "utest/utest.h"
+#include "unity/unity.h"
+#include "greentea-client/test_env.h"
+#include "mbed_trace.h"
+
+using namespace utest::v1;
+
+// Test vectors from NIST SP 800-38A, F.5.1 (CTR-AES128.Encrypt)
+static const uint8_t CTR_KEY[16] = {
+    0x2b, 0x7e, 0x15, 0x16, 0x28, 0xae, 0xd2, 0xa6, 0xab, 0xf7, 0x15, 0x88, 0x09, 0xcf, 0x4f, 0x3c
+};
+
+// last byte overflows after the first block, so this also tests the counter carry
+static const uint8_t CTR_NONCE[16] = {
+    0xf0, 0xf1, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8, 0xf9, 0xfa, 0xfb, 0xfc, 0xfd, 0xfe, 0xff
+};
+
+static const uint8_t CTR_PLAINTEXT[64] = {
+    0x6b, 0xc1, 0xbe, 0xe2, 0x2e, 0x40, 0x9f, 0x96, 0xe9, 0x3d, 0x7e, 0x11, 0x73, 0x93, 0x17, 0x2a,
+    0xae, 0x2d, 0x8a, 0x57, 0x1e, 0x03, 0xac, 0x9c, 0x9e, 0xb7, 0x6f, 0xac, 0x45, 0xaf, 0x8e, 0x51,
+    0x30, 0xc8, 0x1c, 0x46, 0xa3, 0x5c, 0xe4, 0x11, 0xe5, 0xfb, 0xc1, 0x19, 0x1a, 0x0a, 0x52, 0xef,
+    0xf6, 0x9f, 0x24, 0x45, 0xdf, 0x4f, 0x9b, 0x17, 0xad, 0x2b, 0x41, 0x7b, 0xe6, 0x6c, 0x37, 0x10
+};
+
+static const uint8_t CTR_CIPHERTEXT[64] = {
+    0x87, 0x4d, 0x61, 0x91, 0xb6, 0x20, 0xe3, 0x26, 0x1b, 0xef, 0x68, 0x64, 0x99, 0x0d, 0xb6, 0xce,
+    0x98, 0x06, 0xf6, 0x6b, 0x79, 0x70, 0xfd, 0xff, 0x86, 0x17, 0x18, 0x7b, 0xb9, 0xff, 0xfd, 0xff,
+    0x5a, 0xe4, 0xdf, 0x3e, 0xdb, 0xd5, 0xd3, 0x5e, 0x5b, 0x4f, 0x09, 0x02, 0x0d, 0xb0, 0x3e, 0xab,
+    0x1e, 0x03, 0x1d, 0xda, 0x2f, 0xbe, 0x03, 0xd1, 0x79, 0x21, 0x70, 0xa0, 0xf3, 0x00, 0x9c, 0xee
+};
+
+static control_t aes_fips197_vector(const size_t call_count) {
+    // FIPS-197, Appendix C.1
+    const uint8_t key[16] = {
+        0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f
+    };
+    const uint8_t plaintext[16] = {
+        0x00, 0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77, 0x88, 0x99, 0xaa, 0xbb, 0xcc, 0xdd, 0xee, 0xff
+    };
+    const uint8_t expected[16] = {
+        0x69, 0xc4, 0xe0, 0xd8, 0x6a, 0x7b, 0x04, 0x30, 0xd8, 0xcd, 0xb7, 0x80, 0x70, 0xb4, 0xc5, 0x5a
+    };
+
+    uint8_t output[16];
+
+    FragmentationAes aes(key);
+    aes.encrypt(plaintext, output);
+    TEST_ASSERT_EQUAL(true, compare_buffers(output, expected, 16));
+
+    // key schedule is reused, and in place encryption works
+    memcpy(output, plaintext, 16);
+    aes.encrypt(output, output);
+    TEST_ASSERT_EQUAL(true, compare_buffers(output, expected, 16));
+
+    aes.clear();
+
+    return CaseNext;
+}
+
+static control_t ctr_sequential(const size_t call_count) {
+    uint8_t buffer[64];
+    memcpy(buffer, CTR_CIPHERTEXT, sizeof(buffer));
+
+    FragmentationAesCtr aes_ctr;
+    TEST_ASSERT_EQUAL(true, aes_ctr.setup(CTR_KEY, CTR_NONCE));
+
+    // chunks deliberately not a multiple of the AES block size
+    for (size_t offset = 0; offset < sizeof(buffer); offset += 7) {
+        size_t length = sizeof(buffer) - offset < 7 ? sizeof(buffer) - offset : 7;
+        TEST_ASSERT_EQUAL(true, aes_ctr.decrypt(offset, buffer + offset, length));
+    }
+
+    aes_ctr.finish();
+
+    TEST_ASSERT_EQUAL(true, compare_buffers(buffer, CTR_PLAINTEXT, sizeof(buffer)));
+
+    return CaseNext;
+}
+
+static control_t ctr_random_access(const size_t call_count) {
+    uint8_t buffer[20];
+
+    FragmentationAesCtr aes_ctr;
+    TEST_ASSERT_EQUAL(true, aes_ctr.setup(CTR_KEY, CTR_NONCE));
+
+    // seek forward into the middle of a block
+    memcpy(buffer, CTR_CIPHERTEXT + 37, 20);
+    TEST_ASSERT_EQUAL(true, aes_ctr.decrypt(37, buffer, 20));
+    TEST_ASSERT_EQUAL(true, compare_buffers(buffer, CTR_PLAINTEXT + 37, 20));
+
+    // and back again, across the counter carry
+    memcpy(buffer, CTR_CIPHERTEXT + 10, 20);
+    TEST_ASSERT_EQUAL(true, aes_ctr.decrypt(10, buffer, 20));
+    TEST_ASSERT_EQUAL(true, compare_buffers(buffer, CTR_PLAINTEXT + 10, 20));
+
+    aes_ctr.finish();
+
+    return CaseNext;
+}
+
+static bool wrote_package = false;
+
+static void write_to_package() {
+    wrote_package = true;
+}
+
+static control_t decrypt_into_target_slot(const size_t call_count) {
+    FragmentationBlockDeviceWrapper fbd(&bd);
+    fbd.init();
+
+    int r = fbd.program(CTR_CIPHERTEXT, MBED_CONF_LORAWAN_UPDATE_CLIENT_SLOT0_FW_ADDRESS, sizeof(CTR_CIPHERTEXT));
+    TEST_ASSERT_EQUAL(BD_ERROR_OK, r);
+
+    uint8_t sha_buffer[24];
+    unsigned char decrypted_hash[32];
+    unsigned char plaintext_hash[32];
+
+    FragmentationAesCtr aes_ctr;
+    TEST_ASSERT_EQUAL(true, aes_ctr.setup(CTR_KEY, CTR_NONCE));
+
+    FragmentationSha256 sha256(&fbd, sha_buffer, sizeof(sha_buffer));
+    sha256.start();
+
+    wrote_package = false;
+    fbd.set_write_watch(MBED_CONF_LORAWAN_UPDATE_CLIENT_SLOT0_FW_ADDRESS, sizeof(CTR_CIPHERTEXT), callback(write_to_package));
+
+    {
+        BDFILE source(&fbd, MBED_CONF_LORAWAN_UPDATE_CLIENT_SLOT0_FW_ADDRESS, sizeof(CTR_CIPHERTEXT));
+        source.set_decryption(&aes_ctr);
+
+        FragmentationSequentialWriter writer;
+        TEST_ASSERT_EQUAL(BD_ERROR_OK, writer.start(&fbd, MBED_CONF_LORAWAN_UPDATE_CLIENT_SLOT1_FW_ADDRESS,
+            MBED_CONF_LORAWAN_UPDATE_CLIENT_SLOT1_FW_ADDRESS + MBED_CONF_LORAWAN_UPDATE_CLIENT_SLOT_SIZE));
+
+        BDFILE target(&fbd, MBED_CONF_LORAWAN_UPDATE_CLIENT_SLOT1_FW_ADDRESS, 0);
+        target.set_sequential_writer(&writer);
+        target.set_hash(&sha256);
+
+        // odd chunks, so the counter blocks don't line up with the reads
+        uint8_t buffer[24];
+        size_t pos = 0;
+        while (pos < sizeof(CTR_CIPHERTEXT)) {
+            size_t chunk = sizeof(CTR_CIPHERTEXT) - pos > sizeof(buffer) ? sizeof(buffer) : sizeof(CTR_CIPHERTEXT) - pos;
+            TEST_ASSERT_EQUAL(chunk, bd_fread(buffer, 1, chunk, &source));
+            TEST_ASSERT_EQUAL(chunk, bd_fwrite(buffer, 1, chunk, &target));
+            pos += chunk;
+        }
+
+        TEST_ASSERT_EQUAL(0, bd_fflush(&target));
+        TEST_ASSERT_EQUAL(sizeof(CTR_CIPHERTEXT), target.hashed_length());
+    }
+
+    sha256.finish(decrypted_hash);
+    fbd.clear_write_watch();
+
+    // the package was not touched, so it can be decrypted again
+    TEST_ASSERT_EQUAL(false, wrote_package);
+
+    uint8_t flash_content[64];
+    r = fbd.read(flash_content, MBED_CONF_LORAWAN_UPDATE_CLIENT_SLOT0_FW_ADDRESS, sizeof(flash_content));
+    TEST_ASSERT_EQUAL(BD_ERROR_OK, r);
+    TEST_ASSERT_EQUAL(true, compare_buffers(flash_content, CTR_CIPHERTEXT, sizeof(flash_content)));
+
+    // the target holds the plaintext, and the hash is over the plaintext
+    r = fbd.read(flash_content, MBED_CONF_LORAWAN_UPDATE_CLIENT_SLOT1_FW_ADDRESS, sizeof(flash_content));
+    TEST_ASSERT_EQUAL(BD_ERROR_OK, r);
+    TEST_ASSERT_EQUAL(true, compare_buffers(flash_content, CTR_PLAINTEXT, sizeof(flash_content)));
+
+    sha256.calculate(MBED_CONF_LORAWAN_UPDATE_CLIENT_SLOT1_FW_ADDRESS, sizeof(CTR_PLAINTEXT), plaintext_hash);
+    TEST_ASSERT_EQUAL(true, compare_buffers(decrypted_hash, plaintext_hash, 32));
+
+    return CaseNext;
+}
+
+utest::v1::status_t greentea_setup(const size_t number_of_cases) {
+    GREENTEA_SETUP(5*60, "default_auto");
+    return greentea_test_setup_handler(number_of_cases);
+}
+
+Case cases[] = {
+    Case("aes_fips197_vector", aes_fips197_vector),
+    Case("ctr_sequential", ctr_sequential),
+    Case("ctr_random_access", ctr_random_access),
+    Case("decrypt_into_target_slot", decrypt_into_target_slot)
+};
+
+Specification specification(greentea_setup, cases);
+
+void blink_led() {
+    static DigitalOut led(LED1);
+    led = !led;
+}
+
+int main() {
+    Ticker t;
+    t.attach(blink_led, 0.5);
+
+    mbed_trace_init();
+
+    return !Harness::run(specification);
+}
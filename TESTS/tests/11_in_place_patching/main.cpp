@@ -0,0 +1,397 @@
+/*
+ * PackageLicenseDeclared: Apache-2.0
+ * Copyright (c) 2018 ARM Limited
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// delta updates are patched in place: the journal goes in slot 1 (which is not used then),
+// and the slot 2 header needs room for the bootloader header
+#undef  MBED_CONF_LORAWAN_UPDATE_CLIENT_IN_PLACE_DELTA_JOURNAL_ADDRESS
+#define MBED_CONF_LORAWAN_UPDATE_CLIENT_IN_PLACE_DELTA_JOURNAL_ADDRESS MBED_CONF_LORAWAN_UPDATE_CLIENT_SLOT1_HEADER_ADDRESS
+#undef  MBED_CONF_LORAWAN_UPDATE_CLIENT_SLOT2_FW_ADDRESS
+#define MBED_CONF_LORAWAN_UPDATE_CLIENT_SLOT2_FW_ADDRESS (MBED_CONF_LORAWAN_UPDATE_CLIENT_SLOT2_HEADER_ADDRESS + 0x210)
+
+// check patches with a dry run, so an unsuitable diff is rejected before slot 2 is touched
+#undef  MBED_CONF_LORAWAN_UPDATE_CLIENT_IN_PLACE_DELTA_DRY_RUN
+#define MBED_CONF_LORAWAN_UPDATE_CLIENT_IN_PLACE_DELTA_DRY_RUN 1
+
+#include "mbed.h"
+#include "packets_diff.h"
+#include "UpdateCerts.h"
+#include "LoRaWANUpdateClient.h"
+#include "FragmentationBlockDeviceWrapper.h"
+#include "FragmentationInPlaceWriter.h"
+#include "FragmentationSha256.h"
+#include "BDFile.h"
+#include "crc32.h"
+#include "test_setup.h"
+#include "utest/utest.h"
+#include "unity/unity.h"
+#include "greentea-client/test_env.h"
+#include "mbed_trace.h"
+
+using namespace utest::v1;
+
+#define TEST_PAGES  6
+
+// fwd declaration
+static void fake_send_method(LoRaWANUpdateClientSendParams_t &params);
+
+const uint8_t APP_KEY[16] = { 0x0, 0x1, 0x2, 0x3, 0x4, 0x5, 0x6, 0x7, 0x8, 0x9, 0xa, 0xb, 0xc, 0xd, 0xe, 0xf };
+
+LoRaWANUpdateClient uc(&bd, APP_KEY, fake_send_method);
+
+static bool is_complete = false;
+static bool is_firmware_ready = false;
+
+static void fake_send_method(LoRaWANUpdateClientSendParams_t &params) {
+    printf("Sending %u bytes on port %u: ", params.length, params.port);
+    for (size_t ix = 0; ix < params.length; ix++) {
+        printf("%02x ", params.data[ix]);
+    }
+    printf("\n");
+}
+
+static void lorawan_uc_fragsession_complete() {
+    is_complete = true;
+}
+
+static void lorawan_uc_firmware_ready() {
+    is_firmware_ready = true;
+}
+
+// old content of the region, byte n is (n & 0xff)
+static uint8_t old_byte(size_t n) {
+    return n & 0xff;
+}
+
+// new content of the region, byte n is (n * 7 & 0xff)
+static uint8_t new_byte(size_t n) {
+    return (n * 7) & 0xff;
+}
+
+static bd_addr_t region_start(FragmentationBlockDeviceWrapper &fbd) {
+    return ((MBED_CONF_LORAWAN_UPDATE_CLIENT_SLOT1_FW_ADDRESS / fbd.get_page_size()) + 1) * fbd.get_page_size();
+}
+
+static bd_addr_t journal_address(FragmentationBlockDeviceWrapper &fbd) {
+    return region_start(fbd) + ((TEST_PAGES + 1) * fbd.get_page_size());
+}
+
+static void fill_region(FragmentationBlockDeviceWrapper &fbd) {
+    size_t page_size = fbd.get_page_size();
+    uint8_t *page = (uint8_t*)malloc(page_size);
+    TEST_ASSERT_NOT_NULL(page);
+
+    for (size_t p = 0; p < TEST_PAGES; p++) {
+        for (size_t ix = 0; ix < page_size; ix++) {
+            page[ix] = old_byte((p * page_size) + ix);
+        }
+        TEST_ASSERT_EQUAL(BD_ERROR_OK, fbd.program(page, region_start(fbd) + (p * page_size), page_size));
+    }
+
+    free(page);
+}
+
+static control_t in_place_window(const size_t call_count) {
+    FragmentationBlockDeviceWrapper fbd(&bd);
+    TEST_ASSERT_EQUAL(BD_ERROR_OK, fbd.init());
+
+    size_t page_size = fbd.get_page_size();
+    bd_addr_t start = region_start(fbd);
+    size_t length = (TEST_PAGES * page_size) - 10;
+
+    fill_region(fbd);
+
+    {
+        FragmentationInPlaceWriter writer;
+        TEST_ASSERT_EQUAL(BD_ERROR_OK, writer.start(&fbd, start, start + (TEST_PAGES * page_size), journal_address(fbd), 2));
+
+        BDFILE source(&fbd, start, TEST_PAGES * page_size);
+        BDFILE target(&fbd, start, 0);
+        target.set_in_place_writer(&writer);
+        source.set_overwritten_by(&writer);
+
+        // the new data runs one page ahead of where the old data is read, which fits in a window of two pages
+        for (size_t ix = 0; ix < length; ix++) {
+            uint8_t b = new_byte(ix);
+            TEST_ASSERT_EQUAL(1, bd_fwrite(&b, 1, 1, &target));
+
+            if (ix >= page_size) {
+                uint8_t old;
+                TEST_ASSERT_EQUAL(0, bd_fseek(&source, ix - page_size, SEEK_SET));
+                TEST_ASSERT_EQUAL(1, bd_fread(&old, 1, 1, &source));
+                TEST_ASSERT_EQUAL(old_byte(ix - page_size), old);
+            }
+        }
+
+        // the first pages were committed, so reading them fails
+        uint8_t old;
+        TEST_ASSERT_EQUAL(0, bd_fseek(&source, 0, SEEK_SET));
+        TEST_ASSERT_EQUAL(0, bd_fread(&old, 1, 1, &source));
+        TEST_ASSERT_EQUAL(true, source.read_overwritten_data());
+
+        TEST_ASSERT_EQUAL(0, bd_fflush(&target));
+    }
+
+    // new data in the region, the rest of the last page keeps the old data
+    uint8_t *page = (uint8_t*)malloc(page_size);
+    TEST_ASSERT_NOT_NULL(page);
+
+    for (size_t p = 0; p < TEST_PAGES; p++) {
+        TEST_ASSERT_EQUAL(BD_ERROR_OK, fbd.read(page, start + (p * page_size), page_size));
+        for (size_t ix = 0; ix < page_size; ix++) {
+            size_t n = (p * page_size) + ix;
+            TEST_ASSERT_EQUAL(n < length ? new_byte(n) : old_byte(n), page[ix]);
+        }
+    }
+
+    free(page);
+
+    // finished cleanly, so there is nothing to recover
+    bd_addr_t recovered_start, committed_end;
+    TEST_ASSERT_EQUAL(0, FragmentationInPlaceWriter::recover(&fbd, journal_address(fbd), &recovered_start, &committed_end));
+
+    return CaseNext;
+}
+
+static control_t in_place_recover(const size_t call_count) {
+    FragmentationBlockDeviceWrapper fbd(&bd);
+    TEST_ASSERT_EQUAL(BD_ERROR_OK, fbd.init());
+
+    size_t page_size = fbd.get_page_size();
+    bd_addr_t start = region_start(fbd);
+    bd_addr_t journal = journal_address(fbd);
+
+    fill_region(fbd);
+
+    uint8_t *page = (uint8_t*)malloc(page_size);
+    TEST_ASSERT_NOT_NULL(page);
+
+    // power failed while the third page was written: the journal holds the page, but the region does not
+    for (size_t ix = 0; ix < page_size; ix++) {
+        page[ix] = new_byte((2 * page_size) + ix);
+    }
+
+    FragmentationInPlaceJournal_t record;
+    record.magic = FRAG_IN_PLACE_JOURNAL_MAGIC;
+    record.region_start = start;
+    record.page_address = start + (2 * page_size);
+    record.data_crc = crc32(0, page, page_size);
+    record.crc = crc32(0, (uint8_t*)&record, sizeof(FragmentationInPlaceJournal_t) - sizeof(record.crc));
+
+    TEST_ASSERT_EQUAL(BD_ERROR_OK, fbd.erase(journal, page_size * 2));
+    TEST_ASSERT_EQUAL(BD_ERROR_OK, fbd.program(page, journal, page_size));
+    TEST_ASSERT_EQUAL(BD_ERROR_OK, fbd.program(&record, journal + page_size, sizeof(FragmentationInPlaceJournal_t)));
+    TEST_ASSERT_EQUAL(BD_ERROR_OK, fbd.erase(record.page_address, page_size));
+
+    bd_addr_t recovered_start, committed_end;
+    TEST_ASSERT_EQUAL(1, FragmentationInPlaceWriter::recover(&fbd, journal, &recovered_start, &committed_end));
+    TEST_ASSERT_EQUAL(start, recovered_start);
+    TEST_ASSERT_EQUAL(start + (3 * page_size), committed_end);
+
+    TEST_ASSERT_EQUAL(BD_ERROR_OK, fbd.read(page, start + (2 * page_size), page_size));
+    for (size_t ix = 0; ix < page_size; ix++) {
+        TEST_ASSERT_EQUAL(new_byte((2 * page_size) + ix), page[ix]);
+    }
+
+    // journal was cleared
+    TEST_ASSERT_EQUAL(0, FragmentationInPlaceWriter::recover(&fbd, journal, &recovered_start, &committed_end));
+
+    free(page);
+
+    return CaseNext;
+}
+
+// old firmware in slot 2, with the header that describes it
+static void put_old_firmware_in_slot2(FragmentationBlockDeviceWrapper &fbd) {
+    TEST_ASSERT_EQUAL(BD_ERROR_OK, fbd.program(SLOT2_DATA, MBED_CONF_LORAWAN_UPDATE_CLIENT_SLOT2_FW_ADDRESS, SLOT2_DATA_LENGTH));
+
+    arm_uc_firmware_details_t details;
+    details.version = static_cast<uint64_t>(MBED_BUILD_TIMESTAMP);
+    details.size = SLOT2_DATA_LENGTH;
+    memcpy(details.hash, SLOT2_SHA256_HASH, 32);
+    memset(details.campaign, 0, ARM_UC_GUID_SIZE);
+    details.signatureSize = 0;
+
+    TEST_ASSERT_EQUAL(BD_ERROR_OK, fbd.program(&details, MBED_CONF_LORAWAN_UPDATE_CLIENT_SLOT2_HEADER_ADDRESS, sizeof(arm_uc_firmware_details_t)));
+}
+
+static void verify_slot2(FragmentationBlockDeviceWrapper &fbd, size_t length, const uint8_t expected[32]) {
+    unsigned char sha_out_buffer[32];
+    uint8_t sha_buffer[LW_UC_SHA256_BUFFER_SIZE];
+
+    FragmentationSha256* sha256 = new FragmentationSha256(&fbd, sha_buffer, sizeof(sha_buffer));
+    sha256->calculate(MBED_CONF_LORAWAN_UPDATE_CLIENT_SLOT2_FW_ADDRESS, length, sha_out_buffer);
+    delete sha256;
+
+    TEST_ASSERT_EQUAL(true, compare_buffers(sha_out_buffer, expected, 32));
+}
+
+/**
+ * Byte of a package with a diff that inserts 'insert_length' bytes in front of the old firmware, in the
+ * format that janpatch reads: INS with the new bytes, then EQL over the complete old firmware.
+ * After the insertion janpatch reads the old firmware from the start, while the new firmware is written
+ * 'insert_length' bytes further, so the diff cannot be applied in place when that's more than the window.
+ */
+static uint8_t insert_package_byte(size_t insert_length, size_t ix) {
+    // ESC INS <data> ESC EQL 253 <16-bit length>
+    const uint8_t eql[] = { 0xa7, 0xa3, 0xfd, (uint8_t)(SLOT2_DATA_LENGTH >> 8), (uint8_t)(SLOT2_DATA_LENGTH & 0xff) };
+
+    if (ix < 2) return ix == 0 ? 0xa7 : 0xa5;
+    ix -= 2;
+
+    if (ix < insert_length) return 0x00;
+    ix -= insert_length;
+
+    if (ix < sizeof(eql)) return eql[ix];
+    ix -= sizeof(eql);
+
+    // the signature is only checked after patching, only diff_info matters here
+    UpdateSignature_t header;
+    memset(&header, 0, sizeof(UpdateSignature_t));
+    uint8_t *diff_info = (uint8_t*)&header.diff_info;
+    diff_info[0] = FOTA_DIFF_INFO_IS_DIFF;
+    diff_info[1] = (SLOT2_DATA_LENGTH >> 16) & 0xff;
+    diff_info[2] = (SLOT2_DATA_LENGTH >> 8) & 0xff;
+    diff_info[3] = SLOT2_DATA_LENGTH & 0xff;
+
+    return ((uint8_t*)&header)[ix];
+}
+
+static control_t in_place_delta_rejects_unsuitable_diff(const size_t call_count) {
+    FragmentationBlockDeviceWrapper fbd(&bd);
+    TEST_ASSERT_EQUAL(BD_ERROR_OK, fbd.init());
+
+    put_old_firmware_in_slot2(fbd);
+
+    // janpatch writes through a buffer, so the new firmware can lag that much behind
+    size_t insert_length = ((MBED_CONF_LORAWAN_UPDATE_CLIENT_IN_PLACE_DELTA_WINDOW + 1) * fbd.get_page_size()) + LW_UC_JANPATCH_BUFFER_SIZE;
+    size_t package_size = 2 + insert_length + 5 + FOTA_SIGNATURE_LENGTH;
+
+    const uint8_t frag_size = 200;
+    uint16_t nb_frag = (package_size + frag_size - 1) / frag_size;
+    uint8_t padding = (nb_frag * frag_size) - package_size;
+
+    is_complete = false;
+    is_firmware_ready = false;
+    uc.callbacks.fragSessionComplete = lorawan_uc_fragsession_complete;
+    uc.callbacks.firmwareReady = lorawan_uc_firmware_ready;
+
+    const uint8_t setup[] = { FRAG_SESSION_SETUP_REQ, 0x0, (uint8_t)(nb_frag & 0xff), (uint8_t)(nb_frag >> 8), frag_size, 0x0, padding, 0x0, 0x0, 0x0, 0x0 };
+    TEST_ASSERT_EQUAL(LW_UC_OK, uc.handleFragmentationCommand(0x0, (uint8_t*)setup, sizeof(setup)));
+
+    LW_UC_STATUS status = LW_UC_OK;
+    uint8_t frame[3 + frag_size];
+
+    for (uint16_t n = 1; n <= nb_frag && !is_complete; n++) {
+        frame[0] = DATA_FRAGMENT;
+        frame[1] = n & 0xff;
+        frame[2] = n >> 8;
+        for (size_t ix = 0; ix < frag_size; ix++) {
+            size_t pos = ((n - 1) * frag_size) + ix;
+            frame[3 + ix] = pos < package_size ? insert_package_byte(insert_length, pos) : 0x0;
+        }
+
+        status = uc.handleFragmentationCommand(0x0, frame, sizeof(frame));
+        if (!is_complete) {
+            TEST_ASSERT_EQUAL(LW_UC_OK, status);
+        }
+
+        wait_ms(20);
+    }
+
+    TEST_ASSERT_EQUAL(true, is_complete);
+    TEST_ASSERT_EQUAL(LW_UC_DIFF_IN_PLACE_SOURCE_OVERWRITTEN, status);
+    TEST_ASSERT_EQUAL(false, is_firmware_ready);
+
+    // slot 2 was not touched: still the old firmware, and the header still describes it
+    verify_slot2(fbd, SLOT2_DATA_LENGTH, SLOT2_SHA256_HASH);
+
+    arm_uc_firmware_details_t details;
+    TEST_ASSERT_EQUAL(BD_ERROR_OK, fbd.read(&details, MBED_CONF_LORAWAN_UPDATE_CLIENT_SLOT2_HEADER_ADDRESS, sizeof(arm_uc_firmware_details_t)));
+    TEST_ASSERT_EQUAL(SLOT2_DATA_LENGTH, details.size);
+    TEST_ASSERT_EQUAL(true, compare_buffers(details.hash, SLOT2_SHA256_HASH, 32));
+
+    // and there is nothing to recover
+    TEST_ASSERT_EQUAL(LW_UC_OK, uc.recoverInPlaceDeltaUpdate());
+
+    return CaseNext;
+}
+
+static control_t in_place_delta_update(const size_t call_count) {
+    FragmentationBlockDeviceWrapper fbd(&bd);
+    TEST_ASSERT_EQUAL(BD_ERROR_OK, fbd.init());
+
+    put_old_firmware_in_slot2(fbd);
+
+    is_complete = false;
+    is_firmware_ready = false;
+    uc.callbacks.fragSessionComplete = lorawan_uc_fragsession_complete;
+    uc.callbacks.firmwareReady = lorawan_uc_firmware_ready;
+
+    TEST_ASSERT_EQUAL(LW_UC_OK, uc.handleFragmentationCommand(0x0, (uint8_t*)FAKE_PACKETS_HEADER, sizeof(FAKE_PACKETS_HEADER)));
+
+    // the diff from xdot-l151cc-blinky_application.bin to xdot-l151cc-blinky_application-v2.bin only modifies
+    // a few bytes, so the patch never reads old firmware behind the new firmware
+    for (size_t ix = 0; ix < sizeof(FAKE_PACKETS) / sizeof(FAKE_PACKETS[0]); ix++) {
+        LW_UC_STATUS status = uc.handleFragmentationCommand(0x0, (uint8_t*)FAKE_PACKETS[ix], sizeof(FAKE_PACKETS[0]));
+        TEST_ASSERT_EQUAL(LW_UC_OK, status);
+
+        if (is_complete) break;
+
+        wait_ms(20);
+    }
+
+    TEST_ASSERT_EQUAL(true, is_complete);
+    TEST_ASSERT_EQUAL(true, is_firmware_ready);
+
+    // output from shasum -a 256 xdot-l151cc-blinky-application-v2.bin
+    const uint8_t expected[] = {
+        0x64, 0x3c, 0x1d, 0x63, 0x5b, 0x0c, 0xa8, 0xd3, 0x90, 0x8a, 0x60, 0x80, 0x03, 0xd0, 0xcb, 0x61,
+        0x31, 0xd4, 0xf9, 0x47, 0xbe, 0xec, 0xa6, 0x97, 0x5c, 0xa2, 0x24, 0xb4, 0x8b, 0xb0, 0xaf, 0xff
+    };
+
+    verify_slot2(fbd, 7884, expected);
+
+    return CaseNext;
+}
+
+utest::v1::status_t greentea_setup(const size_t number_of_cases) {
+    GREENTEA_SETUP(5*60, "default_auto");
+    return greentea_test_setup_handler(number_of_cases);
+}
+
+Case cases[] = {
+    Case("in_place_window", in_place_window),
+    Case("in_place_recover", in_place_recover),
+    Case("in_place_delta_rejects_unsuitable_diff", in_place_delta_rejects_unsuitable_diff),
+    Case("in_place_delta_update", in_place_delta_update)
+};
+
+Specification specification(greentea_setup, cases);
+
+void blink_led() {
+    static DigitalOut led(LED1);
+    led = !led;
+}
+
+int main() {
+    Ticker t;
+    t.attach(blink_led, 0.5);
+
+    mbed_trace_init();
+
+    return !Harness::run(specification);
+}
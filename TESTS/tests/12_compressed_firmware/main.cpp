@@ -0,0 +1,194 @@
+/*
+ * PackageLicenseDeclared: Apache-2.0
+ * Copyright (c) 2018 ARM Limited
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "mbed.h"
+#include "FragmentationBlockDeviceWrapper.h"
+#include "FragmentationHeatshrinkDecoder.h"
+#include "FragmentationSha256.h"
+#include "BDFile.h"
+#include "test_setup.h"
+#include "utest/utest.h"
+#include "unity/unity.h"
+#include "greentea-client/test_env.h"
+#include "mbed_trace.h"
+
+using namespace utest::v1;
+
+static const char PLAINTEXT[] = "LoRaWAN FUOTA, LoRaWAN FUOTA, LoRaWAN FUOTA - compressed firmware 0000000000000000";
+
+// header byte (window 8 bits, lookahead 4 bits) followed by 'heatshrink -e -w 8 -l 4' output
+static const uint8_t COMPRESSED[] = {
+    0x84, 0xa6, 0x5b, 0xea, 0x56, 0x1a, 0xbd, 0x06, 0x9d, 0x20, 0xa3, 0x55, 0x69, 0xf5, 0x4a, 0x0c,
+    0xb2, 0x40, 0x0e, 0xf0, 0x75, 0xc8, 0x25, 0xb2, 0x0b, 0x1d, 0xbe, 0xdb, 0x70, 0xb9, 0x59, 0x6e,
+    0x77, 0x3b, 0x2d, 0x92, 0x41, 0x66, 0xb4, 0xdc, 0xad, 0xb7, 0x7b, 0x08, 0x30, 0x64, 0x13, 0x00,
+    0x07, 0x00
+};
+
+#define PLAINTEXT_LENGTH    (sizeof(PLAINTEXT) - 1)
+
+static control_t heatshrink_vector(const size_t call_count) {
+    FragmentationHeatshrinkDecoder decoder;
+    TEST_ASSERT_EQUAL(0, decoder.init(8));
+
+    uint8_t out[PLAINTEXT_LENGTH];
+    size_t in_used, out_used;
+    TEST_ASSERT_EQUAL(0, decoder.decode(COMPRESSED, sizeof(COMPRESSED), &in_used, out, sizeof(out), &out_used));
+    TEST_ASSERT_EQUAL(PLAINTEXT_LENGTH, out_used);
+    TEST_ASSERT_EQUAL(true, compare_buffers(out, (const uint8_t*)PLAINTEXT, PLAINTEXT_LENGTH));
+
+    // window larger than what the decoder was initialized for
+    const uint8_t header[] = { 0x94 };
+    decoder.reset();
+    TEST_ASSERT_EQUAL(FRAG_HEATSHRINK_INVALID_HEADER, decoder.decode(header, sizeof(header), &in_used, out, sizeof(out), &out_used));
+
+    return CaseNext;
+}
+
+static control_t heatshrink_byte_by_byte(const size_t call_count) {
+    FragmentationHeatshrinkDecoder decoder;
+    TEST_ASSERT_EQUAL(0, decoder.init(10));
+
+    uint8_t out[PLAINTEXT_LENGTH];
+    size_t in_pos = 0, out_pos = 0;
+
+    // one byte of input and one byte of output space at a time
+    while (out_pos < PLAINTEXT_LENGTH) {
+        size_t in_used, out_used;
+        size_t in_size = in_pos < sizeof(COMPRESSED) ? 1 : 0;
+        TEST_ASSERT_EQUAL(0, decoder.decode(COMPRESSED + in_pos, in_size, &in_used, out + out_pos, 1, &out_used));
+        TEST_ASSERT_EQUAL(true, in_used > 0 || out_used > 0);
+
+        in_pos += in_used;
+        out_pos += out_used;
+    }
+
+    TEST_ASSERT_EQUAL(true, compare_buffers(out, (const uint8_t*)PLAINTEXT, PLAINTEXT_LENGTH));
+
+    return CaseNext;
+}
+
+static control_t decompress_and_hash_in_flash(const size_t call_count) {
+    FragmentationBlockDeviceWrapper fbd(&bd);
+    fbd.init();
+
+    int r = fbd.program(COMPRESSED, MBED_CONF_LORAWAN_UPDATE_CLIENT_SLOT0_FW_ADDRESS, sizeof(COMPRESSED));
+    TEST_ASSERT_EQUAL(BD_ERROR_OK, r);
+
+    FragmentationHeatshrinkDecoder decoder;
+    TEST_ASSERT_EQUAL(0, decoder.init(8));
+
+    BDFILE source(&fbd, MBED_CONF_LORAWAN_UPDATE_CLIENT_SLOT0_FW_ADDRESS, PLAINTEXT_LENGTH);
+    source.set_decompression(&decoder, sizeof(COMPRESSED));
+
+    BDFILE target(&fbd, MBED_CONF_LORAWAN_UPDATE_CLIENT_SLOT1_FW_ADDRESS, 0);
+
+    uint8_t sha_buffer[24];
+    FragmentationSha256 sha256(&fbd, sha_buffer, sizeof(sha_buffer));
+    sha256.start();
+    target.set_hash(&sha256);
+
+    // odd sized chunks, so reads end in the middle of back-references
+    uint8_t buffer[7];
+    size_t bytes_left = PLAINTEXT_LENGTH;
+    while (bytes_left > 0) {
+        size_t length = bytes_left > sizeof(buffer) ? sizeof(buffer) : bytes_left;
+        TEST_ASSERT_EQUAL(length, bd_fread(buffer, 1, length, &source));
+        TEST_ASSERT_EQUAL(length, bd_fwrite(buffer, 1, length, &target));
+        bytes_left -= length;
+    }
+    TEST_ASSERT_EQUAL(0, bd_fflush(&target));
+
+    unsigned char fused_hash[32];
+    unsigned char flash_hash[32];
+    sha256.finish(fused_hash);
+    TEST_ASSERT_EQUAL(PLAINTEXT_LENGTH, target.hashed_length());
+
+    uint8_t flash_content[PLAINTEXT_LENGTH];
+    r = fbd.read(flash_content, MBED_CONF_LORAWAN_UPDATE_CLIENT_SLOT1_FW_ADDRESS, sizeof(flash_content));
+    TEST_ASSERT_EQUAL(BD_ERROR_OK, r);
+    TEST_ASSERT_EQUAL(true, compare_buffers(flash_content, (const uint8_t*)PLAINTEXT, PLAINTEXT_LENGTH));
+
+    sha256.calculate(MBED_CONF_LORAWAN_UPDATE_CLIENT_SLOT1_FW_ADDRESS, PLAINTEXT_LENGTH, flash_hash);
+    TEST_ASSERT_EQUAL(true, compare_buffers(fused_hash, flash_hash, 32));
+
+    // seeking back restarts decompression
+    TEST_ASSERT_EQUAL(0, bd_fseek(&source, 15, SEEK_SET));
+    TEST_ASSERT_EQUAL(sizeof(buffer), bd_fread(buffer, 1, sizeof(buffer), &source));
+    TEST_ASSERT_EQUAL(true, compare_buffers(buffer, (const uint8_t*)PLAINTEXT + 15, sizeof(buffer)));
+
+    return CaseNext;
+}
+
+static control_t decompress_unknown_size(const size_t call_count) {
+    FragmentationBlockDeviceWrapper fbd(&bd);
+    fbd.init();
+
+    int r = fbd.program(COMPRESSED, MBED_CONF_LORAWAN_UPDATE_CLIENT_SLOT0_FW_ADDRESS, sizeof(COMPRESSED));
+    TEST_ASSERT_EQUAL(BD_ERROR_OK, r);
+
+    FragmentationHeatshrinkDecoder decoder;
+    TEST_ASSERT_EQUAL(0, decoder.init(8));
+
+    // compressed diffs only have an upper bound for their size, the end of the compressed data is the end of the file
+    BDFILE source(&fbd, MBED_CONF_LORAWAN_UPDATE_CLIENT_SLOT0_FW_ADDRESS, PLAINTEXT_LENGTH * 4);
+    source.set_decompression(&decoder, sizeof(COMPRESSED));
+
+    uint8_t buffer[32];
+    size_t total = 0;
+    size_t read;
+    while ((read = bd_fread(buffer, 1, sizeof(buffer), &source)) > 0) {
+        TEST_ASSERT_EQUAL(true, compare_buffers(buffer, (const uint8_t*)PLAINTEXT + total, read));
+        total += read;
+    }
+
+    TEST_ASSERT_EQUAL(PLAINTEXT_LENGTH, total);
+    TEST_ASSERT_EQUAL(PLAINTEXT_LENGTH, bd_ftell(&source));
+
+    // reading past the end keeps returning nothing
+    TEST_ASSERT_EQUAL(0, bd_fseek(&source, PLAINTEXT_LENGTH + 10, SEEK_SET));
+    TEST_ASSERT_EQUAL(0, bd_fread(buffer, 1, sizeof(buffer), &source));
+
+    return CaseNext;
+}
+
+utest::v1::status_t greentea_setup(const size_t number_of_cases) {
+    GREENTEA_SETUP(5*60, "default_auto");
+    return greentea_test_setup_handler(number_of_cases);
+}
+
+Case cases[] = {
+    Case("heatshrink_vector", heatshrink_vector),
+    Case("heatshrink_byte_by_byte", heatshrink_byte_by_byte),
+    Case("decompress_and_hash_in_flash", decompress_and_hash_in_flash),
+    Case("decompress_unknown_size", decompress_unknown_size)
+};
+
+Specification specification(greentea_setup, cases);
+
+void blink_led() {
+    static DigitalOut led(LED1);
+    led = !led;
+}
+
+int main() {
+    Ticker t;
+    t.attach(blink_led, 0.5);
+
+    mbed_trace_init();
+
+    return !Harness::run(specification);
+}
@@ -0,0 +1,324 @@
+/*
+ * PackageLicenseDeclared: Apache-2.0
+ * Copyright (c) 2018 ARM Limited
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// checkpoints for the delta updates that go through the update client, well behind the firmware it patches into slot 1
+#undef  MBED_CONF_LORAWAN_UPDATE_CLIENT_DELTA_CHECKPOINT_ADDRESS
+#define MBED_CONF_LORAWAN_UPDATE_CLIENT_DELTA_CHECKPOINT_ADDRESS (MBED_CONF_LORAWAN_UPDATE_CLIENT_SLOT1_HEADER_ADDRESS + 0x21000)
+
+#include "mbed.h"
+#include "packets_diff.h"
+#include "UpdateCerts.h"
+#include "LoRaWANUpdateClient.h"
+#include "FragmentationAesCtr.h"
+#include "FragmentationBlockDeviceWrapper.h"
+#include "FragmentationCheckpoint.h"
+#include "FragmentationSequentialWriter.h"
+#include "FragmentationSha256.h"
+#include "BDFile.h"
+#include "test_setup.h"
+#include "utest/utest.h"
+#include "unity/unity.h"
+#include "greentea-client/test_env.h"
+#include "mbed_trace.h"
+
+using namespace utest::v1;
+
+#define TEST_PAGES  5
+
+// fwd declaration
+static void fake_send_method(LoRaWANUpdateClientSendParams_t &params);
+
+const uint8_t APP_KEY[16] = { 0x0, 0x1, 0x2, 0x3, 0x4, 0x5, 0x6, 0x7, 0x8, 0x9, 0xa, 0xb, 0xc, 0xd, 0xe, 0xf };
+
+const uint8_t FW_KEY[16] = { 0x2b, 0x7e, 0x15, 0x16, 0x28, 0xae, 0xd2, 0xa6, 0xab, 0xf7, 0x15, 0x88, 0x09, 0xcf, 0x4f, 0x3c };
+
+LoRaWANUpdateClient uc(&bd, APP_KEY, fake_send_method);
+
+static bool is_firmware_ready = false;
+
+static void fake_send_method(LoRaWANUpdateClientSendParams_t &params) {
+    printf("Sending %u bytes on port %u: ", params.length, params.port);
+    for (size_t ix = 0; ix < params.length; ix++) {
+        printf("%02x ", params.data[ix]);
+    }
+    printf("\n");
+}
+
+static void lorawan_uc_firmware_ready() {
+    is_firmware_ready = true;
+}
+
+// content of the patched file, byte n is (n * 13 & 0xff)
+static uint8_t new_byte(size_t n) {
+    return (n * 13) & 0xff;
+}
+
+static bd_addr_t target_start(FragmentationBlockDeviceWrapper &fbd) {
+    return ((MBED_CONF_LORAWAN_UPDATE_CLIENT_SLOT1_FW_ADDRESS / fbd.get_page_size()) + 1) * fbd.get_page_size();
+}
+
+static bd_addr_t checkpoint_address(FragmentationBlockDeviceWrapper &fbd) {
+    return target_start(fbd) + ((TEST_PAGES + 1) * fbd.get_page_size());
+}
+
+static bool written_before_checkpoint = false;
+
+static void write_before_checkpoint() {
+    written_before_checkpoint = true;
+}
+
+/**
+ * Write the file from the start, in chunks of 100 bytes, through a sequential writer and with checkpoints every page
+ * @param resume Checkpoint to resume from
+ * @param length Number of bytes to write
+ * @param corrupt Write different data than the original file
+ * @returns number of bytes that were accepted
+ */
+static size_t write_file(FragmentationBlockDeviceWrapper &fbd, FragmentationCheckpoint &log, const FragmentationCheckpoint_t &resume,
+                         size_t length, bool corrupt, FragmentationSha256 *sha256 = NULL, bool *mismatch = NULL) {
+    FragmentationSequentialWriter writer;
+    TEST_ASSERT_EQUAL(BD_ERROR_OK, writer.start(&fbd, target_start(fbd) + resume.target_length,
+        target_start(fbd) + (TEST_PAGES * fbd.get_page_size())));
+
+    BDFILE target(&fbd, target_start(fbd), 0);
+    target.set_sequential_writer(&writer);
+    target.set_checkpoint(&log, resume, fbd.get_page_size());
+    if (sha256) target.set_hash(sha256);
+
+    uint8_t buffer[100];
+    size_t pos = 0;
+    while (pos < length) {
+        size_t chunk = length - pos > sizeof(buffer) ? sizeof(buffer) : length - pos;
+        for (size_t ix = 0; ix < chunk; ix++) {
+            buffer[ix] = new_byte(pos + ix) ^ (corrupt ? 1 : 0);
+        }
+
+        if (bd_fwrite(buffer, 1, chunk, &target) != chunk) break;
+
+        pos += chunk;
+    }
+
+    if (mismatch) *mismatch = target.checkpoint_mismatch();
+
+    return pos;
+}
+
+static control_t checkpoint_log(const size_t call_count) {
+    FragmentationBlockDeviceWrapper fbd(&bd);
+    TEST_ASSERT_EQUAL(BD_ERROR_OK, fbd.init());
+
+    FragmentationCheckpoint_t record;
+    uint32_t count = ((fbd.get_page_size() / sizeof(FragmentationCheckpoint_t)) * 2) + 1;
+
+    {
+        FragmentationCheckpoint log;
+        TEST_ASSERT_EQUAL(BD_ERROR_OK, log.init(&fbd, checkpoint_address(fbd)));
+        TEST_ASSERT_EQUAL(BD_ERROR_OK, log.clear());
+        TEST_ASSERT_EQUAL(0, log.load(&record));
+
+        // enough checkpoints to fill both pages at least once
+        for (uint32_t ix = 1; ix <= count; ix++) {
+            memset(&record, 0, sizeof(FragmentationCheckpoint_t));
+            record.package_size = 1000;
+            record.package_crc = 0x1234;
+            record.target_length = ix;
+            record.target_crc = ix * 3;
+            TEST_ASSERT_EQUAL(BD_ERROR_OK, log.save(&record));
+        }
+    }
+
+    // after a reboot
+    FragmentationCheckpoint log;
+    TEST_ASSERT_EQUAL(BD_ERROR_OK, log.init(&fbd, checkpoint_address(fbd)));
+    TEST_ASSERT_EQUAL(1, log.load(&record));
+    TEST_ASSERT_EQUAL(1000, record.package_size);
+    TEST_ASSERT_EQUAL(count, record.target_length);
+    TEST_ASSERT_EQUAL(count * 3, record.target_crc);
+
+    TEST_ASSERT_EQUAL(BD_ERROR_OK, log.clear());
+    TEST_ASSERT_EQUAL(0, log.load(&record));
+
+    return CaseNext;
+}
+
+static control_t resume_after_power_failure(const size_t call_count) {
+    FragmentationBlockDeviceWrapper fbd(&bd);
+    TEST_ASSERT_EQUAL(BD_ERROR_OK, fbd.init());
+
+    size_t page_size = fbd.get_page_size();
+    size_t length = (TEST_PAGES * page_size) - 10;
+
+    FragmentationCheckpoint log;
+    TEST_ASSERT_EQUAL(BD_ERROR_OK, log.init(&fbd, checkpoint_address(fbd)));
+    TEST_ASSERT_EQUAL(BD_ERROR_OK, log.clear());
+
+    FragmentationCheckpoint_t resume;
+    memset(&resume, 0, sizeof(FragmentationCheckpoint_t));
+    resume.package_size = 1000;
+    resume.package_crc = 0x1234;
+
+    // power fails in the middle of the fourth page
+    size_t interrupted_at = (3 * page_size) + 50;
+    TEST_ASSERT_EQUAL(interrupted_at, write_file(fbd, log, resume, interrupted_at, false));
+
+    TEST_ASSERT_EQUAL(1, log.load(&resume));
+    TEST_ASSERT_EQUAL(1000, resume.package_size);
+    TEST_ASSERT_EQUAL(true, resume.target_length >= 2 * page_size);
+    TEST_ASSERT_EQUAL(true, resume.target_length <= interrupted_at);
+
+    // data that doesn't match the checkpoint is rejected
+    bool mismatch;
+    TEST_ASSERT_EQUAL(true, write_file(fbd, log, resume, length, true, NULL, &mismatch) < resume.target_length);
+    TEST_ASSERT_EQUAL(true, mismatch);
+
+    // resume: the data in front of the checkpoint is not written again, but it's still hashed
+    uint8_t sha_buffer[24];
+    FragmentationSha256 sha256(&fbd, sha_buffer, sizeof(sha_buffer));
+    sha256.start();
+
+    written_before_checkpoint = false;
+    fbd.set_write_watch(target_start(fbd), resume.target_length, callback(write_before_checkpoint));
+
+    TEST_ASSERT_EQUAL(length, write_file(fbd, log, resume, length, false, &sha256, &mismatch));
+    TEST_ASSERT_EQUAL(false, mismatch);
+    TEST_ASSERT_EQUAL(false, written_before_checkpoint);
+    fbd.clear_write_watch();
+
+    uint8_t *page = (uint8_t*)malloc(page_size);
+    TEST_ASSERT_NOT_NULL(page);
+
+    for (size_t p = 0; p < TEST_PAGES; p++) {
+        TEST_ASSERT_EQUAL(BD_ERROR_OK, fbd.read(page, target_start(fbd) + (p * page_size), page_size));
+        for (size_t ix = 0; ix < page_size && (p * page_size) + ix < length; ix++) {
+            TEST_ASSERT_EQUAL(new_byte((p * page_size) + ix), page[ix]);
+        }
+    }
+
+    free(page);
+
+    unsigned char fused_hash[32];
+    unsigned char flash_hash[32];
+    sha256.finish(fused_hash);
+    sha256.calculate(target_start(fbd), length, flash_hash);
+    TEST_ASSERT_EQUAL(true, compare_buffers(fused_hash, flash_hash, 32));
+
+    // checkpoints kept going after the resume position
+    FragmentationCheckpoint_t last;
+    TEST_ASSERT_EQUAL(1, log.load(&last));
+    TEST_ASSERT_EQUAL(true, last.target_length >= 4 * page_size);
+
+    return CaseNext;
+}
+
+static control_t resume_encrypted_delta_after_checkpoint_mismatch(const size_t call_count) {
+    FragmentationBlockDeviceWrapper fbd(&bd);
+    TEST_ASSERT_EQUAL(BD_ERROR_OK, fbd.init());
+
+    // old firmware in slot 2
+    TEST_ASSERT_EQUAL(BD_ERROR_OK, fbd.program(SLOT2_DATA, MBED_CONF_LORAWAN_UPDATE_CLIENT_SLOT2_FW_ADDRESS, SLOT2_DATA_LENGTH));
+
+    arm_uc_firmware_details_t details;
+    details.version = static_cast<uint64_t>(MBED_BUILD_TIMESTAMP);
+    details.size = SLOT2_DATA_LENGTH;
+    memcpy(details.hash, SLOT2_SHA256_HASH, 32);
+    memset(details.campaign, 0, ARM_UC_GUID_SIZE);
+    details.signatureSize = 0;
+    TEST_ASSERT_EQUAL(BD_ERROR_OK, fbd.program(&details, MBED_CONF_LORAWAN_UPDATE_CLIENT_SLOT2_HEADER_ADDRESS, sizeof(arm_uc_firmware_details_t)));
+
+    // the package is in the first 7 (systematic) fragments: 16 bytes of diff, followed by the signature
+    const size_t package_size = (7 * 20) - 11;
+    const size_t diff_size = package_size - FOTA_SIGNATURE_LENGTH;
+    uint8_t package[7 * 20];
+    for (size_t ix = 0; ix < 7; ix++) {
+        memcpy(package + (ix * 20), FAKE_PACKETS[ix] + 3, 20);
+    }
+
+    // encrypt the diff, the signature is over the patched firmware so it stays valid
+    UpdateSignature_t *header = (UpdateSignature_t*)(package + diff_size);
+    ((uint8_t*)&header->diff_info)[0] |= FOTA_DIFF_INFO_ENCRYPTED;
+
+    FragmentationAesCtr aes_ctr;
+    TEST_ASSERT_EQUAL(true, aes_ctr.setup(FW_KEY, header->signature + header->signature_length - 16));
+    TEST_ASSERT_EQUAL(true, aes_ctr.decrypt(0, package, diff_size));
+
+    TEST_ASSERT_EQUAL(BD_ERROR_OK, fbd.program(package, MBED_CONF_LORAWAN_UPDATE_CLIENT_SLOT0_FW_ADDRESS, package_size));
+
+    // a checkpoint for this package, but the patched firmware in slot 1 does not match it
+    FragmentationCheckpoint log;
+    TEST_ASSERT_EQUAL(BD_ERROR_OK, log.init(&fbd, MBED_CONF_LORAWAN_UPDATE_CLIENT_DELTA_CHECKPOINT_ADDRESS));
+    TEST_ASSERT_EQUAL(BD_ERROR_OK, log.clear());
+
+    FragmentationCheckpoint_t record;
+    memset(&record, 0, sizeof(FragmentationCheckpoint_t));
+    record.package_size = package_size;
+    record.package_crc = crc32(0, package + diff_size, FOTA_SIGNATURE_LENGTH);
+    record.target_length = fbd.get_page_size();
+    record.target_crc = 0x1234;
+    TEST_ASSERT_EQUAL(BD_ERROR_OK, log.save(&record));
+
+    // the update starts over after the mismatch, with the same decryption session
+    is_firmware_ready = false;
+    uc.callbacks.firmwareReady = lorawan_uc_firmware_ready;
+    uc.setFirmwareDecryptionKey(FW_KEY);
+
+    TEST_ASSERT_EQUAL(LW_UC_OK, uc.resumeDeltaUpdate());
+    TEST_ASSERT_EQUAL(true, is_firmware_ready);
+
+    // output from shasum -a 256 xdot-l151cc-blinky-application-v2.bin
+    const uint8_t expected[] = {
+        0x64, 0x3c, 0x1d, 0x63, 0x5b, 0x0c, 0xa8, 0xd3, 0x90, 0x8a, 0x60, 0x80, 0x03, 0xd0, 0xcb, 0x61,
+        0x31, 0xd4, 0xf9, 0x47, 0xbe, 0xec, 0xa6, 0x97, 0x5c, 0xa2, 0x24, 0xb4, 0x8b, 0xb0, 0xaf, 0xff
+    };
+
+    unsigned char hash[32];
+    uint8_t sha_buffer[LW_UC_SHA256_BUFFER_SIZE];
+    FragmentationSha256 sha256(&fbd, sha_buffer, sizeof(sha_buffer));
+    sha256.calculate(MBED_CONF_LORAWAN_UPDATE_CLIENT_SLOT1_FW_ADDRESS, 7884, hash);
+    TEST_ASSERT_EQUAL(true, compare_buffers(hash, expected, 32));
+
+    // done, nothing left to resume
+    TEST_ASSERT_EQUAL(0, log.load(&record));
+
+    return CaseNext;
+}
+
+utest::v1::status_t greentea_setup(const size_t number_of_cases) {
+    GREENTEA_SETUP(5*60, "default_auto");
+    return greentea_test_setup_handler(number_of_cases);
+}
+
+Case cases[] = {
+    Case("checkpoint_log", checkpoint_log),
+    Case("resume_after_power_failure", resume_after_power_failure),
+    Case("resume_encrypted_delta_after_checkpoint_mismatch", resume_encrypted_delta_after_checkpoint_mismatch)
+};
+
+Specification specification(greentea_setup, cases);
+
+void blink_led() {
+    static DigitalOut led(LED1);
+    led = !led;
+}
+
+int main() {
+    Ticker t;
+    t.attach(blink_led, 0.5);
+
+    mbed_trace_init();
+
+    return !Harness::run(specification);
+}
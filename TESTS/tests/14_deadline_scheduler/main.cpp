@@ -0,0 +1,187 @@
+/*
+ * PackageLicenseDeclared: Apache-2.0
+ * Copyright (c) 2018 ARM Limited
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "mbed.h"
+#include "DeadlineScheduler.h"
+#include "update_types.h"
+#include "utest/utest.h"
+#include "unity/unity.h"
+#include "greentea-client/test_env.h"
+#include "mbed_trace.h"
+
+using namespace utest::v1;
+
+#define MAX_FIRED   16
+
+// events in the order in which they were handled, owner in the high nibble and type in the low nibble
+static volatile uint8_t fired[MAX_FIRED];
+static volatile size_t fired_count = 0;
+
+static void handler(uint8_t owner, uint8_t type) {
+    if (fired_count < MAX_FIRED) {
+        fired[fired_count] = (owner << 4) | type;
+    }
+    fired_count++;
+}
+
+static uint8_t ev(uint8_t owner, uint8_t type) {
+    return (owner << 4) | type;
+}
+
+static control_t overlapping_groups(const size_t call_count) {
+    DeadlineScheduler<8> scheduler;
+    scheduler.set_handler(callback(handler));
+    fired_count = 0;
+
+    // four groups with overlapping class C windows, scheduled out of order
+    TEST_ASSERT_EQUAL(true, scheduler.schedule(0, LW_UC_MC_EVENT_START, 100000));
+    TEST_ASSERT_EQUAL(true, scheduler.schedule(0, LW_UC_MC_EVENT_TIMEOUT, 700000));
+    TEST_ASSERT_EQUAL(true, scheduler.schedule(1, LW_UC_MC_EVENT_START, 300000));
+    TEST_ASSERT_EQUAL(true, scheduler.schedule(1, LW_UC_MC_EVENT_TIMEOUT, 500000));
+    TEST_ASSERT_EQUAL(true, scheduler.schedule(2, LW_UC_MC_EVENT_START, 200000));
+    TEST_ASSERT_EQUAL(true, scheduler.schedule(2, LW_UC_MC_EVENT_TIMEOUT, 600000));
+    TEST_ASSERT_EQUAL(true, scheduler.schedule(3, LW_UC_MC_EVENT_START, 400000));
+    TEST_ASSERT_EQUAL(true, scheduler.schedule(3, LW_UC_MC_EVENT_TIMEOUT, 800000));
+    TEST_ASSERT_EQUAL(8, scheduler.size());
+
+    // full
+    TEST_ASSERT_EQUAL(false, scheduler.schedule(4, LW_UC_MC_EVENT_START, 100000));
+
+    wait_ms(450);
+    TEST_ASSERT_EQUAL(4, fired_count);
+    TEST_ASSERT_EQUAL(ev(0, LW_UC_MC_EVENT_START), fired[0]);
+    TEST_ASSERT_EQUAL(ev(2, LW_UC_MC_EVENT_START), fired[1]);
+    TEST_ASSERT_EQUAL(ev(1, LW_UC_MC_EVENT_START), fired[2]);
+    TEST_ASSERT_EQUAL(ev(3, LW_UC_MC_EVENT_START), fired[3]);
+
+    wait_ms(400);
+    TEST_ASSERT_EQUAL(8, fired_count);
+    TEST_ASSERT_EQUAL(ev(1, LW_UC_MC_EVENT_TIMEOUT), fired[4]);
+    TEST_ASSERT_EQUAL(ev(2, LW_UC_MC_EVENT_TIMEOUT), fired[5]);
+    TEST_ASSERT_EQUAL(ev(0, LW_UC_MC_EVENT_TIMEOUT), fired[6]);
+    TEST_ASSERT_EQUAL(ev(3, LW_UC_MC_EVENT_TIMEOUT), fired[7]);
+    TEST_ASSERT_EQUAL(0, scheduler.size());
+
+    return CaseNext;
+}
+
+static control_t reschedule_and_cancel(const size_t call_count) {
+    DeadlineScheduler<8> scheduler;
+    scheduler.set_handler(callback(handler));
+    fired_count = 0;
+
+    scheduler.schedule(0, LW_UC_MC_EVENT_TIMEOUT, 200000);
+    scheduler.schedule(1, LW_UC_MC_EVENT_START, 250000);
+    scheduler.schedule(1, LW_UC_MC_EVENT_TIMEOUT, 300000);
+
+    // moving the deadline replaces the pending event
+    scheduler.schedule(0, LW_UC_MC_EVENT_TIMEOUT, 400000);
+    TEST_ASSERT_EQUAL(3, scheduler.size());
+
+    scheduler.cancel_all(1);
+    TEST_ASSERT_EQUAL(false, scheduler.is_scheduled(1, LW_UC_MC_EVENT_START));
+    TEST_ASSERT_EQUAL(true, scheduler.is_scheduled(0, LW_UC_MC_EVENT_TIMEOUT));
+
+    wait_ms(330);
+    TEST_ASSERT_EQUAL(0, fired_count);
+
+    wait_ms(150);
+    TEST_ASSERT_EQUAL(1, fired_count);
+    TEST_ASSERT_EQUAL(ev(0, LW_UC_MC_EVENT_TIMEOUT), fired[0]);
+
+    return CaseNext;
+}
+
+static control_t absolute_deadlines(const size_t call_count) {
+    DeadlineScheduler<8> scheduler;
+    scheduler.set_handler(callback(handler));
+    fired_count = 0;
+
+    // the timeout is 2^15 seconds out, where a float of seconds would no longer hold whole milliseconds
+    uint64_t base = scheduler.now_us() + 100000;
+    scheduler.schedule_at(0, LW_UC_MC_EVENT_START, base);
+    scheduler.schedule_at(0, LW_UC_MC_EVENT_TIMEOUT, base + (32768ULL * 1000000ULL));
+    scheduler.schedule_at(1, LW_UC_MC_EVENT_START, base + 200000);
+
+    wait_ms(150);
+    TEST_ASSERT_EQUAL(1, fired_count);
+    TEST_ASSERT_EQUAL(ev(0, LW_UC_MC_EVENT_START), fired[0]);
+
+    wait_ms(200);
+    TEST_ASSERT_EQUAL(2, fired_count);
+    TEST_ASSERT_EQUAL(ev(1, LW_UC_MC_EVENT_START), fired[1]);
+
+    TEST_ASSERT_EQUAL(true, scheduler.is_scheduled(0, LW_UC_MC_EVENT_TIMEOUT));
+    scheduler.cancel_all(0);
+    TEST_ASSERT_EQUAL(0, scheduler.size());
+
+    return CaseNext;
+}
+
+static control_t dispatch_through_event_queue(const size_t call_count) {
+    EventQueue queue(8 * EVENTS_EVENT_SIZE);
+
+    DeadlineScheduler<8> scheduler;
+    scheduler.set_handler(callback(handler));
+    scheduler.set_event_queue(&queue);
+    fired_count = 0;
+
+    scheduler.schedule(2, LW_UC_MC_EVENT_START, 50000);
+
+    // due, but only handled when the queue is dispatched
+    wait_ms(100);
+    TEST_ASSERT_EQUAL(0, fired_count);
+    TEST_ASSERT_EQUAL(0, scheduler.size());
+
+    queue.dispatch(0);
+    TEST_ASSERT_EQUAL(1, fired_count);
+    TEST_ASSERT_EQUAL(ev(2, LW_UC_MC_EVENT_START), fired[0]);
+
+    // the event waited in the queue for about 50 ms
+    DeadlineSchedulerStats_t stats;
+    scheduler.get_stats(&stats);
+    TEST_ASSERT_EQUAL(1, stats.count);
+    TEST_ASSERT_EQUAL(true, stats.max_latency_us >= 40000);
+    TEST_ASSERT_EQUAL(stats.max_latency_us, stats.last_latency_us);
+
+    scheduler.reset_stats();
+    scheduler.get_stats(&stats);
+    TEST_ASSERT_EQUAL(0, stats.count);
+    TEST_ASSERT_EQUAL(0, stats.max_latency_us);
+
+    return CaseNext;
+}
+
+utest::v1::status_t greentea_setup(const size_t number_of_cases) {
+    GREENTEA_SETUP(5*60, "default_auto");
+    return greentea_test_setup_handler(number_of_cases);
+}
+
+Case cases[] = {
+    Case("overlapping_groups", overlapping_groups),
+    Case("reschedule_and_cancel", reschedule_and_cancel),
+    Case("absolute_deadlines", absolute_deadlines),
+    Case("dispatch_through_event_queue", dispatch_through_event_queue)
+};
+
+Specification specification(greentea_setup, cases);
+
+int main() {
+    mbed_trace_init();
+
+    return !Harness::run(specification);
+}
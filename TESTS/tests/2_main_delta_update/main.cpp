@@ -63,6 +63,21 @@ static void lorawan_uc_firmware_ready() {
     printf("Firmware is ready - reset the device to flash new firmware...\n");
 }
 
+// bit per phase that reported completion
+static uint32_t completed_phases = 0;
+static bool progress_out_of_range = false;
+
+static void lorawan_uc_progress(LoRaWANUpdateClientProgress_t *progress) {
+    if (progress->processed > progress->total) {
+        progress_out_of_range = true;
+    }
+
+    if (progress->processed == progress->total) {
+        printf("Phase %d done, %u bytes in %llu us\n", progress->phase, progress->total, progress->elapsed_us);
+        completed_phases |= 1 << progress->phase;
+    }
+}
+
 static control_t delta_update(const size_t call_count) {
     // Copy data into slot 2
     {
@@ -94,6 +109,7 @@ static control_t delta_update(const size_t call_count) {
 
     uc.callbacks.fragSessionComplete = lorawan_uc_fragsession_complete;
     uc.callbacks.firmwareReady = lorawan_uc_firmware_ready;
+    uc.callbacks.progress = lorawan_uc_progress;
 
     status = uc.handleFragmentationCommand(0x0, (uint8_t*)FAKE_PACKETS_HEADER, sizeof(FAKE_PACKETS_HEADER));
     TEST_ASSERT_EQUAL(LW_UC_OK, status);
@@ -115,6 +131,12 @@ static control_t delta_update(const size_t call_count) {
         wait_ms(20); // @todo: this is really weird, writing these in quick succession leads to corrupt image... need to investigate.
     }
 
+    TEST_ASSERT_EQUAL(false, progress_out_of_range);
+    TEST_ASSERT_EQUAL(true, (completed_phases & (1 << LW_UC_PROGRESS_DECODE)) != 0);
+    TEST_ASSERT_EQUAL(true, (completed_phases & (1 << LW_UC_PROGRESS_HASH)) != 0);
+    TEST_ASSERT_EQUAL(true, (completed_phases & (1 << LW_UC_PROGRESS_PATCH)) != 0);
+    TEST_ASSERT_EQUAL(true, (completed_phases & (1 << LW_UC_PROGRESS_HEADER)) != 0);
+
     return CaseNext;
 }
 
@@ -162,6 +184,45 @@ static control_t verify_firmware_in_slot1(const size_t call_count) {
     return CaseNext;
 }
 
+static control_t copy_application_to_slot2(const size_t call_count) {
+#if DEVICE_FLASH
+    FragmentationBlockDeviceWrapper fbd(&bd);
+    fbd.init();
+
+    FlashIAP flash;
+    TEST_ASSERT_EQUAL(0, flash.init());
+    uint32_t flash_start = flash.get_flash_start();
+    uint32_t flash_page_size = flash.get_page_size();
+    flash.deinit();
+
+    // ends in the middle of a page
+    size_t length = (fbd.get_page_size() * 2) + 100;
+
+    unsigned char copy_hash[32];
+    size_t pages_written;
+    int r = copy_flash_to_blockdevice(flash_page_size, flash_start, length, &fbd,
+        MBED_CONF_LORAWAN_UPDATE_CLIENT_SLOT2_FW_ADDRESS, copy_hash, &pages_written);
+    TEST_ASSERT_EQUAL(MBED_DELTA_UPDATE_OK, r);
+
+    unsigned char flash_hash[32];
+    uint8_t sha_buffer[LW_UC_SHA256_BUFFER_SIZE];
+    FragmentationSha256* sha256 = new FragmentationSha256(&fbd, sha_buffer, sizeof(sha_buffer));
+    sha256->calculate(MBED_CONF_LORAWAN_UPDATE_CLIENT_SLOT2_FW_ADDRESS, length, flash_hash);
+    delete sha256;
+
+    TEST_ASSERT_EQUAL(true, compare_buffers(copy_hash, flash_hash, 32));
+
+    // slot 2 holds the same data now, so copying again does not write anything
+    r = copy_flash_to_blockdevice(flash_page_size, flash_start, length, &fbd,
+        MBED_CONF_LORAWAN_UPDATE_CLIENT_SLOT2_FW_ADDRESS, copy_hash, &pages_written);
+    TEST_ASSERT_EQUAL(MBED_DELTA_UPDATE_OK, r);
+    TEST_ASSERT_EQUAL(0, pages_written);
+    TEST_ASSERT_EQUAL(true, compare_buffers(copy_hash, flash_hash, 32));
+#endif
+
+    return CaseNext;
+}
+
 utest::v1::status_t greentea_setup(const size_t number_of_cases) {
     GREENTEA_SETUP(5*60, "default_auto");
     return greentea_test_setup_handler(number_of_cases);
@@ -169,7 +230,8 @@ utest::v1::status_t greentea_setup(const size_t number_of_cases) {
 
 Case cases[] = {
     Case("delta update", delta_update),
-    Case("verify firmware", verify_firmware_in_slot1)
+    Case("verify firmware", verify_firmware_in_slot1),
+    Case("copy application to slot 2", copy_application_to_slot2)
 };
 
 Specification specification(greentea_setup, cases);
@@ -118,6 +118,43 @@ static control_t get_status(const size_t call_count) {
     return CaseNext;
 }
 
+static control_t get_status_over_multicast(const size_t call_count) {
+    LW_UC_STATUS status;
+
+    const uint8_t mc_setup_header[] = { 0x2, 0b00,
+        0x3e, 0xaa, 0x24, 0x18, /* mcaddr */
+        0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17, 0x18, 0x19, 0x20, 0x21, 0x22, 0x23, 0x24, 0x25, /* mcKey_Encrypted */
+        0x3, 0x0, 0x0, 0x0, /* minFcCount */
+        0x2, 0x10, 0x0, 0x0 /* maxFcCount */
+    };
+    status = uc.handleMulticastControlCommand((uint8_t*)mc_setup_header, sizeof(mc_setup_header));
+    TEST_ASSERT_EQUAL(LW_UC_OK, status);
+
+    last_message.length = 0;
+
+    // over multicast the answer waits for a random delay of up to 2^(BlockAckDelay+4) seconds, BlockAckDelay is 0 here
+    const uint8_t header[] = { 0x1, 0b00000001 };
+    status = uc.handleFragmentationCommand(0x1824aa3e, (uint8_t*)header, sizeof(header));
+
+    TEST_ASSERT_EQUAL(LW_UC_OK, status);
+    TEST_ASSERT_EQUAL(0, last_message.length);
+
+    wait_ms(16500);
+
+    // the scheduler only queues the answer, it's sent from the application thread
+    TEST_ASSERT_EQUAL(0, last_message.length);
+    TEST_ASSERT_EQUAL(1, uc.getOutboundQueueDepth());
+    TEST_ASSERT_EQUAL(LW_UC_OK, uc.sendNextOutbound());
+
+    TEST_ASSERT_EQUAL(201, last_message.port);
+    TEST_ASSERT_EQUAL(5, last_message.length);
+    TEST_ASSERT_EQUAL(0x1, last_message.data[0]);
+    TEST_ASSERT_EQUAL(3, last_message.data[2]);
+    TEST_ASSERT_EQUAL(2, last_message.data[3]);
+
+    return CaseNext;
+}
+
 static control_t delete_session(const size_t call_count) {
     LW_UC_STATUS status;
     const uint8_t header[] = { 0x3, 0 };
@@ -176,6 +213,7 @@ Case cases[] = {
     Case("invalid_index", invalid_index),
     Case("create_session", create_session),
     Case("get_status", get_status),
+    Case("get_status_over_multicast", get_status_over_multicast),
     Case("delete_session", delete_session),
     Case("delete_invalid_session", delete_invalid_session),
     Case("get_package_version", get_package_version)
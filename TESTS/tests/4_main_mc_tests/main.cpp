@@ -292,6 +292,81 @@ static control_t session_in_past_should_start_directly(const size_t call_count)
     return CaseNext;
 }
 
+static control_t batch_setup_mc_groups(const size_t call_count) {
+    LW_UC_STATUS status;
+
+    // two McGroupSetupReq commands in one downlink, second one has an index that is not supported
+    const uint8_t header[] = {
+        0x2, 0b00,
+        0x3e, 0xaa, 0x24, 0x18, /* mcaddr */
+        0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17, 0x18, 0x19, 0x20, 0x21, 0x22, 0x23, 0x24, 0x25, /* mcKey_Encrypted */
+        0x3, 0x0, 0x0, 0x0, /* minFcCount */
+        0x2, 0x10, 0x0, 0x0, /* maxFcCount */
+        0x2, 0b01,
+        0x3f, 0xaa, 0x24, 0x18, /* mcaddr */
+        0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17, 0x18, 0x19, 0x20, 0x21, 0x22, 0x23, 0x24, 0x25, /* mcKey_Encrypted */
+        0x3, 0x0, 0x0, 0x0, /* minFcCount */
+        0x2, 0x10, 0x0, 0x0 /* maxFcCount */
+    };
+    status = uc.handleMulticastControlCommand((uint8_t*)header, sizeof(header));
+
+    TEST_ASSERT_EQUAL(LW_UC_OK, status);
+    TEST_ASSERT_EQUAL(last_message.port, 200);
+    TEST_ASSERT_EQUAL(last_message.length, 4);
+    TEST_ASSERT_EQUAL(last_message.data[0], 2);
+    TEST_ASSERT_EQUAL(last_message.data[1], 0);
+    TEST_ASSERT_EQUAL(last_message.data[2], 2);
+    TEST_ASSERT_EQUAL(last_message.data[3], 0b101);
+
+    return CaseNext;
+}
+
+static control_t deferred_outbound_queue(const size_t call_count) {
+    LW_UC_STATUS status;
+
+    uc.resetStats();
+    uc.setOutboundDeferred(true);
+    last_message.length = 0;
+
+    const uint8_t package_version[] = { 0x0 };
+    status = uc.handleMulticastControlCommand((uint8_t*)package_version, sizeof(package_version));
+    TEST_ASSERT_EQUAL(LW_UC_OK, status);
+
+    // both answers go in one uplink
+    const uint8_t delete_invalid[] = { 0x3, 0b10 };
+    status = uc.handleMulticastControlCommand((uint8_t*)delete_invalid, sizeof(delete_invalid));
+    TEST_ASSERT_EQUAL(LW_UC_OK, status);
+    status = uc.handleMulticastControlCommand((uint8_t*)delete_invalid, sizeof(delete_invalid));
+    TEST_ASSERT_EQUAL(LW_UC_OK, status);
+
+    TEST_ASSERT_EQUAL(0, last_message.length);
+    TEST_ASSERT_EQUAL(2, uc.getOutboundQueueDepth());
+
+    // the package version answer has a lower priority
+    TEST_ASSERT_EQUAL(LW_UC_OK, uc.sendNextOutbound());
+    TEST_ASSERT_EQUAL(200, last_message.port);
+    TEST_ASSERT_EQUAL(4, last_message.length);
+    TEST_ASSERT_EQUAL(3, last_message.data[0]);
+    TEST_ASSERT_EQUAL(0b110, last_message.data[1]);
+    TEST_ASSERT_EQUAL(3, last_message.data[2]);
+    TEST_ASSERT_EQUAL(0b110, last_message.data[3]);
+
+    TEST_ASSERT_EQUAL(LW_UC_OK, uc.sendNextOutbound());
+    TEST_ASSERT_EQUAL(3, last_message.length);
+    TEST_ASSERT_EQUAL(0, last_message.data[0]);
+
+    TEST_ASSERT_EQUAL(LW_UC_OUTBOUND_QUEUE_EMPTY, uc.sendNextOutbound());
+
+    LoRaWANUpdateClientStats_t stats;
+    uc.getStats(&stats);
+    TEST_ASSERT_EQUAL(1, stats.outboundCoalesced);
+    TEST_ASSERT_EQUAL(0, stats.outboundQueueDepth);
+
+    uc.setOutboundDeferred(false);
+
+    return CaseNext;
+}
+
 utest::v1::status_t greentea_setup(const size_t number_of_cases) {
     GREENTEA_SETUP(5*60, "default_auto");
     return greentea_test_setup_handler(number_of_cases);
@@ -309,7 +384,9 @@ Case cases[] = {
     Case("get_status_active_group", get_status_active_group),
     Case("start_inactive_classc_request", start_inactive_classc_request),
     Case("start_active_classc_request", start_active_classc_request),
-    Case("session_in_past_should_start_directly", session_in_past_should_start_directly)
+    Case("session_in_past_should_start_directly", session_in_past_should_start_directly),
+    Case("batch_setup_mc_groups", batch_setup_mc_groups),
+    Case("deferred_outbound_queue", deferred_outbound_queue)
 };
 
 Specification specification(greentea_setup, cases);
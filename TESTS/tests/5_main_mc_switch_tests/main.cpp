@@ -163,6 +163,35 @@ static control_t getting_datafragments_should_reset(const size_t call_count) {
     return CaseNext;
 }
 
+static control_t frame_counter_window(const size_t call_count) {
+    LoRaWANUpdateClientStats_t stats;
+    uc.resetStats();
+
+    uint8_t dataFragPacket[] = { 0x8, 0x3, 0x3, 0x3 };
+
+    // window of the group is [3, 0x1002)
+    TEST_ASSERT_EQUAL(LW_UC_MC_FRAME_COUNTER_OUT_OF_WINDOW, uc.handleFragmentationCommand(0x1824aa3e, dataFragPacket, sizeof(dataFragPacket), 2));
+    TEST_ASSERT_EQUAL(LW_UC_MC_FRAME_COUNTER_OUT_OF_WINDOW, uc.handleFragmentationCommand(0x1824aa3e, dataFragPacket, sizeof(dataFragPacket), 0x1002));
+
+    // in the window, so it reaches the fragmentation session
+    TEST_ASSERT_EQUAL(LW_UC_FRAG_SESSION_NOT_ACTIVE, uc.handleFragmentationCommand(0x1824aa3e, dataFragPacket, sizeof(dataFragPacket), 10));
+
+    // same and earlier frame counters were already received
+    TEST_ASSERT_EQUAL(LW_UC_MC_FRAME_COUNTER_REPLAYED, uc.handleFragmentationCommand(0x1824aa3e, dataFragPacket, sizeof(dataFragPacket), 10));
+    TEST_ASSERT_EQUAL(LW_UC_MC_FRAME_COUNTER_REPLAYED, uc.handleFragmentationCommand(0x1824aa3e, dataFragPacket, sizeof(dataFragPacket), 5));
+
+    TEST_ASSERT_EQUAL(LW_UC_FRAG_SESSION_NOT_ACTIVE, uc.handleFragmentationCommand(0x1824aa3e, dataFragPacket, sizeof(dataFragPacket), 11));
+
+    // unicast frames are not checked against a multicast window
+    TEST_ASSERT_EQUAL(LW_UC_FRAG_SESSION_NOT_ACTIVE, uc.handleFragmentationCommand(0x0, dataFragPacket, sizeof(dataFragPacket), 1));
+
+    uc.getStats(&stats);
+    TEST_ASSERT_EQUAL(2, stats.mcFramesOutOfWindow);
+    TEST_ASSERT_EQUAL(2, stats.mcFramesReplayed);
+
+    return CaseNext;
+}
+
 utest::v1::status_t greentea_setup(const size_t number_of_cases) {
     GREENTEA_SETUP(5*60, "default_auto");
     return greentea_test_setup_handler(number_of_cases);
@@ -170,7 +199,8 @@ utest::v1::status_t greentea_setup(const size_t number_of_cases) {
 
 Case cases[] = {
     Case("start_active_classc_session_request", start_active_classc_session_request),
-    Case("getting_datafragments_should_reset", getting_datafragments_should_reset)
+    Case("getting_datafragments_should_reset", getting_datafragments_should_reset),
+    Case("frame_counter_window", frame_counter_window)
 };
 
 Specification specification(greentea_setup, cases);
@@ -15,6 +15,10 @@
  * limitations under the License.
  */
 
+// space the retransmissions of a ForceDeviceResyncReq 2..3 seconds apart
+#define LW_UC_CLOCK_RESYNC_INTERVAL     2
+#define LW_UC_CLOCK_RESYNC_JITTER       1
+
 #include "mbed.h"
 #include "packets.h"
 #include "UpdateCerts.h"
@@ -41,7 +45,9 @@ typedef struct {
 } send_message_t;
 
 static send_message_t last_message;
+static volatile size_t send_count = 0;
 static bool in_class_c = false;
+static volatile bool outbound_pending = false;
 
 void switch_to_class_a() {
     in_class_c = false;
@@ -51,10 +57,15 @@ void switch_to_class_c(LoRaWANUpdateClientClassCSession_t*) {
     in_class_c = true;
 }
 
+void outbound_pending_cb() {
+    outbound_pending = true;
+}
+
 static void fake_send_method(LoRaWANUpdateClientSendParams_t &params) {
     last_message.port = params.port;
     memcpy(last_message.data, params.data, params.length);
     last_message.length = params.length;
+    send_count++;
 }
 
 static uint64_t gpsTime = 1214658125; // Tue Jul 03 2018 21:02:35 GMT+0800
@@ -66,6 +77,7 @@ void setup() {
     // !!! DO NOT DO BLOCKING THINGS IN THEM !!!
     uc.callbacks.switchToClassA = switch_to_class_a;
     uc.callbacks.switchToClassC = switch_to_class_c;
+    uc.callbacks.outboundPending = outbound_pending_cb;
 
     wait_ms(2000); // 2 seconds delay to make sure the clock is forward
 }
@@ -126,6 +138,24 @@ static control_t should_handle_forcedevicesyncreq(const size_t call_count) {
     return CaseNext;
 }
 
+static control_t should_honour_periodicityreq(const size_t call_count) {
+    uint8_t header[] = { 2, 0b0011 /* period, 128 * 2^3 seconds */ };
+    status = uc.handleClockSyncCommand(header, sizeof(header));
+    TEST_ASSERT_EQUAL(status, LW_UC_OK);
+    TEST_ASSERT_EQUAL(last_message.port, 202);
+    TEST_ASSERT_EQUAL(last_message.length, 6);
+    TEST_ASSERT_EQUAL(last_message.data[0], 2);
+    TEST_ASSERT_EQUAL(last_message.data[1], 0); // supported
+
+    uint32_t curr_time = (last_message.data[5] << 24) + (last_message.data[4] << 16) + (last_message.data[3] << 8) + last_message.data[2];
+    TEST_ASSERT(curr_time - (gpsTime - 2400) < 6);
+
+    // not enough time between the syncs to estimate the drift
+    TEST_ASSERT_EQUAL(0, uc.getClockDriftPpm());
+
+    return CaseNext;
+}
+
 static control_t should_update_mc_during_clocksync(const size_t call_count) {
     uc.outOfBandClockSync(gpsTime);
 
@@ -173,6 +203,39 @@ static control_t should_update_mc_during_clocksync(const size_t call_count) {
     return CaseNext;
 }
 
+static control_t should_retry_forcedevicesyncreq(const size_t call_count) {
+    send_count = 0;
+
+    uint8_t header[] = { 3, 0b011 /* nbTrans */ };
+    status = uc.handleClockSyncCommand(header, sizeof(header));
+    TEST_ASSERT_EQUAL(status, LW_UC_OK);
+    TEST_ASSERT_EQUAL(1, send_count);
+
+    // second transmission after 2..3 seconds, queued by the scheduler and sent from this thread
+    wait_ms(3200);
+    TEST_ASSERT_EQUAL(1, send_count);
+    TEST_ASSERT_EQUAL(true, outbound_pending);
+    outbound_pending = false;
+
+    TEST_ASSERT_EQUAL(LW_UC_OK, uc.sendNextOutbound());
+    TEST_ASSERT_EQUAL(2, send_count);
+    TEST_ASSERT_EQUAL(last_message.port, 202);
+    TEST_ASSERT_EQUAL(last_message.data[0], 1);
+    TEST_ASSERT_EQUAL(last_message.data[5], 0b00010);
+
+    // valid answer cancels the third transmission
+    int32_t adjust = 0;
+    uint8_t adjustHeader[] = { 1, adjust & 0xff, (adjust >> 8) & 0xff, (adjust >> 16) & 0xff, (adjust >> 24) & 0xff, 0b0010 /* tokenAns */ };
+    status = uc.handleClockSyncCommand(adjustHeader, sizeof(adjustHeader));
+    TEST_ASSERT_EQUAL(status, LW_UC_OK);
+
+    wait_ms(3200);
+    TEST_ASSERT_EQUAL(false, outbound_pending);
+    TEST_ASSERT_EQUAL(LW_UC_OUTBOUND_QUEUE_EMPTY, uc.sendNextOutbound());
+    TEST_ASSERT_EQUAL(2, send_count);
+
+    return CaseNext;
+}
 
 utest::v1::status_t greentea_setup(const size_t number_of_cases) {
     GREENTEA_SETUP(5*60, "default_auto");
@@ -184,7 +247,9 @@ Case cases[] = {
     Case("response_should_adjust_time", response_should_adjust_time),
     Case("response_should_up_tokenans", response_should_up_tokenans),
     Case("should_handle_forcedevicesyncreq", should_handle_forcedevicesyncreq),
-    Case("should_update_mc_during_clocksync", should_update_mc_during_clocksync)
+    Case("should_honour_periodicityreq", should_honour_periodicityreq),
+    Case("should_update_mc_during_clocksync", should_update_mc_during_clocksync),
+    Case("should_retry_forcedevicesyncreq", should_retry_forcedevicesyncreq)
 };
 
 Specification specification(greentea_setup, cases);
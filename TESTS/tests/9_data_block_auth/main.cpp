@@ -0,0 +1,313 @@
+/*
+ * PackageLicenseDeclared: Apache-2.0
+ * Copyright (c) 2018 ARM Limited
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// the data block is only verified and applied after a DataBlockAuthAns
+#undef  MBED_CONF_LORAWAN_UPDATE_CLIENT_DATA_BLOCK_AUTH
+#define MBED_CONF_LORAWAN_UPDATE_CLIENT_DATA_BLOCK_AUTH 1
+
+#include "mbed.h"
+#include "packets.h"
+#include "UpdateCerts.h"
+#include "LoRaWANUpdateClient.h"
+#include "FragmentationBlockDeviceWrapper.h"
+#include "FragmentationCmac.h"
+#include "test_setup.h"
+#include "utest/utest.h"
+#include "unity/unity.h"
+#include "greentea-client/test_env.h"
+
+using namespace utest::v1;
+
+// fwd declaration
+static void fake_send_method(LoRaWANUpdateClientSendParams_t &params);
+
+const uint8_t APP_KEY[16] = { 0x0, 0x1, 0x2, 0x3, 0x4, 0x5, 0x6, 0x7, 0x8, 0x9, 0xa, 0xb, 0xc, 0xd, 0xe, 0xf };
+
+LoRaWANUpdateClient uc(&bd, APP_KEY, fake_send_method);
+
+typedef struct {
+    uint8_t port;
+    uint8_t data[255];
+    size_t length;
+} send_message_t;
+
+static send_message_t last_message;
+static bool is_complete = false;
+static bool is_fw_ready = false;
+
+static void fake_send_method(LoRaWANUpdateClientSendParams_t &params) {
+    last_message.port = params.port;
+    memcpy(last_message.data, params.data, params.length);
+    last_message.length = params.length;
+}
+
+static void lorawan_uc_fragsession_complete() {
+    is_complete = true;
+}
+
+static void lorawan_uc_firmware_ready() {
+    is_fw_ready = true;
+}
+
+// FAKE_PACKETS_HEADER with descriptor 0x12345678
+static const uint8_t SESSION_SETUP[] = { 0x2, 0x0, 0x28, 0x0, 0xcc, 0x0, 0xa3, 0x78, 0x56, 0x34, 0x12 };
+
+// first 4 bytes of aes128_cmac(aes128_encrypt(APP_KEY, 0x30 | pad16), B0 | data block), calculated with
+// openssl over the 7997 bytes that the 40 uncoded fragments in FAKE_PACKETS reconstruct
+static const uint8_t EXPECTED_MIC[4] = { 0x42, 0xb7, 0xa0, 0xb9 };
+
+// marks the header of slot 0, so we can see whether the bootloader header was written
+static const uint8_t HEADER_MARKER[16] = {
+    0xa5, 0xa5, 0xa5, 0xa5, 0xa5, 0xa5, 0xa5, 0xa5, 0xa5, 0xa5, 0xa5, 0xa5, 0xa5, 0xa5, 0xa5, 0xa5
+};
+
+static void mark_slot0_header() {
+    FragmentationBlockDeviceWrapper fbd(&bd);
+    fbd.init();
+
+    int r = fbd.program(HEADER_MARKER, MBED_CONF_LORAWAN_UPDATE_CLIENT_SLOT0_HEADER_ADDRESS, sizeof(HEADER_MARKER));
+    TEST_ASSERT_EQUAL(BD_ERROR_OK, r);
+}
+
+static bool slot0_header_marked() {
+    FragmentationBlockDeviceWrapper fbd(&bd);
+    fbd.init();
+
+    uint8_t header[sizeof(HEADER_MARKER)];
+    int r = fbd.read(header, MBED_CONF_LORAWAN_UPDATE_CLIENT_SLOT0_HEADER_ADDRESS, sizeof(header));
+    TEST_ASSERT_EQUAL(BD_ERROR_OK, r);
+
+    return compare_buffers(header, HEADER_MARKER, sizeof(HEADER_MARKER));
+}
+
+// sets up a fragmentation session and reconstructs the data block, which ends in a DataBlockAuthReq
+static void receive_data_block() {
+    LW_UC_STATUS status;
+
+    is_complete = false;
+    is_fw_ready = false;
+    last_message.length = 0;
+
+    uc.callbacks.fragSessionComplete = lorawan_uc_fragsession_complete;
+    uc.callbacks.firmwareReady = lorawan_uc_firmware_ready;
+
+    status = uc.handleFragmentationCommand(0x0, (uint8_t*)SESSION_SETUP, sizeof(SESSION_SETUP));
+    TEST_ASSERT_EQUAL(LW_UC_OK, status);
+
+    for (size_t ix = 0; ix < sizeof(FAKE_PACKETS) / sizeof(FAKE_PACKETS[0]); ix++) {
+        status = uc.handleFragmentationCommand(0x0, (uint8_t*)FAKE_PACKETS[ix], sizeof(FAKE_PACKETS[0]));
+        TEST_ASSERT_EQUAL(LW_UC_OK, status);
+
+        if (is_complete) break;
+    }
+
+    TEST_ASSERT_EQUAL(true, is_complete);
+}
+
+// Test vectors from RFC 4493
+static const uint8_t CMAC_KEY[16] = {
+    0x2b, 0x7e, 0x15, 0x16, 0x28, 0xae, 0xd2, 0xa6, 0xab, 0xf7, 0x15, 0x88, 0x09, 0xcf, 0x4f, 0x3c
+};
+
+static const uint8_t CMAC_MESSAGE[64] = {
+    0x6b, 0xc1, 0xbe, 0xe2, 0x2e, 0x40, 0x9f, 0x96, 0xe9, 0x3d, 0x7e, 0x11, 0x73, 0x93, 0x17, 0x2a,
+    0xae, 0x2d, 0x8a, 0x57, 0x1e, 0x03, 0xac, 0x9c, 0x9e, 0xb7, 0x6f, 0xac, 0x45, 0xaf, 0x8e, 0x51,
+    0x30, 0xc8, 0x1c, 0x46, 0xa3, 0x5c, 0xe4, 0x11, 0xe5, 0xfb, 0xc1, 0x19, 0x1a, 0x0a, 0x52, 0xef,
+    0xf6, 0x9f, 0x24, 0x45, 0xdf, 0x4f, 0x9b, 0x17, 0xad, 0x2b, 0x41, 0x7b, 0xe6, 0x6c, 0x37, 0x10
+};
+
+static void calculate_cmac(FragmentationBlockDeviceWrapper *fbd, size_t length, uint8_t output[16]) {
+    // buffer is deliberately not a multiple of the AES block size
+    uint8_t cmac_buffer[7];
+
+    FragmentationCmac cmac(fbd, cmac_buffer, sizeof(cmac_buffer));
+    cmac.start(CMAC_KEY);
+    int r = cmac.update_from_flash(MBED_CONF_LORAWAN_UPDATE_CLIENT_SLOT0_FW_ADDRESS, length);
+    TEST_ASSERT_EQUAL(0, r);
+    cmac.finish(output);
+}
+
+static control_t cmac_rfc4493_vectors(const size_t call_count) {
+    FragmentationBlockDeviceWrapper fbd(&bd);
+    fbd.init();
+
+    int r = fbd.program(CMAC_MESSAGE, MBED_CONF_LORAWAN_UPDATE_CLIENT_SLOT0_FW_ADDRESS, sizeof(CMAC_MESSAGE));
+    TEST_ASSERT_EQUAL(BD_ERROR_OK, r);
+
+    const uint8_t expected_0[16] = {
+        0xbb, 0x1d, 0x69, 0x29, 0xe9, 0x59, 0x37, 0x28, 0x7f, 0xa3, 0x7d, 0x12, 0x9b, 0x75, 0x67, 0x46
+    };
+    const uint8_t expected_16[16] = {
+        0x07, 0x0a, 0x16, 0xb4, 0x6b, 0x4d, 0x41, 0x44, 0xf7, 0x9b, 0xdd, 0x9d, 0xd0, 0x4a, 0x28, 0x7c
+    };
+    const uint8_t expected_40[16] = {
+        0xdf, 0xa6, 0x67, 0x47, 0xde, 0x9a, 0xe6, 0x30, 0x30, 0xca, 0x32, 0x61, 0x14, 0x97, 0xc8, 0x27
+    };
+    const uint8_t expected_64[16] = {
+        0x51, 0xf0, 0xbe, 0xbf, 0x7e, 0x3b, 0x9d, 0x92, 0xfc, 0x49, 0x74, 0x17, 0x79, 0x36, 0x3c, 0xfe
+    };
+
+    uint8_t output[16];
+
+    calculate_cmac(&fbd, 0, output);
+    TEST_ASSERT_EQUAL(true, compare_buffers(output, expected_0, 16));
+
+    calculate_cmac(&fbd, 16, output);
+    TEST_ASSERT_EQUAL(true, compare_buffers(output, expected_16, 16));
+
+    calculate_cmac(&fbd, 40, output);
+    TEST_ASSERT_EQUAL(true, compare_buffers(output, expected_40, 16));
+
+    calculate_cmac(&fbd, 64, output);
+    TEST_ASSERT_EQUAL(true, compare_buffers(output, expected_64, 16));
+
+    return CaseNext;
+}
+
+static control_t cmac_ram_and_flash(const size_t call_count) {
+    FragmentationBlockDeviceWrapper fbd(&bd);
+    fbd.init();
+
+    uint8_t cmac_buffer[16];
+    uint8_t output[16];
+
+    // first 5 bytes from RAM (like the B0 block), rest from flash should give the same result
+    FragmentationCmac cmac(&fbd, cmac_buffer, sizeof(cmac_buffer));
+    cmac.start(CMAC_KEY);
+    cmac.update(CMAC_MESSAGE, 5);
+    int r = cmac.update_from_flash(MBED_CONF_LORAWAN_UPDATE_CLIENT_SLOT0_FW_ADDRESS + 5, 35);
+    TEST_ASSERT_EQUAL(0, r);
+    cmac.finish(output);
+
+    const uint8_t expected_40[16] = {
+        0xdf, 0xa6, 0x67, 0x47, 0xde, 0x9a, 0xe6, 0x30, 0x30, 0xca, 0x32, 0x61, 0x14, 0x97, 0xc8, 0x27
+    };
+    TEST_ASSERT_EQUAL(true, compare_buffers(output, expected_40, 16));
+
+    return CaseNext;
+}
+
+static control_t auth_ans_invalid_length(const size_t call_count) {
+    const uint8_t header[] = { 0x5, 0x0, 0x0 };
+    LW_UC_STATUS status = uc.handleFragmentationCommand(0x0, (uint8_t*)header, sizeof(header));
+
+    TEST_ASSERT_EQUAL(LW_UC_INVALID_PACKET_LENGTH, status);
+
+    return CaseNext;
+}
+
+static control_t auth_ans_not_pending(const size_t call_count) {
+    const uint8_t header[] = { 0x5, 0x0, 0x0, 0x0, 0x0, 0x0 };
+    LW_UC_STATUS status = uc.handleFragmentationCommand(0x0, (uint8_t*)header, sizeof(header));
+
+    TEST_ASSERT_EQUAL(LW_UC_DATA_BLOCK_AUTH_NOT_PENDING, status);
+
+    return CaseNext;
+}
+
+static control_t auth_req_content(const size_t call_count) {
+    mark_slot0_header();
+
+    receive_data_block();
+
+    // DataBlockAuthReq: fragIx, descriptor, MIC
+    TEST_ASSERT_EQUAL(201, last_message.port);
+    TEST_ASSERT_EQUAL(10, last_message.length);
+    TEST_ASSERT_EQUAL(0x5, last_message.data[0]);
+    TEST_ASSERT_EQUAL(0, last_message.data[1]);
+    TEST_ASSERT_EQUAL(0x78, last_message.data[2]);
+    TEST_ASSERT_EQUAL(0x56, last_message.data[3]);
+    TEST_ASSERT_EQUAL(0x34, last_message.data[4]);
+    TEST_ASSERT_EQUAL(0x12, last_message.data[5]);
+    TEST_ASSERT_EQUAL(true, compare_buffers(last_message.data + 6, EXPECTED_MIC, 4));
+
+    // nothing is verified or written before the network server answers
+    TEST_ASSERT_EQUAL(false, is_fw_ready);
+    TEST_ASSERT_EQUAL(true, slot0_header_marked());
+
+    return CaseNext;
+}
+
+static control_t auth_ans_mismatch(const size_t call_count) {
+    // MIC mismatch reported by the network server (bit 2), for the data block of the previous case
+    const uint8_t header[] = { 0x5, 0b100, 0x78, 0x56, 0x34, 0x12 };
+    LW_UC_STATUS status = uc.handleFragmentationCommand(0x0, (uint8_t*)header, sizeof(header));
+
+    TEST_ASSERT_EQUAL(LW_UC_DATA_BLOCK_AUTH_FAILED, status);
+    TEST_ASSERT_EQUAL(false, is_fw_ready);
+    TEST_ASSERT_EQUAL(true, slot0_header_marked());
+
+    // the data block was discarded
+    status = uc.handleFragmentationCommand(0x0, (uint8_t*)header, sizeof(header));
+    TEST_ASSERT_EQUAL(LW_UC_DATA_BLOCK_AUTH_NOT_PENDING, status);
+
+    return CaseNext;
+}
+
+static control_t auth_ans_match(const size_t call_count) {
+    mark_slot0_header();
+
+    receive_data_block();
+    TEST_ASSERT_EQUAL(true, compare_buffers(last_message.data + 6, EXPECTED_MIC, 4));
+
+    // an answer for another descriptor is not ours
+    const uint8_t other_descriptor[] = { 0x5, 0b000, 0x0, 0x0, 0x0, 0x0 };
+    LW_UC_STATUS status = uc.handleFragmentationCommand(0x0, (uint8_t*)other_descriptor, sizeof(other_descriptor));
+    TEST_ASSERT_EQUAL(LW_UC_DATA_BLOCK_AUTH_NOT_PENDING, status);
+    TEST_ASSERT_EQUAL(false, is_fw_ready);
+
+    // MIC matched, the data block is verified and the bootloader header written
+    const uint8_t header[] = { 0x5, 0b000, 0x78, 0x56, 0x34, 0x12 };
+    status = uc.handleFragmentationCommand(0x0, (uint8_t*)header, sizeof(header));
+
+    TEST_ASSERT_EQUAL(LW_UC_OK, status);
+    TEST_ASSERT_EQUAL(true, is_fw_ready);
+    TEST_ASSERT_EQUAL(false, slot0_header_marked());
+
+    return CaseNext;
+}
+
+utest::v1::status_t greentea_setup(const size_t number_of_cases) {
+    GREENTEA_SETUP(5*60, "default_auto");
+    return greentea_test_setup_handler(number_of_cases);
+}
+
+Case cases[] = {
+    Case("cmac_rfc4493_vectors", cmac_rfc4493_vectors),
+    Case("cmac_ram_and_flash", cmac_ram_and_flash),
+    Case("auth_ans_invalid_length", auth_ans_invalid_length),
+    Case("auth_ans_not_pending", auth_ans_not_pending),
+    Case("auth_req_content", auth_req_content),
+    Case("auth_ans_mismatch", auth_ans_mismatch),
+    Case("auth_ans_match", auth_ans_match)
+};
+
+Specification specification(greentea_setup, cases);
+
+void blink_led() {
+    static DigitalOut led(LED1);
+    led = !led;
+}
+
+int main() {
+    Ticker t;
+    t.attach(blink_led, 0.5);
+
+    mbed_trace_init();
+
+    return !Harness::run(specification);
+}
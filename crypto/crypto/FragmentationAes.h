@@ -0,0 +1,92 @@
+/*
+ * PackageLicenseDeclared: Apache-2.0
+ * Copyright (c) 2018 ARM Limited
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _MBED_LORAWAN_UPDATE_CLIENT_CRYPTO_FRAG_AES
+#define _MBED_LORAWAN_UPDATE_CLIENT_CRYPTO_FRAG_AES
+
+#if !defined(MBEDTLS_CONFIG_FILE)
+#include "mbedtls/config.h"
+#else
+#include MBEDTLS_CONFIG_FILE
+#endif
+
+#include "mbed.h"
+
+// AES backends, select one through lorawan-update-client.aes-backend
+#define FRAG_AES_BACKEND_SOFTWARE   1   // built-in table based implementation
+#define FRAG_AES_BACKEND_MBEDTLS    2   // Mbed TLS, which uses hardware crypto (MBEDTLS_AES_ALT) or AES-NI / ARMv8-CE when available
+
+#if defined(MBED_CONF_LORAWAN_UPDATE_CLIENT_AES_BACKEND)
+#define FRAG_AES_BACKEND    MBED_CONF_LORAWAN_UPDATE_CLIENT_AES_BACKEND
+#elif defined(MBEDTLS_AES_C)
+#define FRAG_AES_BACKEND    FRAG_AES_BACKEND_MBEDTLS
+#else
+#define FRAG_AES_BACKEND    FRAG_AES_BACKEND_SOFTWARE
+#endif
+
+#if FRAG_AES_BACKEND == FRAG_AES_BACKEND_MBEDTLS
+#include "mbedtls/aes.h"
+#endif
+
+/**
+ * AES-128 block encryption. The key schedule is expanded once in set_key(),
+ * and then reused for every block.
+ */
+class FragmentationAes {
+public:
+    FragmentationAes();
+
+    /**
+     * Create an instance, and expand the key schedule for key
+     */
+    FragmentationAes(const uint8_t key[16]);
+
+    ~FragmentationAes();
+
+    /**
+     * Expand the key schedule for a new key
+     *
+     * @param key 128 bits AES key
+     */
+    void set_key(const uint8_t key[16]);
+
+    /**
+     * Encrypt a single block
+     *
+     * @param input     Plaintext block
+     * @param output    Ciphertext block, can be the same as input
+     */
+    void encrypt(const uint8_t input[16], uint8_t output[16]);
+
+    /**
+     * Clear the key schedule
+     */
+    void clear();
+
+private:
+    // no copies, this holds key material
+    FragmentationAes(const FragmentationAes&);
+    FragmentationAes& operator=(const FragmentationAes&);
+
+#if FRAG_AES_BACKEND == FRAG_AES_BACKEND_MBEDTLS
+    mbedtls_aes_context _ctx;
+#else
+    uint32_t _rk[44];
+#endif
+};
+
+#endif // _MBED_LORAWAN_UPDATE_CLIENT_CRYPTO_FRAG_AES
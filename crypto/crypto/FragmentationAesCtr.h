@@ -0,0 +1,71 @@
+/*
+ * PackageLicenseDeclared: Apache-2.0
+ * Copyright (c) 2018 ARM Limited
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _MBED_LORAWAN_UPDATE_CLIENT_CRYPTO_FRAG_AES_CTR
+#define _MBED_LORAWAN_UPDATE_CLIENT_CRYPTO_FRAG_AES_CTR
+
+#include "mbed.h"
+#include "FragmentationAes.h"
+
+/**
+ * AES-128-CTR decryption of an encrypted stream.
+ * Data can be decrypted in any order, the counter block is derived from the offset in the stream.
+ */
+class FragmentationAesCtr {
+public:
+    FragmentationAesCtr();
+
+    ~FragmentationAesCtr();
+
+    /**
+     * Set up a decryption session
+     *
+     * @param key       128 bits AES key
+     * @param nonce     Initial counter block (counter for byte 0 of the stream)
+     *
+     * @returns true if the session was set up
+     */
+    bool setup(const uint8_t key[16], const uint8_t nonce[16]);
+
+    /**
+     * Decrypt part of the stream, in place
+     *
+     * @param offset    Offset of the data in the encrypted stream
+     * @param buffer    Data to decrypt, will be overwritten with the plaintext
+     * @param size      Size of the buffer
+     *
+     * @returns true if decryption succeeded
+     */
+    bool decrypt(size_t offset, uint8_t* buffer, size_t size);
+
+    /**
+     * Finish the decryption session, this also clears the key material
+     */
+    void finish();
+
+private:
+    void generate_keystream(uint32_t block);
+
+    FragmentationAes _aes;
+    uint8_t _nonce[16];
+    uint8_t _keystream[16];
+    uint32_t _keystream_block;
+    bool _keystream_valid;
+    bool _active;
+};
+
+#endif // _MBED_LORAWAN_UPDATE_CLIENT_CRYPTO_FRAG_AES_CTR
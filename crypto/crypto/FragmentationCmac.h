@@ -0,0 +1,88 @@
+/*
+ * PackageLicenseDeclared: Apache-2.0
+ * Copyright (c) 2018 ARM Limited
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _MBED_LORAWAN_UPDATE_CLIENT_CRYPTO_FRAG_CMAC
+#define _MBED_LORAWAN_UPDATE_CLIENT_CRYPTO_FRAG_CMAC
+
+#include "mbed.h"
+#include "FragmentationBlockDeviceWrapper.h"
+#include "FragmentationAes.h"
+
+/**
+ * AES-128-CMAC (RFC 4493) over a file in flash, optionally prefixed by data held in RAM
+ * (e.g. the B0 block of a LoRaWAN MIC).
+ */
+class FragmentationCmac {
+public:
+    /**
+     * Calculate the AES-CMAC of a file in flash
+     *
+     * @param flash         Instance of FragmentationBlockDeviceWrapper
+     * @param buffer        A buffer to be used to read into
+     * @param buffer_size   The size of the buffer
+     */
+    FragmentationCmac(FragmentationBlockDeviceWrapper* flash, uint8_t* buffer, size_t buffer_size);
+
+    ~FragmentationCmac();
+
+    /**
+     * Start a new CMAC calculation
+     *
+     * @param key       128 bits AES key
+     */
+    void start(const uint8_t key[16]);
+
+    /**
+     * Add data from RAM to the CMAC calculation
+     *
+     * @param data      Data to add
+     * @param size      Size of the data
+     */
+    void update(const uint8_t* data, size_t size);
+
+    /**
+     * Add a file in flash to the CMAC calculation, read in chunks of buffer_size
+     *
+     * @param address   Offset of the file in flash
+     * @param size      Size of the file in flash
+     *
+     * @returns 0 if all reads succeeded, negative value if a read failed
+     */
+    int update_from_flash(uint32_t address, size_t size);
+
+    /**
+     * Finish the CMAC calculation, this also clears the key material
+     *
+     * @param output    Buffer to write the 16 bytes CMAC into
+     */
+    void finish(uint8_t output[16]);
+
+private:
+    void process_block(const uint8_t block[16]);
+    void generate_subkey(const uint8_t in[16], uint8_t out[16]);
+
+    FragmentationBlockDeviceWrapper* _flash;
+    uint8_t* _buffer;
+    size_t _buffer_size;
+
+    FragmentationAes _aes;
+    uint8_t _x[16];
+    uint8_t _last[16];
+    size_t _last_size;
+};
+
+#endif // _MBED_LORAWAN_UPDATE_CLIENT_CRYPTO_FRAG_CMAC
@@ -51,10 +51,38 @@ public:
      */
     void calculate(uint32_t address, size_t size, unsigned char output[32]);
 
+    /**
+     * Start a streaming hash calculation, feed data through update() and get the result with finish()
+     */
+    void start();
+
+    /**
+     * Add data to the streaming hash calculation
+     *
+     * @param data      Data to hash
+     * @param size      Size of the data
+     */
+    void update(const uint8_t *data, size_t size);
+
+    /**
+     * Finish the streaming hash calculation
+     *
+     * @param output    SHA256 hash of all data passed to update()
+     */
+    void finish(unsigned char output[32]);
+
+    /**
+     * Report progress while calculate() goes over flash
+     *
+     * @param progress  Invoked after every buffer with the number of bytes hashed and the size of the file
+     */
+    void set_progress(Callback<void(size_t, size_t)> progress);
+
 private:
     FragmentationBlockDeviceWrapper* _flash;
     uint8_t* _buffer;
     size_t _buffer_size;
+    Callback<void(size_t, size_t)> _progress;
     mbedtls_sha256_context _sha256_ctx;
 };
 
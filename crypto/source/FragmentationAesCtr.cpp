@@ -0,0 +1,90 @@
+/*
+ * PackageLicenseDeclared: Apache-2.0
+ * Copyright (c) 2018 ARM Limited
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "crypto/FragmentationAesCtr.h"
+
+FragmentationAesCtr::FragmentationAesCtr()
+    : _keystream_block(0), _keystream_valid(false), _active(false)
+{
+    memset(_nonce, 0, 16);
+    memset(_keystream, 0, 16);
+}
+
+FragmentationAesCtr::~FragmentationAesCtr() {
+    finish();
+}
+
+bool FragmentationAesCtr::setup(const uint8_t key[16], const uint8_t nonce[16]) {
+    _aes.set_key(key);
+    memcpy(_nonce, nonce, 16);
+
+    _keystream_valid = false;
+    _active = true;
+
+    return true;
+}
+
+bool FragmentationAesCtr::decrypt(size_t offset, uint8_t* buffer, size_t size) {
+    if (!_active) return false;
+
+    while (size > 0) {
+        uint32_t block = offset / 16;
+        size_t block_offset = offset % 16;
+
+        if (!_keystream_valid || block != _keystream_block) {
+            generate_keystream(block);
+        }
+
+        size_t length = 16 - block_offset;
+        if (length > size) length = size;
+
+        for (size_t ix = 0; ix < length; ix++) {
+            buffer[ix] ^= _keystream[block_offset + ix];
+        }
+
+        buffer += length;
+        offset += length;
+        size -= length;
+    }
+
+    return true;
+}
+
+void FragmentationAesCtr::finish() {
+    // clear potentially sensitive details
+    _aes.clear();
+    memset(_keystream, 0, 16);
+    _keystream_valid = false;
+    _active = false;
+}
+
+void FragmentationAesCtr::generate_keystream(uint32_t block) {
+    // counter block is nonce + block, big endian
+    uint8_t counter[16];
+    memcpy(counter, _nonce, 16);
+
+    uint32_t carry = block;
+    for (int ix = 15; ix >= 0 && carry > 0; ix--) {
+        carry += counter[ix];
+        counter[ix] = carry & 0xff;
+        carry >>= 8;
+    }
+
+    _aes.encrypt(counter, _keystream);
+    _keystream_block = block;
+    _keystream_valid = true;
+}
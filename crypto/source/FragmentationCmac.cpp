@@ -0,0 +1,128 @@
+/*
+ * PackageLicenseDeclared: Apache-2.0
+ * Copyright (c) 2018 ARM Limited
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "crypto/FragmentationCmac.h"
+
+FragmentationCmac::FragmentationCmac(FragmentationBlockDeviceWrapper* flash, uint8_t* buffer, size_t buffer_size)
+    : _flash(flash), _buffer(buffer), _buffer_size(buffer_size), _last_size(0)
+{
+    memset(_x, 0, 16);
+    memset(_last, 0, 16);
+}
+
+FragmentationCmac::~FragmentationCmac() {
+    _aes.clear();
+}
+
+void FragmentationCmac::start(const uint8_t key[16]) {
+    _aes.set_key(key);
+    memset(_x, 0, 16);
+    memset(_last, 0, 16);
+    _last_size = 0;
+}
+
+void FragmentationCmac::update(const uint8_t* data, size_t size) {
+    while (size > 0) {
+        // only process the pending block when we know it's not the last one
+        if (_last_size == 16) {
+            process_block(_last);
+            _last_size = 0;
+        }
+
+        size_t length = 16 - _last_size;
+        if (length > size) length = size;
+
+        memcpy(_last + _last_size, data, length);
+
+        _last_size += length;
+        data += length;
+        size -= length;
+    }
+}
+
+int FragmentationCmac::update_from_flash(uint32_t address, size_t size) {
+    size_t offset = address;
+    size_t bytes_left = size;
+
+    while (bytes_left > 0) {
+        size_t length = _buffer_size;
+        if (length > bytes_left) length = bytes_left;
+
+        int r = _flash->read(_buffer, offset, length);
+        if (r != 0) return r;
+
+        update(_buffer, length);
+
+        offset += length;
+        bytes_left -= length;
+    }
+
+    return 0;
+}
+
+void FragmentationCmac::finish(uint8_t output[16]) {
+    uint8_t l[16];
+    uint8_t zero[16] = { 0 };
+    _aes.encrypt(zero, l);
+
+    // K1 is used for a complete last block, K2 for a padded one
+    uint8_t subkey[16];
+    generate_subkey(l, subkey);
+
+    if (_last_size < 16) {
+        generate_subkey(subkey, subkey);
+
+        _last[_last_size] = 0x80;
+        memset(_last + _last_size + 1, 0, 16 - _last_size - 1);
+    }
+
+    for (size_t ix = 0; ix < 16; ix++) {
+        _x[ix] ^= _last[ix] ^ subkey[ix];
+    }
+
+    _aes.encrypt(_x, output);
+
+    // clear potentially sensitive details
+    memset(l, 0, 16);
+    memset(subkey, 0, 16);
+    _aes.clear();
+    memset(_x, 0, 16);
+    memset(_last, 0, 16);
+    _last_size = 0;
+}
+
+void FragmentationCmac::process_block(const uint8_t block[16]) {
+    uint8_t in[16];
+    for (size_t ix = 0; ix < 16; ix++) {
+        in[ix] = _x[ix] ^ block[ix];
+    }
+
+    _aes.encrypt(in, _x);
+}
+
+void FragmentationCmac::generate_subkey(const uint8_t in[16], uint8_t out[16]) {
+    uint8_t msb = in[0] & 0x80;
+
+    for (size_t ix = 0; ix < 15; ix++) {
+        out[ix] = (in[ix] << 1) | (in[ix + 1] >> 7);
+    }
+    out[15] = in[15] << 1;
+
+    if (msb) {
+        out[15] ^= 0x87;
+    }
+}
@@ -22,9 +22,28 @@ FragmentationSha256::FragmentationSha256(FragmentationBlockDeviceWrapper* flash,
 {
 }
 
-void FragmentationSha256::calculate(uint32_t address, size_t size, unsigned char output[32]) {
+void FragmentationSha256::start() {
     mbedtls_sha256_init(&_sha256_ctx);
     mbedtls_sha256_starts(&_sha256_ctx, false /* is224 */);
+}
+
+void FragmentationSha256::update(const uint8_t *data, size_t size) {
+    mbedtls_sha256_update(&_sha256_ctx, data, size);
+}
+
+void FragmentationSha256::finish(unsigned char output[32]) {
+    mbedtls_sha256_finish(&_sha256_ctx, output);
+    mbedtls_sha256_free(&_sha256_ctx);
+}
+
+void FragmentationSha256::set_progress(Callback<void(size_t, size_t)> progress) {
+    _progress = progress;
+}
+
+void FragmentationSha256::calculate(uint32_t address, size_t size, unsigned char output[32]) {
+    start();
+
+    if (_progress) _progress(0, size);
 
     size_t offset = address;
     size_t bytes_left = size;
@@ -35,12 +54,13 @@ void FragmentationSha256::calculate(uint32_t address, size_t size, unsigned char
 
         _flash->read(_buffer, offset, length);
 
-        mbedtls_sha256_update(&_sha256_ctx, _buffer, length);
+        update(_buffer, length);
 
         offset += length;
         bytes_left -= length;
+
+        if (_progress) _progress(size - bytes_left, size);
     }
 
-    mbedtls_sha256_finish(&_sha256_ctx, output);
-    mbedtls_sha256_free(&_sha256_ctx);
+    finish(output);
 }
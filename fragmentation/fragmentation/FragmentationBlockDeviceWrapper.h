@@ -40,6 +40,7 @@
 enum frag_bd_error {
     BD_ERROR_NO_MEMORY          = -4002,
     BD_ERROR_NOT_INITIALIZED    = -4003,
+    BD_ERROR_OUT_OF_RANGE       = -4004,
 };
 
 class FragmentationBlockDeviceWrapper {
@@ -81,12 +82,71 @@ public:
      */
     int read(void *a_buffer, bd_addr_t addr, bd_size_t size);
 
+    /**
+     * Get the page (erase) size of the underlying block device, only valid after 'init'
+     */
+    bd_size_t get_page_size() const;
+
+    /**
+     * Get the program size of the underlying block device
+     */
+    bd_size_t get_program_size() const;
+
+    /**
+     * Get the value of erased storage of the underlying block device, or -1 if it's not known
+     */
+    int get_erase_value() const;
+
+    /**
+     * Erase pages on the block device, bypassing the page buffer
+     *
+     * @param addr Address, needs to be page aligned
+     * @param size Size, needs to be a multiple of the page size
+     *
+     * @returns 0 if the erase succeeded, negative value if it failed
+     */
+    int erase(bd_addr_t addr, bd_size_t size);
+
+    /**
+     * Program already erased storage, bypassing the read-modify-erase-program cycle
+     *
+     * @param a_buffer Buffer to write
+     * @param addr Address, needs to be aligned to the program size
+     * @param size Size, needs to be a multiple of the program size
+     *
+     * @returns 0 if the write succeeded, negative value if it failed
+     */
+    int program_erased(const void *a_buffer, bd_addr_t addr, bd_size_t size);
+
+    /**
+     * Watch a range of the block device for writes. The first call to 'program' that touches
+     * the range invokes the callback (before anything is written), after which the watch is cleared.
+     * The callback is allowed to call 'program' on an address outside of the range.
+     *
+     * @param addr Start of the range
+     * @param size Size of the range
+     * @param cb Callback to invoke
+     */
+    void set_write_watch(bd_addr_t addr, bd_size_t size, Callback<void()> cb);
+
+    /**
+     * Clear the write watch, without invoking the callback
+     */
+    void clear_write_watch();
+
 private:
+    void notify_write(bd_addr_t addr, bd_size_t size);
+    void invalidate_page_buffer(bd_addr_t addr, bd_size_t size);
+
     BlockDevice*    _block_device;
     bd_size_t       _page_size;
     bd_size_t       _total_size;
     uint8_t*        _page_buffer;
     uint32_t        _last_page;
+
+    bd_addr_t       _watch_addr;
+    bd_size_t       _watch_size;
+    Callback<void()> _watch_cb;
 };
 
 #endif // _MBED_LORAWAN_UPDATE_CLIENT_FRAGMENTATION_BDWRAPPER
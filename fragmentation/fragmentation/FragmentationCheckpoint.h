@@ -0,0 +1,125 @@
+/*
+ * PackageLicenseDeclared: Apache-2.0
+ * Copyright (c) 2018 ARM Limited
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _MBED_LORAWAN_UPDATE_CLIENT_FRAGMENTATION_CHECKPOINT
+#define _MBED_LORAWAN_UPDATE_CLIENT_FRAGMENTATION_CHECKPOINT
+
+#include "mbed.h"
+#include "FragmentationBlockDeviceWrapper.h"
+
+#define FRAG_CHECKPOINT_MAGIC 0x4b504843 // 'CHPK'
+
+/**
+ * Progress of a long running write (e.g. a delta update), so it can be resumed after a power failure
+ */
+typedef struct __attribute__((__packed__)) {
+    /**
+     * Always FRAG_CHECKPOINT_MAGIC
+     */
+    uint32_t magic;
+
+    /**
+     * Size of the package that is being applied
+     */
+    uint32_t package_size;
+
+    /**
+     * CRC32 that identifies the package
+     */
+    uint32_t package_crc;
+
+    /**
+     * Number of bytes of the output that are in flash
+     */
+    uint32_t target_length;
+
+    /**
+     * CRC32 over the first target_length bytes of the output
+     */
+    uint32_t target_crc;
+
+    /**
+     * CRC32 over all previous fields
+     */
+    uint32_t crc;
+} FragmentationCheckpoint_t;
+
+/**
+ * Log of checkpoints in a scratch area of two pages.
+ *
+ * Checkpoints are appended (one program unit each) to the current page, and when it's full the other
+ * page is erased and used. The previous checkpoint thus survives a power failure during the erase,
+ * and a page is only erased once every (page size / program size) checkpoints.
+ */
+class FragmentationCheckpoint {
+public:
+    FragmentationCheckpoint();
+
+    ~FragmentationCheckpoint();
+
+    /**
+     * Set up the log
+     *
+     * @param bd        Block device, needs to be initialized
+     * @param address   Address of the scratch area, needs to be page aligned and two pages long
+     *
+     * @returns 0 if OK, BD_ERROR_NO_MEMORY if the record buffer could not be allocated,
+     *          BD_ERROR_OUT_OF_RANGE if a record does not fit in a page
+     */
+    int init(FragmentationBlockDeviceWrapper *bd, bd_addr_t address);
+
+    /**
+     * Find the latest checkpoint
+     *
+     * @param record Out parameter, the checkpoint
+     *
+     * @returns 1 if a checkpoint was found, 0 if the log is empty, negative value if reading failed
+     */
+    int load(FragmentationCheckpoint_t *record);
+
+    /**
+     * Append a checkpoint, magic and crc are filled in
+     *
+     * @returns 0 if OK, negative value if a block device operation failed
+     */
+    int save(FragmentationCheckpoint_t *record);
+
+    /**
+     * Remove all checkpoints
+     *
+     * @returns 0 if OK, negative value if a block device operation failed
+     */
+    int clear();
+
+private:
+    // no copies, the record buffer is owned by this log
+    FragmentationCheckpoint(const FragmentationCheckpoint&);
+    FragmentationCheckpoint& operator=(const FragmentationCheckpoint&);
+
+    bool is_valid(const FragmentationCheckpoint_t *record);
+
+    FragmentationBlockDeviceWrapper* _bd;
+    bd_addr_t _address;
+    bd_size_t _page_size;
+    bd_size_t _record_size;     // record padded to the program size
+    uint8_t* _record_buffer;
+    uint8_t _page;              // page that checkpoints are appended to
+    bd_size_t _next;            // slot in that page where the next checkpoint goes
+    bd_size_t _slots;           // checkpoints per page
+};
+
+#endif // _MBED_LORAWAN_UPDATE_CLIENT_FRAGMENTATION_CHECKPOINT
@@ -0,0 +1,101 @@
+/*
+ * PackageLicenseDeclared: Apache-2.0
+ * Copyright (c) 2018 ARM Limited
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _MBED_LORAWAN_UPDATE_CLIENT_FRAGMENTATION_HEATSHRINK_DECODER
+#define _MBED_LORAWAN_UPDATE_CLIENT_FRAGMENTATION_HEATSHRINK_DECODER
+
+#include "mbed.h"
+
+enum frag_heatshrink_error {
+    FRAG_HEATSHRINK_NO_MEMORY       = -4101,
+    FRAG_HEATSHRINK_INVALID_HEADER  = -4102,
+    FRAG_HEATSHRINK_NOT_INITIALIZED = -4103,
+};
+
+/**
+ * Streaming decoder for heatshrink (LZSS) compressed data.
+ *
+ * The stream starts with one byte that holds the window size (upper nibble) and the lookahead size
+ * (lower nibble) in bits, followed by the output of 'heatshrink -e -w <window> -l <lookahead>'.
+ * Only the window (2^window bytes) is kept in RAM, so data can be decoded in chunks of any size:
+ * input that is passed in is always consumed (up to the point where the output buffer is full),
+ * and the decoder picks up where it left off on the next call.
+ */
+class FragmentationHeatshrinkDecoder {
+public:
+    FragmentationHeatshrinkDecoder();
+
+    ~FragmentationHeatshrinkDecoder();
+
+    /**
+     * Allocate the window and reset the decoder
+     *
+     * @param max_window_bits Largest window size (in bits) that streams are allowed to use
+     *
+     * @returns 0 if OK, FRAG_HEATSHRINK_NO_MEMORY if the window could not be allocated
+     */
+    int init(uint8_t max_window_bits);
+
+    /**
+     * Start decoding a new stream
+     */
+    void reset();
+
+    /**
+     * Decode data
+     *
+     * @param in        Compressed data
+     * @param in_size   Size of the compressed data
+     * @param in_used   Out parameter, number of bytes of compressed data that were consumed
+     * @param out       Buffer for decompressed data
+     * @param out_size  Size of the buffer
+     * @param out_used  Out parameter, number of bytes that were decompressed into the buffer
+     *
+     * @returns 0 if OK, FRAG_HEATSHRINK_INVALID_HEADER if the stream uses parameters that are not supported
+     */
+    int decode(const uint8_t *in, size_t in_size, size_t *in_used, uint8_t *out, size_t out_size, size_t *out_used);
+
+private:
+    // no copies, the window is owned by this decoder
+    FragmentationHeatshrinkDecoder(const FragmentationHeatshrinkDecoder&);
+    FragmentationHeatshrinkDecoder& operator=(const FragmentationHeatshrinkDecoder&);
+
+    bool get_bits(uint8_t count, const uint8_t *in, size_t in_size, size_t *in_pos, uint16_t *value);
+    void emit(uint8_t c, uint8_t *out, size_t *out_pos);
+
+    enum State {
+        STATE_HEADER,
+        STATE_TAG,
+        STATE_LITERAL,
+        STATE_INDEX,
+        STATE_COUNT,
+        STATE_BACKREF
+    };
+
+    uint8_t* _window;
+    uint8_t _max_window_bits;
+    uint8_t _window_bits;
+    uint8_t _lookahead_bits;
+    uint16_t _head;         // position in the window where the next byte goes
+    uint16_t _index;        // distance of the back-reference that is being copied
+    uint16_t _count;        // bytes left to copy for the back-reference
+    uint32_t _bits;         // bits that were read from the input, but not used yet
+    uint8_t _bit_count;
+    State _state;
+};
+
+#endif // _MBED_LORAWAN_UPDATE_CLIENT_FRAGMENTATION_HEATSHRINK_DECODER
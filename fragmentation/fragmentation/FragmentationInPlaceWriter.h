@@ -0,0 +1,176 @@
+/*
+ * PackageLicenseDeclared: Apache-2.0
+ * Copyright (c) 2018 ARM Limited
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _MBED_LORAWAN_UPDATE_CLIENT_FRAGMENTATION_IN_PLACE_WRITER
+#define _MBED_LORAWAN_UPDATE_CLIENT_FRAGMENTATION_IN_PLACE_WRITER
+
+#include "mbed.h"
+#include "FragmentationBlockDeviceWrapper.h"
+
+#define FRAG_IN_PLACE_JOURNAL_MAGIC 0x4a4e4c50 // 'PLNJ'
+
+/**
+ * Journal record, stored in the page after the journaled page data
+ */
+typedef struct __attribute__((__packed__)) {
+    /**
+     * Always FRAG_IN_PLACE_JOURNAL_MAGIC
+     */
+    uint32_t magic;
+
+    /**
+     * Start of the region that is being overwritten
+     */
+    uint32_t region_start;
+
+    /**
+     * Address of the page that is being overwritten, everything in the region before this page
+     * already holds new data
+     */
+    uint32_t page_address;
+
+    /**
+     * CRC32 over the page data in the journal
+     */
+    uint32_t data_crc;
+
+    /**
+     * CRC32 over all previous fields
+     */
+    uint32_t crc;
+} FragmentationInPlaceJournal_t;
+
+/**
+ * Append-only writer that overwrites a region which is also the source of the data being written
+ * (in-place delta patching).
+ *
+ * The last 'window' pages are held in RAM, and a page is only committed to the block device when
+ * the write cursor moves out of the window. Everything below get_committed_end() is overwritten,
+ * so a reader of the old data must not access it anymore (see is_overwritten()). The data can thus
+ * be written at most 'window - 1' pages ahead of where the old data is still read.
+ *
+ * Committing a page is journaled: the page is first stored in a scratch area (two pages, one for
+ * the data and one for the journal record) and only then erased and programmed in the region. After
+ * a power failure recover() completes the interrupted page, so the region always consists of new data
+ * up to the journaled page, and old data after it.
+ */
+class FragmentationInPlaceWriter {
+public:
+    FragmentationInPlaceWriter();
+
+    ~FragmentationInPlaceWriter();
+
+    /**
+     * Start writing at address
+     *
+     * @param bd        Block device, needs to be initialized
+     * @param start     Address where the first byte is written
+     * @param limit     End of the region, writing past it fails
+     * @param journal   Address of the scratch area, needs to be page aligned, two pages long, and outside of the region
+     * @param window    Number of pages to hold in RAM (at least 1)
+     *
+     * @returns 0 if OK, BD_ERROR_NO_MEMORY if the window could not be allocated
+     */
+    int start(FragmentationBlockDeviceWrapper *bd, bd_addr_t start, bd_addr_t limit, bd_addr_t journal, uint8_t window);
+
+    /**
+     * Start a dry run: the write cursor and get_committed_end() move exactly like they would after start(),
+     * but the data is discarded and nothing is read from or written to the block device.
+     * Used to find out whether a reader of the old data would access overwritten data, before the region is touched.
+     *
+     * @param bd        Block device, needs to be initialized
+     * @param start     Address where the first byte would be written
+     * @param limit     End of the region, writing past it fails
+     * @param window    Number of pages that would be held in RAM (at least 1)
+     *
+     * @returns 0 if OK
+     */
+    int start_dry_run(FragmentationBlockDeviceWrapper *bd, bd_addr_t start, bd_addr_t limit, uint8_t window);
+
+    /**
+     * Append data
+     *
+     * @returns 0 if OK, BD_ERROR_OUT_OF_RANGE if writing past the limit, negative value if a block device operation failed
+     */
+    int write(const void *buffer, bd_size_t size);
+
+    /**
+     * Commit all pages in the window, clear the journal, and stop writing.
+     * The rest of the last page keeps its old content.
+     *
+     * @returns 0 if OK, negative value if a block device operation failed
+     */
+    int finish();
+
+    /**
+     * Whether the writer was started, and not finished yet
+     */
+    bool is_active() const;
+
+    /**
+     * Address where the next byte will be written
+     */
+    bd_addr_t get_position() const;
+
+    /**
+     * End of the data that was committed to the block device (the old data before it is gone)
+     */
+    bd_addr_t get_committed_end() const;
+
+    /**
+     * Whether a range of the region no longer holds the old data
+     */
+    bool is_overwritten(bd_addr_t addr, bd_size_t size) const;
+
+    /**
+     * Complete a page commit that was interrupted by a power failure
+     *
+     * @param bd            Block device, needs to be initialized
+     * @param journal       Address of the scratch area
+     * @param region_start  Out parameter, start of the region that was being overwritten
+     * @param committed_end Out parameter, end of the new data in the region (including the completed page)
+     *
+     * @returns 1 if an interrupted commit was found and completed, 0 if the journal is empty,
+     *          negative value if a block device operation failed
+     */
+    static int recover(FragmentationBlockDeviceWrapper *bd, bd_addr_t journal, bd_addr_t *region_start, bd_addr_t *committed_end);
+
+private:
+    // no copies, the window is owned by this writer
+    FragmentationInPlaceWriter(const FragmentationInPlaceWriter&);
+    FragmentationInPlaceWriter& operator=(const FragmentationInPlaceWriter&);
+
+    int commit_oldest();
+    int program_page(const uint8_t *buffer, bd_addr_t addr);
+
+    FragmentationBlockDeviceWrapper* _bd;
+    bd_size_t _page_size;
+    bd_addr_t _start;
+    bd_addr_t _limit;
+    bd_addr_t _journal;
+    bd_addr_t _committed_end;   // first page that was not committed yet (oldest page in the window)
+    bd_addr_t _position;
+    uint8_t* _window;           // ring buffer of pages, page n lives in slot (n % _window_pages)
+    uint8_t _window_pages;
+    uint8_t _pending_pages;     // pages in the window, including the one being filled
+    uint8_t* _record_buffer;    // journal record padded to the program size
+    bd_size_t _record_size;
+    bool _active;
+    bool _dry_run;              // no window, nothing is read or written
+};
+
+#endif // _MBED_LORAWAN_UPDATE_CLIENT_FRAGMENTATION_IN_PLACE_WRITER
@@ -0,0 +1,99 @@
+/*
+ * PackageLicenseDeclared: Apache-2.0
+ * Copyright (c) 2018 ARM Limited
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _MBED_LORAWAN_UPDATE_CLIENT_FRAGMENTATION_SEQ_WRITER
+#define _MBED_LORAWAN_UPDATE_CLIENT_FRAGMENTATION_SEQ_WRITER
+
+#include "mbed.h"
+#include "FragmentationBlockDeviceWrapper.h"
+
+/**
+ * Append-only writer for data that is written sequentially (patched firmware, copied firmware,
+ * fragments that arrive in order).
+ *
+ * Pages that lie completely in the region [start, limit) are erased once, right before the write
+ * cursor enters them, and are then written with 'program' calls at the program granularity of
+ * the block device. Only a partial page at the start or the end of the region goes through the
+ * read-modify-erase-program path of the wrapper, so data outside of the region is preserved.
+ * Data between the write cursor and the end of a page that was erased is lost.
+ */
+class FragmentationSequentialWriter {
+public:
+    FragmentationSequentialWriter();
+
+    ~FragmentationSequentialWriter();
+
+    /**
+     * Start writing at address
+     *
+     * @param bd        Block device, needs to be initialized
+     * @param start     Address where the first byte is written
+     * @param limit     End of the region that this writer is allowed to erase
+     *
+     * @returns 0 if OK, BD_ERROR_NO_MEMORY if the program buffer could not be allocated
+     */
+    int start(FragmentationBlockDeviceWrapper *bd, bd_addr_t start, bd_addr_t limit);
+
+    /**
+     * Append data
+     *
+     * @returns 0 if OK, negative value if a block device operation failed
+     */
+    int write(const void *buffer, bd_size_t size);
+
+    /**
+     * Program the data that is still buffered (less than the program size), and stop writing.
+     *
+     * @returns 0 if OK, negative value if a block device operation failed
+     */
+    int finish();
+
+    /**
+     * Whether the writer was started, and not finished yet
+     */
+    bool is_active() const;
+
+    /**
+     * Address where the next byte will be written
+     */
+    bd_addr_t get_position() const;
+
+    /**
+     * End of the data that was programmed, data after it (less than one program unit) is still buffered
+     */
+    bd_addr_t get_programmed_end() const;
+
+private:
+    // no copies, the program buffer is owned by this writer
+    FragmentationSequentialWriter(const FragmentationSequentialWriter&);
+    FragmentationSequentialWriter& operator=(const FragmentationSequentialWriter&);
+
+    int program_units(const uint8_t *buffer, bd_addr_t addr, bd_size_t size);
+
+    FragmentationBlockDeviceWrapper* _bd;
+    bd_size_t _page_size;
+    bd_size_t _program_size;
+    bd_addr_t _aligned_start;   // first address of the pages that can be erased
+    bd_addr_t _aligned_end;     // end of the pages that can be erased
+    bd_addr_t _erased_end;      // end of the pages that were erased so far
+    bd_addr_t _position;
+    uint8_t* _unit_buffer;      // holds a partially filled program unit
+    bd_size_t _unit_fill;
+    bool _active;
+};
+
+#endif // _MBED_LORAWAN_UPDATE_CLIENT_FRAGMENTATION_SEQ_WRITER
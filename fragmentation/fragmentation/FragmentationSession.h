@@ -20,6 +20,7 @@
 
 #include "mbed.h"
 #include "FragmentationBlockDeviceWrapper.h"
+#include "FragmentationSequentialWriter.h"
 #include "FragmentationMath.h"
 #include "mbed_debug.h"
 
@@ -113,6 +114,10 @@ private:
     FragmentationSessionOpts_t _opts;
     FragmentationMath _math;
 
+    // as long as fragments arrive in order they are appended through a sequential writer
+    FragmentationSequentialWriter _writer;
+    uint16_t _next_in_order;
+
     uint16_t _frames_received;
 };
 
@@ -18,7 +18,8 @@
 #include "FragmentationBlockDeviceWrapper.h"
 
 FragmentationBlockDeviceWrapper::FragmentationBlockDeviceWrapper(BlockDevice *bd)
-    : _block_device(bd), _page_size(0), _total_size(0), _page_buffer(NULL), _last_page(0xffffffff)
+    : _block_device(bd), _page_size(0), _total_size(0), _page_buffer(NULL), _last_page(0xffffffff),
+      _watch_addr(0), _watch_size(0), _watch_cb(NULL)
 {
 
 }
@@ -58,6 +59,8 @@ int FragmentationBlockDeviceWrapper::program(const void *a_buffer, bd_addr_t add
 
     frag_debug("[FBDW] write addr=%lu size=%d\n", addr, size);
 
+    notify_write(addr, size);
+
     // find the page
     size_t bytes_left = size;
     while (bytes_left > 0) {
@@ -145,3 +148,62 @@ int FragmentationBlockDeviceWrapper::read(void *a_buffer, bd_addr_t addr, bd_siz
     return BD_ERROR_OK;
 }
 
+bd_size_t FragmentationBlockDeviceWrapper::get_page_size() const {
+    return _page_size;
+}
+
+bd_size_t FragmentationBlockDeviceWrapper::get_program_size() const {
+    return _block_device->get_program_size();
+}
+
+int FragmentationBlockDeviceWrapper::get_erase_value() const {
+    return _block_device->get_erase_value();
+}
+
+int FragmentationBlockDeviceWrapper::erase(bd_addr_t addr, bd_size_t size) {
+    if (!_page_buffer) return BD_ERROR_NOT_INITIALIZED;
+
+    frag_debug("[FBDW] erase addr=%lu size=%d\n", addr, size);
+
+    notify_write(addr, size);
+    invalidate_page_buffer(addr, size);
+
+    return _block_device->erase(addr, size);
+}
+
+int FragmentationBlockDeviceWrapper::program_erased(const void *a_buffer, bd_addr_t addr, bd_size_t size) {
+    if (!_page_buffer) return BD_ERROR_NOT_INITIALIZED;
+
+    frag_debug("[FBDW] program_erased addr=%lu size=%d\n", addr, size);
+
+    notify_write(addr, size);
+    invalidate_page_buffer(addr, size);
+
+    return _block_device->program(a_buffer, addr, size);
+}
+
+void FragmentationBlockDeviceWrapper::notify_write(bd_addr_t addr, bd_size_t size) {
+    // notify before writing into the watched range, clear first so the callback can write itself
+    if (_watch_cb && addr < _watch_addr + _watch_size && addr + size > _watch_addr) {
+        Callback<void()> cb = _watch_cb;
+        _watch_cb = NULL;
+        cb();
+    }
+}
+
+void FragmentationBlockDeviceWrapper::invalidate_page_buffer(bd_addr_t addr, bd_size_t size) {
+    // the page buffer is a cache of _last_page, which is no longer valid if that page is written directly
+    if (_last_page != 0xffffffff && addr < (_last_page + 1) * _page_size && addr + size > _last_page * _page_size) {
+        _last_page = 0xffffffff;
+    }
+}
+
+void FragmentationBlockDeviceWrapper::set_write_watch(bd_addr_t addr, bd_size_t size, Callback<void()> cb) {
+    _watch_addr = addr;
+    _watch_size = size;
+    _watch_cb = cb;
+}
+
+void FragmentationBlockDeviceWrapper::clear_write_watch() {
+    _watch_cb = NULL;
+}
@@ -0,0 +1,126 @@
+/*
+ * PackageLicenseDeclared: Apache-2.0
+ * Copyright (c) 2018 ARM Limited
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "FragmentationCheckpoint.h"
+#include "crc32.h"
+
+FragmentationCheckpoint::FragmentationCheckpoint()
+    : _bd(NULL), _address(0), _page_size(0), _record_size(0), _record_buffer(NULL), _page(0), _next(0), _slots(0)
+{
+}
+
+FragmentationCheckpoint::~FragmentationCheckpoint() {
+    if (_record_buffer) free(_record_buffer);
+}
+
+int FragmentationCheckpoint::init(FragmentationBlockDeviceWrapper *bd, bd_addr_t address) {
+    _bd = bd;
+    _address = address;
+    _page_size = bd->get_page_size();
+    if (_page_size == 0) return BD_ERROR_NOT_INITIALIZED;
+
+    bd_size_t program_size = bd->get_program_size();
+    if (program_size == 0 || _page_size % program_size != 0) program_size = _page_size;
+    _record_size = ((sizeof(FragmentationCheckpoint_t) + program_size - 1) / program_size) * program_size;
+    if (_record_size > _page_size) return BD_ERROR_OUT_OF_RANGE;
+
+    if (_record_buffer) free(_record_buffer);
+    _record_buffer = (uint8_t*)malloc(_record_size);
+    if (!_record_buffer) {
+        return BD_ERROR_NO_MEMORY;
+    }
+
+    _slots = _page_size / _record_size;
+
+    // we don't know what's in the log, so the next checkpoint starts on a freshly erased page
+    _page = 1;
+    _next = _slots;
+
+    return BD_ERROR_OK;
+}
+
+int FragmentationCheckpoint::load(FragmentationCheckpoint_t *record) {
+    if (!_record_buffer) return BD_ERROR_NOT_INITIALIZED;
+
+    bool found = false;
+
+    for (uint8_t page = 0; page < 2; page++) {
+        for (bd_size_t slot = 0; slot < _slots; slot++) {
+            FragmentationCheckpoint_t candidate;
+            int r = _bd->read(&candidate, _address + (page * _page_size) + (slot * _record_size), sizeof(FragmentationCheckpoint_t));
+            if (r != 0) return r;
+
+            if (!is_valid(&candidate)) continue;
+
+            // output only grows, so the checkpoint that got furthest is the latest one
+            if (!found || candidate.target_length >= record->target_length) {
+                memcpy(record, &candidate, sizeof(FragmentationCheckpoint_t));
+                _page = page;
+                found = true;
+            }
+        }
+    }
+
+    // slots after the latest checkpoint might hold a partially written one, don't program over them
+    _next = _slots;
+
+    return found ? 1 : 0;
+}
+
+int FragmentationCheckpoint::save(FragmentationCheckpoint_t *record) {
+    if (!_record_buffer) return BD_ERROR_NOT_INITIALIZED;
+
+    record->magic = FRAG_CHECKPOINT_MAGIC;
+    record->crc = crc32(0, (uint8_t*)record, sizeof(FragmentationCheckpoint_t) - sizeof(record->crc));
+
+    // page is full, continue on the other one (the last checkpoint stays intact while it's being erased)
+    if (_next >= _slots) {
+        _page = _page ^ 1;
+
+        int r = _bd->erase(_address + (_page * _page_size), _page_size);
+        if (r != 0) return r;
+
+        _next = 0;
+    }
+
+    memset(_record_buffer, 0xff, _record_size);
+    memcpy(_record_buffer, record, sizeof(FragmentationCheckpoint_t));
+
+    int r = _bd->program_erased(_record_buffer, _address + (_page * _page_size) + (_next * _record_size), _record_size);
+    if (r != 0) return r;
+
+    _next++;
+
+    return BD_ERROR_OK;
+}
+
+int FragmentationCheckpoint::clear() {
+    if (!_record_buffer) return BD_ERROR_NOT_INITIALIZED;
+
+    int r = _bd->erase(_address, _page_size * 2);
+    if (r != 0) return r;
+
+    _page = 0;
+    _next = 0;
+
+    return BD_ERROR_OK;
+}
+
+bool FragmentationCheckpoint::is_valid(const FragmentationCheckpoint_t *record) {
+    return record->magic == FRAG_CHECKPOINT_MAGIC
+        && record->crc == crc32(0, (const uint8_t*)record, sizeof(FragmentationCheckpoint_t) - sizeof(record->crc));
+}
@@ -0,0 +1,149 @@
+/*
+ * PackageLicenseDeclared: Apache-2.0
+ * Copyright (c) 2018 ARM Limited
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "FragmentationHeatshrinkDecoder.h"
+
+// limits of the heatshrink format
+#define HEATSHRINK_MIN_WINDOW_BITS      4
+#define HEATSHRINK_MAX_WINDOW_BITS      15
+#define HEATSHRINK_MIN_LOOKAHEAD_BITS   3
+
+FragmentationHeatshrinkDecoder::FragmentationHeatshrinkDecoder()
+    : _window(NULL), _max_window_bits(0), _window_bits(0), _lookahead_bits(0), _head(0), _index(0), _count(0),
+      _bits(0), _bit_count(0), _state(STATE_HEADER)
+{
+}
+
+FragmentationHeatshrinkDecoder::~FragmentationHeatshrinkDecoder() {
+    if (_window) free(_window);
+}
+
+int FragmentationHeatshrinkDecoder::init(uint8_t max_window_bits) {
+    if (max_window_bits > HEATSHRINK_MAX_WINDOW_BITS) max_window_bits = HEATSHRINK_MAX_WINDOW_BITS;
+
+    if (_window) free(_window);
+    _window = (uint8_t*)malloc(1 << max_window_bits);
+    if (!_window) {
+        return FRAG_HEATSHRINK_NO_MEMORY;
+    }
+
+    _max_window_bits = max_window_bits;
+    reset();
+
+    return 0;
+}
+
+void FragmentationHeatshrinkDecoder::reset() {
+    // back-references in front of the start of the stream refer to zeros
+    if (_window) memset(_window, 0, 1 << _max_window_bits);
+
+    _head = 0;
+    _index = 0;
+    _count = 0;
+    _bits = 0;
+    _bit_count = 0;
+    _state = STATE_HEADER;
+}
+
+int FragmentationHeatshrinkDecoder::decode(const uint8_t *in, size_t in_size, size_t *in_used,
+                                           uint8_t *out, size_t out_size, size_t *out_used) {
+    size_t in_pos = 0;
+    size_t out_pos = 0;
+    int r = 0;
+
+    *in_used = 0;
+    *out_used = 0;
+
+    if (!_window) return FRAG_HEATSHRINK_NOT_INITIALIZED;
+
+    while (true) {
+        uint16_t value;
+
+        if (_state == STATE_HEADER) {
+            if (in_pos == in_size) break;
+
+            uint8_t window_bits = in[in_pos] >> 4;
+            uint8_t lookahead_bits = in[in_pos] & 0x0f;
+            if (window_bits < HEATSHRINK_MIN_WINDOW_BITS || window_bits > _max_window_bits
+                    || lookahead_bits < HEATSHRINK_MIN_LOOKAHEAD_BITS || lookahead_bits >= window_bits) {
+                r = FRAG_HEATSHRINK_INVALID_HEADER;
+                break;
+            }
+
+            _window_bits = window_bits;
+            _lookahead_bits = lookahead_bits;
+            in_pos++;
+            _state = STATE_TAG;
+        }
+        else if (_state == STATE_TAG) {
+            if (!get_bits(1, in, in_size, &in_pos, &value)) break;
+            _state = value ? STATE_LITERAL : STATE_INDEX;
+        }
+        else if (_state == STATE_LITERAL) {
+            if (out_pos == out_size) break;
+            if (!get_bits(8, in, in_size, &in_pos, &value)) break;
+            emit(value, out, &out_pos);
+            _state = STATE_TAG;
+        }
+        else if (_state == STATE_INDEX) {
+            if (!get_bits(_window_bits, in, in_size, &in_pos, &value)) break;
+            _index = value + 1;
+            _state = STATE_COUNT;
+        }
+        else if (_state == STATE_COUNT) {
+            if (!get_bits(_lookahead_bits, in, in_size, &in_pos, &value)) break;
+            _count = value + 1;
+            _state = STATE_BACKREF;
+        }
+        else { // STATE_BACKREF
+            uint16_t mask = (1 << _window_bits) - 1;
+            while (_count > 0 && out_pos < out_size) {
+                emit(_window[(_head - _index) & mask], out, &out_pos);
+                _count--;
+            }
+            if (_count > 0) break;
+            _state = STATE_TAG;
+        }
+    }
+
+    *in_used = in_pos;
+    *out_used = out_pos;
+    return r;
+}
+
+bool FragmentationHeatshrinkDecoder::get_bits(uint8_t count, const uint8_t *in, size_t in_size, size_t *in_pos, uint16_t *value) {
+    // bits are stored MSB first, whatever is read here is kept in _bits until it's used
+    while (_bit_count < count) {
+        if (*in_pos == in_size) return false;
+
+        _bits = (_bits << 8) | in[*in_pos];
+        _bit_count += 8;
+        (*in_pos)++;
+    }
+
+    _bit_count -= count;
+    *value = (_bits >> _bit_count) & ((1 << count) - 1);
+    _bits &= (1 << _bit_count) - 1;
+
+    return true;
+}
+
+void FragmentationHeatshrinkDecoder::emit(uint8_t c, uint8_t *out, size_t *out_pos) {
+    out[(*out_pos)++] = c;
+    _window[_head & ((1 << _window_bits) - 1)] = c;
+    _head++;
+}
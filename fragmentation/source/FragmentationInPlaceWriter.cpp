@@ -0,0 +1,261 @@
+/*
+ * PackageLicenseDeclared: Apache-2.0
+ * Copyright (c) 2018 ARM Limited
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "FragmentationInPlaceWriter.h"
+#include "crc32.h"
+
+FragmentationInPlaceWriter::FragmentationInPlaceWriter()
+    : _bd(NULL), _page_size(0), _start(0), _limit(0), _journal(0), _committed_end(0), _position(0),
+      _window(NULL), _window_pages(0), _pending_pages(0), _record_buffer(NULL), _record_size(0), _active(false),
+      _dry_run(false)
+{
+}
+
+FragmentationInPlaceWriter::~FragmentationInPlaceWriter() {
+    if (_window) free(_window);
+    if (_record_buffer) free(_record_buffer);
+}
+
+int FragmentationInPlaceWriter::start(FragmentationBlockDeviceWrapper *bd, bd_addr_t start, bd_addr_t limit,
+                                      bd_addr_t journal, uint8_t window) {
+    _bd = bd;
+    _page_size = bd->get_page_size();
+    if (_page_size == 0) return BD_ERROR_NOT_INITIALIZED;
+    if (window == 0) window = 1;
+
+    if (_window) free(_window);
+    _window = (uint8_t*)malloc(_page_size * window);
+    if (!_window) {
+        return BD_ERROR_NO_MEMORY;
+    }
+
+    bd_size_t program_size = bd->get_program_size();
+    if (program_size == 0 || _page_size % program_size != 0) program_size = _page_size;
+    _record_size = ((sizeof(FragmentationInPlaceJournal_t) + program_size - 1) / program_size) * program_size;
+
+    // optional, without it the record is written through the read-modify-erase-program path
+    if (_record_buffer) free(_record_buffer);
+    _record_buffer = _record_size <= _page_size ? (uint8_t*)malloc(_record_size) : NULL;
+
+    _window_pages = window;
+    _pending_pages = 0;
+    _start = start;
+    _limit = limit;
+    _journal = journal;
+    _committed_end = (start / _page_size) * _page_size;
+    _position = start;
+    _active = true;
+    _dry_run = false;
+
+    return BD_ERROR_OK;
+}
+
+int FragmentationInPlaceWriter::start_dry_run(FragmentationBlockDeviceWrapper *bd, bd_addr_t start, bd_addr_t limit,
+                                              uint8_t window) {
+    _bd = bd;
+    _page_size = bd->get_page_size();
+    if (_page_size == 0) return BD_ERROR_NOT_INITIALIZED;
+    if (window == 0) window = 1;
+
+    _window_pages = window;
+    _pending_pages = 0;
+    _start = start;
+    _limit = limit;
+    _journal = 0;
+    _committed_end = (start / _page_size) * _page_size;
+    _position = start;
+    _active = true;
+    _dry_run = true;
+
+    return BD_ERROR_OK;
+}
+
+int FragmentationInPlaceWriter::write(const void *a_buffer, bd_size_t size) {
+    if (!_active) return BD_ERROR_NOT_INITIALIZED;
+    if (_position + size > _limit) return BD_ERROR_OUT_OF_RANGE;
+
+    const uint8_t *buffer = (const uint8_t*)a_buffer;
+
+    while (size > 0) {
+        bd_addr_t page_addr = (_position / _page_size) * _page_size;
+        uint8_t *page = _dry_run ? NULL : _window + ((_position / _page_size) % _window_pages) * _page_size;
+
+        // entering a page that is not in the window yet
+        if (page_addr >= _committed_end + _pending_pages * _page_size) {
+            if (_pending_pages == _window_pages) {
+                int r = commit_oldest();
+                if (r != 0) return r;
+            }
+
+            // only happens for the first page, keep what's in front of the start address
+            if (_position > page_addr && !_dry_run) {
+                int r = _bd->read(page, page_addr, _position - page_addr);
+                if (r != 0) return r;
+            }
+
+            _pending_pages++;
+        }
+
+        bd_size_t offset = _position - page_addr;
+        bd_size_t length = _page_size - offset;
+        if (length > size) length = size;
+
+        if (!_dry_run) memcpy(page + offset, buffer, length);
+
+        _position += length;
+        buffer += length;
+        size -= length;
+    }
+
+    return BD_ERROR_OK;
+}
+
+int FragmentationInPlaceWriter::finish() {
+    if (!_active) return BD_ERROR_OK;
+
+    _active = false;
+
+    if (_dry_run) {
+        _committed_end += _pending_pages * _page_size;
+        _pending_pages = 0;
+        return BD_ERROR_OK;
+    }
+
+    if (_pending_pages > 0) {
+        // keep the old content after the write cursor in the last page, it's not committed yet so still in flash
+        bd_addr_t window_end = _committed_end + _pending_pages * _page_size;
+        if (_position < window_end) {
+            uint8_t *page = _window + ((_position / _page_size) % _window_pages) * _page_size;
+            bd_size_t offset = _position % _page_size;
+
+            int r = _bd->read(page + offset, _position, _page_size - offset);
+            if (r != 0) return r;
+        }
+
+        while (_pending_pages > 0) {
+            int r = commit_oldest();
+            if (r != 0) return r;
+        }
+    }
+
+    // all done, nothing to recover anymore
+    return _bd->erase(_journal, _page_size * 2);
+}
+
+bool FragmentationInPlaceWriter::is_active() const {
+    return _active;
+}
+
+bd_addr_t FragmentationInPlaceWriter::get_position() const {
+    return _position;
+}
+
+bd_addr_t FragmentationInPlaceWriter::get_committed_end() const {
+    return _committed_end;
+}
+
+bool FragmentationInPlaceWriter::is_overwritten(bd_addr_t addr, bd_size_t size) const {
+    return addr < _committed_end && addr + size > _start;
+}
+
+int FragmentationInPlaceWriter::recover(FragmentationBlockDeviceWrapper *bd, bd_addr_t journal,
+                                        bd_addr_t *region_start, bd_addr_t *committed_end) {
+    bd_size_t page_size = bd->get_page_size();
+    if (page_size == 0) return BD_ERROR_NOT_INITIALIZED;
+
+    FragmentationInPlaceJournal_t record;
+    int r = bd->read(&record, journal + page_size, sizeof(FragmentationInPlaceJournal_t));
+    if (r != 0) return r;
+
+    if (record.magic != FRAG_IN_PLACE_JOURNAL_MAGIC
+            || record.crc != crc32(0, (uint8_t*)&record, sizeof(FragmentationInPlaceJournal_t) - sizeof(record.crc))) {
+        return 0;
+    }
+
+    uint8_t *page = (uint8_t*)malloc(page_size);
+    if (!page) {
+        return BD_ERROR_NO_MEMORY;
+    }
+
+    r = bd->read(page, journal, page_size);
+    if (r == 0 && record.data_crc != crc32(0, page, page_size)) {
+        // record is only written after the data, so this should not happen
+        r = BD_ERROR_DEVICE_ERROR;
+    }
+    if (r == 0) r = bd->erase(record.page_address, page_size);
+    if (r == 0) r = bd->program_erased(page, record.page_address, page_size);
+
+    free(page);
+
+    if (r != 0) return r;
+
+    *region_start = record.region_start;
+    *committed_end = record.page_address + page_size;
+
+    // the page is complete now, if we lose power before this the journal is replayed again
+    r = bd->erase(journal, page_size * 2);
+    if (r != 0) return r;
+
+    return 1;
+}
+
+int FragmentationInPlaceWriter::commit_oldest() {
+    if (!_dry_run) {
+        uint8_t *page = _window + ((_committed_end / _page_size) % _window_pages) * _page_size;
+
+        int r = program_page(page, _committed_end);
+        if (r != 0) return r;
+    }
+
+    _committed_end += _page_size;
+    _pending_pages--;
+
+    return BD_ERROR_OK;
+}
+
+int FragmentationInPlaceWriter::program_page(const uint8_t *buffer, bd_addr_t addr) {
+    // 1. copy of the page, 2. record that marks the copy as complete, 3. the actual page
+    int r = _bd->erase(_journal, _page_size * 2);
+    if (r != 0) return r;
+
+    r = _bd->program_erased(buffer, _journal, _page_size);
+    if (r != 0) return r;
+
+    FragmentationInPlaceJournal_t record;
+    record.magic = FRAG_IN_PLACE_JOURNAL_MAGIC;
+    record.region_start = _start;
+    record.page_address = addr;
+    record.data_crc = crc32(0, buffer, _page_size);
+    record.crc = crc32(0, (uint8_t*)&record, sizeof(FragmentationInPlaceJournal_t) - sizeof(record.crc));
+
+    // record page was just erased, pad the record to the program size if we know what erased storage looks like
+    int erase_value = _bd->get_erase_value();
+    if (_record_buffer && erase_value >= 0) {
+        memset(_record_buffer, erase_value, _record_size);
+        memcpy(_record_buffer, &record, sizeof(FragmentationInPlaceJournal_t));
+        r = _bd->program_erased(_record_buffer, _journal + _page_size, _record_size);
+    }
+    else {
+        r = _bd->program(&record, _journal + _page_size, sizeof(FragmentationInPlaceJournal_t));
+    }
+    if (r != 0) return r;
+
+    r = _bd->erase(addr, _page_size);
+    if (r != 0) return r;
+
+    return _bd->program_erased(buffer, addr, _page_size);
+}
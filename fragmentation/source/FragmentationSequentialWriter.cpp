@@ -0,0 +1,163 @@
+/*
+ * PackageLicenseDeclared: Apache-2.0
+ * Copyright (c) 2018 ARM Limited
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "FragmentationSequentialWriter.h"
+
+FragmentationSequentialWriter::FragmentationSequentialWriter()
+    : _bd(NULL), _page_size(0), _program_size(0), _aligned_start(0), _aligned_end(0), _erased_end(0),
+      _position(0), _unit_buffer(NULL), _unit_fill(0), _active(false)
+{
+}
+
+FragmentationSequentialWriter::~FragmentationSequentialWriter() {
+    if (_unit_buffer) free(_unit_buffer);
+}
+
+int FragmentationSequentialWriter::start(FragmentationBlockDeviceWrapper *bd, bd_addr_t start, bd_addr_t limit) {
+    _bd = bd;
+    _page_size = bd->get_page_size();
+    _program_size = bd->get_program_size();
+    if (_page_size == 0) return BD_ERROR_NOT_INITIALIZED;
+    if (_program_size == 0 || _page_size % _program_size != 0) _program_size = _page_size;
+
+    if (_unit_buffer) free(_unit_buffer);
+    _unit_buffer = (uint8_t*)malloc(_program_size);
+    if (!_unit_buffer) {
+        return BD_ERROR_NO_MEMORY;
+    }
+
+    _aligned_start = ((start + _page_size - 1) / _page_size) * _page_size;
+    _aligned_end = (limit / _page_size) * _page_size;
+    if (_aligned_end < _aligned_start) _aligned_end = _aligned_start;
+
+    _erased_end = _aligned_start;
+    _position = start;
+    _unit_fill = 0;
+    _active = true;
+
+    return BD_ERROR_OK;
+}
+
+int FragmentationSequentialWriter::write(const void *a_buffer, bd_size_t size) {
+    if (!_active) return BD_ERROR_NOT_INITIALIZED;
+
+    const uint8_t *buffer = (const uint8_t*)a_buffer;
+
+    while (size > 0) {
+        // partial page at the start or the end of the region, use the generic path
+        if (_position < _aligned_start || _position >= _aligned_end) {
+            bd_size_t length = size;
+            if (_position < _aligned_start && _position + length > _aligned_start) {
+                length = _aligned_start - _position;
+            }
+
+            int r = _bd->program(buffer, _position, length);
+            if (r != 0) return r;
+
+            _position += length;
+            buffer += length;
+            size -= length;
+            continue;
+        }
+
+        // complete the program unit that is being filled
+        if (_unit_fill > 0) {
+            bd_size_t length = _program_size - _unit_fill;
+            if (length > size) length = size;
+
+            memcpy(_unit_buffer + _unit_fill, buffer, length);
+            _unit_fill += length;
+            _position += length;
+            buffer += length;
+            size -= length;
+
+            if (_unit_fill == _program_size) {
+                int r = program_units(_unit_buffer, _position - _program_size, _program_size);
+                if (r != 0) return r;
+                _unit_fill = 0;
+            }
+            continue;
+        }
+
+        // program as many complete units as possible directly from the caller's buffer, up to the end of the page
+        bd_size_t page_left = _page_size - (_position % _page_size);
+        bd_size_t length = size < page_left ? size : page_left;
+        length -= length % _program_size;
+
+        if (length > 0) {
+            int r = program_units(buffer, _position, length);
+            if (r != 0) return r;
+
+            _position += length;
+            buffer += length;
+            size -= length;
+            continue;
+        }
+
+        // less than one program unit left, keep it until more data comes in
+        memcpy(_unit_buffer, buffer, size);
+        _unit_fill = size;
+        _position += size;
+        size = 0;
+    }
+
+    return BD_ERROR_OK;
+}
+
+int FragmentationSequentialWriter::finish() {
+    if (!_active) return BD_ERROR_OK;
+
+    _active = false;
+
+    if (_unit_fill == 0) return BD_ERROR_OK;
+
+    bd_addr_t unit_addr = _position - _unit_fill;
+    bd_size_t fill = _unit_fill;
+    _unit_fill = 0;
+
+    // rest of the unit is already erased, so pad it with the erase value
+    int erase_value = _bd->get_erase_value();
+    if (erase_value >= 0) {
+        memset(_unit_buffer + fill, erase_value, _program_size - fill);
+        return program_units(_unit_buffer, unit_addr, _program_size);
+    }
+
+    return _bd->program(_unit_buffer, unit_addr, fill);
+}
+
+bool FragmentationSequentialWriter::is_active() const {
+    return _active;
+}
+
+bd_addr_t FragmentationSequentialWriter::get_position() const {
+    return _position;
+}
+
+bd_addr_t FragmentationSequentialWriter::get_programmed_end() const {
+    return _position - _unit_fill;
+}
+
+int FragmentationSequentialWriter::program_units(const uint8_t *buffer, bd_addr_t addr, bd_size_t size) {
+    // erase the page when the cursor enters it
+    while (addr + size > _erased_end) {
+        int r = _bd->erase(_erased_end, _page_size);
+        if (r != 0) return r;
+        _erased_end += _page_size;
+    }
+
+    return _bd->program_erased(buffer, addr, size);
+}
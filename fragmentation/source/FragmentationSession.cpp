@@ -23,7 +23,7 @@
 FragmentationSession::FragmentationSession(FragmentationBlockDeviceWrapper* flash, FragmentationSessionOpts_t opts)
     : _flash(flash), _opts(opts),
         _math(flash, opts.NumberOfFragments, opts.FragmentSize, opts.RedundancyPackets, opts.FlashOffset),
-        _frames_received(0)
+        _next_in_order(1), _frames_received(0)
 {
     tr_debug("FragmentationSession starting:");
     tr_debug("\tNumberOfFragments:   %d", opts.NumberOfFragments);
@@ -50,6 +50,11 @@ FragResult FragmentationSession::initialize() {
         return FRAG_NO_MEMORY;
     }
 
+    // not fatal, without the writer all fragments go through the generic path
+    if (_writer.start(_flash, _opts.FlashOffset, _opts.FlashOffset + (_opts.NumberOfFragments * _opts.FragmentSize)) != BD_ERROR_OK) {
+        tr_debug("Could not start sequential writer, writing fragments unbuffered");
+    }
+
     return FRAG_OK;
 }
 
@@ -62,7 +67,19 @@ FragResult FragmentationSession::process_frame(uint16_t index, uint8_t* buffer,
     // the first X packets contain the binary as-is... If that is the case, just store it in flash.
     // index is 1-based
     if (index <= _opts.NumberOfFragments) {
-        int r = _flash->program(buffer, _opts.FlashOffset + ((index - 1) * size), size);
+        int r;
+        if (_writer.is_active() && index == _next_in_order) {
+            r = _writer.write(buffer, size);
+            _next_in_order++;
+        }
+        else {
+            // out of order, everything from now on goes through the generic path
+            if (_writer.is_active() && _writer.finish() != 0) {
+                return FRAG_FLASH_WRITE_ERROR;
+            }
+
+            r = _flash->program(buffer, _opts.FlashOffset + ((index - 1) * size), size);
+        }
         if (r != 0) {
             return FRAG_FLASH_WRITE_ERROR;
         }
@@ -70,12 +87,20 @@ FragResult FragmentationSession::process_frame(uint16_t index, uint8_t* buffer,
         _math.set_frame_found(index);
 
         if (index == _opts.NumberOfFragments && _math.get_lost_frame_count() == 0) {
+            if (_writer.finish() != 0) {
+                return FRAG_FLASH_WRITE_ERROR;
+            }
             return FRAG_COMPLETE;
         }
 
         return FRAG_OK;
     }
 
+    // redundancy frames read back stored fragments, so they need to be in flash
+    if (_writer.is_active() && _writer.finish() != 0) {
+        return FRAG_FLASH_WRITE_ERROR;
+    }
+
     // redundancy packet coming in
     FragmentationMathSessionParams_t params;
     params.NbOfFrag = _opts.NumberOfFragments;
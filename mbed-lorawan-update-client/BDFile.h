@@ -19,6 +19,13 @@
 #define _MBED_LORAWAN_UPDATE_CLIENT_BDFILE
 
 #include "FragmentationBlockDeviceWrapper.h"
+#include "FragmentationSequentialWriter.h"
+#include "FragmentationInPlaceWriter.h"
+#include "FragmentationHeatshrinkDecoder.h"
+#include "FragmentationCheckpoint.h"
+#include "FragmentationAesCtr.h"
+#include "FragmentationSha256.h"
+#include "crc32.h"
 
 // So, janpatch uses POSIX FS calls, let's emulate them, but backed by BlockDevice driver
 
@@ -26,14 +33,150 @@ class BDFILE {
 public:
     /**
      * Creates a new BDFILE
+     * Every file has its own page buffer (allocated on first access), reads are served from it
+     * a page at a time, and writes are combined in it and only programmed when moving to another page
+     * or on fflush(). If the buffer cannot be allocated the file falls back to unbuffered access.
+     *
      * @param _bd Instance of a BlockDevice
      * @param _offset Offset of the file in flash
      * @param _size Size of the file in flash
      */
     BDFILE(FragmentationBlockDeviceWrapper* _bd, size_t _offset, size_t _size) :
-        bd(_bd), offset(_offset), size(_size), current_pos(0)
+        bd(_bd), offset(_offset), size(_size), current_pos(0),
+        page_buffer(NULL), page_size(0), buffered_page(0), buffer_valid(false), buffer_dirty(false), buffer_failed(false)
     {
+        aes_ctr = NULL;
+        decompressor = NULL;
+        compressed_size = 0;
+        compressed_pos = 0;
+        decompressed_pos = 0;
+        writer = NULL;
+        in_place_writer = NULL;
+        overwritten_by = NULL;
+        read_overwritten = false;
+        sha256 = NULL;
+        hashed_pos = 0;
+        checkpoint = NULL;
+        memset(&checkpoint_record, 0, sizeof(FragmentationCheckpoint_t));
+        checkpoint_interval = 0;
+        checkpoint_pos = 0;
+        checkpoint_crc = 0;
+        resume_length = 0;
+        resume_crc = 0;
+        resume_failed = false;
+    }
+
+    ~BDFILE() {
+        fflush();
+
+        if (page_buffer) free(page_buffer);
+    }
+
+    /**
+     * Decrypt all data read from this file, the position in the file is used as offset in the stream
+     * @param _aes_ctr Decryption session, already set up with key and nonce (or NULL to disable)
+     */
+    void set_decryption(FragmentationAesCtr* _aes_ctr) {
+        aes_ctr = _aes_ctr;
+    }
+
+    /**
+     * This file is compressed in flash, reads return the decompressed data. The size of the file
+     * is the decompressed size, or an upper bound if that is not known: reads stop at the end of the
+     * compressed data, so a short read marks the end of the file (like EOF on a POSIX file).
+     * Data is decrypted (see set_decryption()) before it's decompressed.
+     * Seeking forward decompresses and skips data, seeking backward restarts decompression from the start.
+     * @param _decompressor Decoder (already initialized), or NULL to disable
+     * @param _compressed_size Size of the compressed data in flash
+     */
+    void set_decompression(FragmentationHeatshrinkDecoder* _decompressor, size_t _compressed_size) {
+        decompressor = _decompressor;
+        compressed_size = _compressed_size;
+        compressed_pos = 0;
+        decompressed_pos = 0;
+
+        if (decompressor) decompressor->reset();
+    }
+
+    /**
+     * Write through a sequential writer (already started at the beginning of this file) as long as the
+     * writes are in order. On the first out of order access the writer is finished, and the file uses
+     * its page buffer.
+     * @param _writer Sequential writer (or NULL to disable)
+     */
+    void set_sequential_writer(FragmentationSequentialWriter* _writer) {
+        writer = _writer;
+    }
+
+    /**
+     * Write through an in-place writer (already started at the beginning of this file), this file
+     * overwrites another file while that one is being read. Only in order writes are allowed.
+     * @param _writer In-place writer (or NULL to disable)
+     */
+    void set_in_place_writer(FragmentationInPlaceWriter* _writer) {
+        in_place_writer = _writer;
+    }
+
+    /**
+     * This file is being overwritten by an in-place writer, reads of data that it already overwrote fail
+     * @param _writer In-place writer (or NULL to disable)
+     */
+    void set_overwritten_by(const FragmentationInPlaceWriter* _writer) {
+        overwritten_by = _writer;
+    }
+
+    /**
+     * Whether a read failed because the data was already overwritten (see set_overwritten_by())
+     */
+    bool read_overwritten_data() const {
+        return read_overwritten;
+    }
+
+    /**
+     * Feed all data written to this file into a SHA256 calculation (already started), so the
+     * hash is known when writing finishes. Writes that are not at the end of the hashed data
+     * (seeking back over hashed data, or leaving a gap) stop hashing, see hashed_length().
+     * @param _sha256 SHA256 calculation (or NULL to disable)
+     */
+    void set_hash(FragmentationSha256* _sha256) {
+        sha256 = _sha256;
+        hashed_pos = 0;
+    }
+
+    /**
+     * Number of bytes from the start of the file that were fed into the SHA256 calculation,
+     * or -1 if hashing stopped because the file was not written in order
+     */
+    long int hashed_length() {
+        return hashed_pos;
+    }
+
+    /**
+     * Save a checkpoint every 'interval' bytes while this file is written in order through a sequential
+     * writer, holding the length and CRC32 of the data that was programmed.
+     * When resuming from a checkpoint (target_length > 0) the data in front of it is already in flash, and is
+     * not written again: it's only checked against the CRC32 in the checkpoint (and hashed). The sequential
+     * writer must be started at the resume position.
+     * @param _checkpoint Checkpoint log (or NULL to disable)
+     * @param resume Checkpoint to resume from, or to start a new log with (target_length 0)
+     * @param interval Minimum number of bytes between checkpoints
+     */
+    void set_checkpoint(FragmentationCheckpoint* _checkpoint, const FragmentationCheckpoint_t &resume, size_t interval) {
+        checkpoint = _checkpoint;
+        checkpoint_record = resume;
+        checkpoint_interval = interval;
+        checkpoint_pos = 0;
+        checkpoint_crc = 0;
+        resume_length = resume.target_length;
+        resume_crc = resume.target_crc;
+        resume_failed = false;
+    }
 
+    /**
+     * Whether a write failed because the data did not match the checkpoint that was resumed from
+     */
+    bool checkpoint_mismatch() const {
+        return resume_failed;
     }
 
     /**
@@ -64,9 +207,34 @@ public:
     }
 
     size_t fread(void *buffer, size_t elements, size_t element_size) {
-        int r = bd->read(buffer, offset + current_pos, elements * element_size);
+        if (writer && finish_writer() != 0) return 0;
+
+        // the new data is not read back while writing in place
+        if (in_place_writer) return 0;
+
+        if (overwritten_by && overwritten_by->is_overwritten(offset + current_pos, elements * element_size)) {
+            read_overwritten = true;
+            return 0;
+        }
+
+        if (decompressor) {
+            size_t length = elements * element_size;
+            if (current_pos + length > size) length = size - current_pos;
+
+            int r = inflate(buffer, current_pos, length);
+            if (r < 0) return 0;
+
+            current_pos += r;
+            return r;
+        }
+
+        int r = read(buffer, offset + current_pos, elements * element_size);
         if (r != 0) return 0;
 
+        if (aes_ctr && !aes_ctr->decrypt(current_pos, (uint8_t*)buffer, elements * element_size)) {
+            return 0;
+        }
+
         int new_pos = current_pos + (elements * element_size);
         if (new_pos < 0) {
             return -1;
@@ -83,9 +251,46 @@ public:
     }
 
     size_t fwrite(const void *buffer, size_t elements, size_t size) {
-        int r = bd->program(buffer, offset + current_pos, elements * size);
+        // data that was written before the checkpoint we resume from is not written again
+        size_t skip = 0;
+        if (checkpoint && !skip_resumed_data((const uint8_t*)buffer, elements * size, &skip)) return 0;
+
+        const void *data = (const uint8_t*)buffer + skip;
+        size_t data_pos = current_pos + skip;
+        size_t data_size = (elements * size) - skip;
+
+        int r = 0;
+        if (data_size == 0) {
+            // all of it was in flash already
+        }
+        else if (in_place_writer) {
+            if (!in_place_writer->is_active() || in_place_writer->get_position() != offset + data_pos) return 0;
+
+            r = in_place_writer->write(data, data_size);
+        }
+        else if (writer && writer->is_active() && writer->get_position() == offset + data_pos) {
+            r = writer->write(data, data_size);
+        }
+        else {
+            // out of order, continue through the page buffer
+            if (writer && finish_writer() != 0) return 0;
+
+            r = write(data, offset + data_pos, data_size);
+        }
         if (r != 0) return 0;
 
+        if (checkpoint && update_checkpoint((const uint8_t*)buffer, elements * size, skip) != 0) return 0;
+
+        if (sha256 && hashed_pos >= 0) {
+            if (current_pos == hashed_pos) {
+                sha256->update((const uint8_t*)buffer, elements * size);
+                hashed_pos += (elements * size);
+            }
+            else {
+                hashed_pos = -1;
+            }
+        }
+
         current_pos += (elements * size);
 
         return elements * size;
@@ -95,11 +300,274 @@ public:
         return current_pos;
     }
 
+    /**
+     * Program any pending writes to the block device
+     * @returns 0 if OK, a block device error if not
+     */
+    int fflush() {
+        if (in_place_writer) return in_place_writer->finish();
+
+        if (writer) return finish_writer();
+
+        if (!buffer_dirty) return 0;
+
+        int r = bd->program(page_buffer, buffered_page * page_size, page_size);
+        if (r != 0) return r;
+
+        buffer_dirty = false;
+        return 0;
+    }
+
 private:
+    int finish_writer() {
+        int r = writer->finish();
+        writer = NULL;
+
+        // the writer bypassed the page buffer
+        if (!buffer_dirty) buffer_valid = false;
+
+        return r;
+    }
+
+    /**
+     * Check data that is written in front of the checkpoint that we resume from
+     * @param skip Out parameter, number of bytes at the start of the buffer that are already in flash
+     * @returns false if the data does not match the checkpoint
+     */
+    bool skip_resumed_data(const uint8_t *buffer, size_t length, size_t *skip) {
+        *skip = 0;
+
+        if (static_cast<size_t>(current_pos) != checkpoint_pos) {
+            // the data in flash can only be verified when it's written in order
+            if (static_cast<size_t>(current_pos) < resume_length) {
+                resume_failed = true;
+                return false;
+            }
+
+            // out of order, the checkpoints no longer describe what's in flash
+            checkpoint->clear();
+            checkpoint = NULL;
+            return true;
+        }
+
+        if (static_cast<size_t>(current_pos) >= resume_length) return true;
+
+        *skip = resume_length - current_pos;
+        if (*skip > length) *skip = length;
+
+        checkpoint_crc = crc32(checkpoint_crc, buffer, *skip);
+
+        if (current_pos + *skip == resume_length && checkpoint_crc != resume_crc) {
+            resume_failed = true;
+            return false;
+        }
+
+        return true;
+    }
+
+    /**
+     * Add written data to the CRC32, and save a checkpoint once 'checkpoint_interval' bytes were programmed
+     * @returns 0 if OK, negative value if saving the checkpoint failed
+     */
+    int update_checkpoint(const uint8_t *buffer, size_t length, size_t skip) {
+        if (!checkpoint) return 0;
+
+        size_t start = checkpoint_pos + skip;
+        uint32_t start_crc = checkpoint_crc;
+
+        checkpoint_crc = crc32(checkpoint_crc, buffer + skip, length - skip);
+        checkpoint_pos += length;
+
+        // data in the page buffer or in the writer's program unit is not in flash yet
+        if (!writer || !writer->is_active()) return 0;
+
+        size_t programmed = writer->get_programmed_end() - offset;
+        if (programmed < checkpoint_record.target_length + checkpoint_interval) return 0;
+
+        // programmed data ends in an earlier write, we don't have the CRC32 for that, try again on the next one
+        if (programmed < start) return 0;
+
+        checkpoint_record.target_length = programmed;
+        checkpoint_record.target_crc = crc32(start_crc, buffer + skip, programmed - start);
+        return checkpoint->save(&checkpoint_record);
+    }
+
+    /**
+     * Decompress length bytes, starting at (decompressed) position pos
+     * @returns number of bytes decompressed (less than length at the end of the compressed data),
+     *          negative value if reading or decompressing failed
+     */
+    int inflate(void *a_buffer, size_t pos, size_t length) {
+        if (pos < decompressed_pos) {
+            decompressor->reset();
+            compressed_pos = 0;
+            decompressed_pos = 0;
+        }
+
+        // skip forward
+        uint8_t skip_buffer[16];
+        while (decompressed_pos < pos) {
+            size_t skip = pos - decompressed_pos;
+            if (skip > sizeof(skip_buffer)) skip = sizeof(skip_buffer);
+
+            int r = decompress(skip_buffer, skip);
+            if (r < 0) return r;
+            if (static_cast<size_t>(r) < skip) return 0;
+        }
+
+        return decompress((uint8_t*)a_buffer, length);
+    }
+
+    int decompress(uint8_t *buffer, size_t length) {
+        uint8_t in[16];
+        size_t decompressed = 0;
+
+        while (decompressed < length) {
+            size_t in_size = compressed_size - compressed_pos;
+            if (in_size > sizeof(in)) in_size = sizeof(in);
+
+            if (in_size > 0) {
+                int r = read(in, offset + compressed_pos, in_size);
+                if (r != 0) return r;
+
+                if (aes_ctr && !aes_ctr->decrypt(compressed_pos, in, in_size)) {
+                    return -1;
+                }
+            }
+
+            // input that's not used is read again on the next round, through the page buffer
+            size_t in_used, out_used;
+            int r = decompressor->decode(in, in_size, &in_used, buffer + decompressed, length - decompressed, &out_used);
+            if (r != 0) return r;
+
+            // end of the compressed data (what's left are padding bits)
+            if (in_used == 0 && out_used == 0) break;
+
+            compressed_pos += in_used;
+            decompressed_pos += out_used;
+            decompressed += out_used;
+        }
+
+        return decompressed;
+    }
+
+    // no copies, the page buffer is owned by this file
+    BDFILE(const BDFILE&);
+    BDFILE& operator=(const BDFILE&);
+
+    /**
+     * Make sure the page buffer holds the page at address
+     * @returns false if the file is unbuffered
+     */
+    bool load_page(size_t address, int *error) {
+        *error = 0;
+
+        if (!page_buffer) {
+            if (buffer_failed) return false;
+
+            page_size = bd->get_page_size();
+            page_buffer = page_size > 0 ? (uint8_t*)malloc(page_size) : NULL;
+            if (!page_buffer) {
+                buffer_failed = true;
+                return false;
+            }
+        }
+
+        uint32_t page = address / page_size;
+        if (buffer_valid && page == buffered_page) return true;
+
+        *error = fflush();
+        if (*error != 0) return true;
+
+        buffer_valid = false;
+        *error = bd->read(page_buffer, page * page_size, page_size);
+        if (*error != 0) return true;
+
+        buffered_page = page;
+        buffer_valid = true;
+        return true;
+    }
+
+    int read(void *a_buffer, size_t address, size_t length) {
+        uint8_t *buffer = (uint8_t*)a_buffer;
+
+        while (length > 0) {
+            int r;
+            if (!load_page(address, &r)) {
+                return bd->read(buffer, address, length);
+            }
+            if (r != 0) return r;
+
+            size_t page_offset = address % page_size;
+            size_t chunk = page_size - page_offset;
+            if (chunk > length) chunk = length;
+
+            memcpy(buffer, page_buffer + page_offset, chunk);
+
+            buffer += chunk;
+            address += chunk;
+            length -= chunk;
+        }
+
+        return 0;
+    }
+
+    int write(const void *a_buffer, size_t address, size_t length) {
+        const uint8_t *buffer = (const uint8_t*)a_buffer;
+
+        while (length > 0) {
+            int r;
+            if (!load_page(address, &r)) {
+                return bd->program(buffer, address, length);
+            }
+            if (r != 0) return r;
+
+            size_t page_offset = address % page_size;
+            size_t chunk = page_size - page_offset;
+            if (chunk > length) chunk = length;
+
+            memcpy(page_buffer + page_offset, buffer, chunk);
+            buffer_dirty = true;
+
+            buffer += chunk;
+            address += chunk;
+            length -= chunk;
+        }
+
+        return 0;
+    }
+
     FragmentationBlockDeviceWrapper* bd;
     size_t offset;
     size_t size;
     int current_pos;
+    FragmentationAesCtr* aes_ctr;
+    FragmentationHeatshrinkDecoder* decompressor;
+    size_t compressed_size;
+    size_t compressed_pos;
+    size_t decompressed_pos;
+    FragmentationSequentialWriter* writer;
+    FragmentationInPlaceWriter* in_place_writer;
+    const FragmentationInPlaceWriter* overwritten_by;
+    bool read_overwritten;
+    FragmentationSha256* sha256;
+    long int hashed_pos;
+    FragmentationCheckpoint* checkpoint;
+    FragmentationCheckpoint_t checkpoint_record;    // last saved checkpoint
+    size_t checkpoint_interval;
+    size_t checkpoint_pos;                          // data up to here is in checkpoint_crc
+    uint32_t checkpoint_crc;
+    size_t resume_length;
+    uint32_t resume_crc;
+    bool resume_failed;
+
+    // per-stream page buffer
+    uint8_t* page_buffer;
+    size_t page_size;
+    uint32_t buffered_page;
+    bool buffer_valid;
+    bool buffer_dirty;
+    bool buffer_failed;
 };
 
 // Functions similar to the POSIX functions
@@ -119,4 +587,8 @@ size_t bd_fwrite(const void *buffer, size_t elements, size_t size, BDFILE *file)
     return file->fwrite(buffer, elements, size);
 }
 
+int bd_fflush(BDFILE *file) {
+    return file->fflush();
+}
+
 #endif // _MBED_LORAWAN_UPDATE_CLIENT_BDFILE
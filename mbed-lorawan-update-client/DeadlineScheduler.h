@@ -0,0 +1,356 @@
+/*
+* PackageLicenseDeclared: Apache-2.0
+* Copyright (c) 2018 ARM Limited
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*     http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+#ifndef _MBED_LORAWAN_UPDATE_CLIENT_DEADLINE_SCHEDULER
+#define _MBED_LORAWAN_UPDATE_CLIENT_DEADLINE_SCHEDULER
+
+#include "mbed.h"
+#include "platform/mbed_critical.h"
+
+typedef struct {
+    // number of events that were handed to the handler
+    uint32_t count;
+    // time between the timer interrupt and the start of the handler, for the last event and the worst case
+    uint32_t last_latency_us;
+    uint32_t max_latency_us;
+} DeadlineSchedulerStats_t;
+
+/**
+ * Schedules events (an owner, e.g. a multicast group, and an event type) at a deadline.
+ *
+ * Deadlines are absolute 64-bit timestamps (in microseconds) of the low power ticker, or of the microsecond ticker
+ * on targets without one. Pending events are kept in a min-heap on their deadline, and only the nearest deadline
+ * is inserted in the ticker, it's only re-inserted when the nearest deadline changes.
+ * When the ticker fires all events that are due are handed to the handler, with the owner and the type
+ * bound to the call. If an EventQueue is set the handler is posted to it, otherwise it runs in the timer interrupt.
+ * The latency between the timer interrupt and the handler is recorded for every event.
+ *
+ * An owner has at most one pending event of every type, scheduling it again moves the deadline.
+ */
+template <size_t N>
+class DeadlineScheduler : private TimerEvent {
+public:
+    DeadlineScheduler() :
+#if defined (DEVICE_LPTICKER)
+        TimerEvent(get_lp_ticker_data()),
+#else
+        TimerEvent(get_us_ticker_data()),
+#endif
+        _count(0), _queue(NULL), _armed(false)
+    {
+        reset_stats();
+    }
+
+    ~DeadlineScheduler() {
+        core_util_critical_section_enter();
+        _count = 0;
+        arm();
+        core_util_critical_section_exit();
+    }
+
+    /**
+     * Set the function that handles events
+     *
+     * @param handler Invoked with the owner and the type of the event
+     */
+    void set_handler(Callback<void(uint8_t, uint8_t)> handler) {
+        _handler = handler;
+    }
+
+    /**
+     * Dispatch events through an event queue instead of from the timer interrupt
+     *
+     * @param queue Event queue, or NULL to dispatch from the timer interrupt
+     */
+    void set_event_queue(EventQueue *queue) {
+        _queue = queue;
+    }
+
+    /**
+     * Schedule an event, replaces the pending event of the same owner and type
+     *
+     * @param owner Owner of the event
+     * @param type Type of the event
+     * @param delay_us Time from now until the event is due, in microseconds
+     *
+     * @returns false if the scheduler is full
+     */
+    bool schedule(uint8_t owner, uint8_t type, uint64_t delay_us) {
+        return schedule_at(owner, type, now_us() + delay_us);
+    }
+
+    /**
+     * Schedule an event at an absolute deadline, replaces the pending event of the same owner and type
+     *
+     * @param owner Owner of the event
+     * @param type Type of the event
+     * @param deadline_us Ticker timestamp (see now_us) at which the event is due, in microseconds
+     *
+     * @returns false if the scheduler is full
+     */
+    bool schedule_at(uint8_t owner, uint8_t type, uint64_t deadline_us) {
+        core_util_critical_section_enter();
+
+        remove_event(owner, type);
+
+        bool added = false;
+        if (_count < N) {
+            _heap[_count].deadline = deadline_us;
+            _heap[_count].owner = owner;
+            _heap[_count].type = type;
+            sift_up(_count);
+            _count++;
+            added = true;
+        }
+
+        arm();
+
+        core_util_critical_section_exit();
+
+        return added;
+    }
+
+    /**
+     * Cancel the pending event of an owner and type, if any
+     */
+    void cancel(uint8_t owner, uint8_t type) {
+        core_util_critical_section_enter();
+        remove_event(owner, type);
+        arm();
+        core_util_critical_section_exit();
+    }
+
+    /**
+     * Cancel all pending events of an owner
+     */
+    void cancel_all(uint8_t owner) {
+        core_util_critical_section_enter();
+
+        for (size_t ix = _count; ix > 0; ix--) {
+            if (_heap[ix - 1].owner == owner) {
+                remove_at(ix - 1);
+            }
+        }
+        arm();
+
+        core_util_critical_section_exit();
+    }
+
+    /**
+     * Whether an event of an owner and type is pending
+     */
+    bool is_scheduled(uint8_t owner, uint8_t type) {
+        core_util_critical_section_enter();
+        bool scheduled = find(owner, type) < _count;
+        core_util_critical_section_exit();
+        return scheduled;
+    }
+
+    /**
+     * Current timestamp of the ticker that the deadlines are based on, in microseconds
+     */
+    uint64_t now_us() {
+        return ticker_read_us(_ticker_data);
+    }
+
+    /**
+     * Number of pending events
+     */
+    size_t size() {
+        return _count;
+    }
+
+    /**
+     * Get the number of handled events and the latency between the timer interrupt and the handler
+     */
+    void get_stats(DeadlineSchedulerStats_t *stats) {
+        core_util_critical_section_enter();
+        *stats = _stats;
+        core_util_critical_section_exit();
+    }
+
+    void reset_stats() {
+        core_util_critical_section_enter();
+        memset(&_stats, 0, sizeof(DeadlineSchedulerStats_t));
+        core_util_critical_section_exit();
+    }
+
+private:
+    typedef struct {
+        uint64_t deadline;
+        uint8_t owner;
+        uint8_t type;
+    } DeadlineEvent_t;
+
+    size_t find(uint8_t owner, uint8_t type) {
+        for (size_t ix = 0; ix < _count; ix++) {
+            if (_heap[ix].owner == owner && _heap[ix].type == type) return ix;
+        }
+        return _count;
+    }
+
+    void remove_event(uint8_t owner, uint8_t type) {
+        size_t ix = find(owner, type);
+        if (ix < _count) {
+            remove_at(ix);
+        }
+    }
+
+    void remove_at(size_t ix) {
+        _count--;
+        if (ix == _count) return;
+
+        // move the last event into the hole, it can go either way from there
+        _heap[ix] = _heap[_count];
+        sift_up(ix);
+        sift_down(ix);
+    }
+
+    void swap(size_t a, size_t b) {
+        DeadlineEvent_t tmp = _heap[a];
+        _heap[a] = _heap[b];
+        _heap[b] = tmp;
+    }
+
+    void sift_up(size_t ix) {
+        while (ix > 0) {
+            size_t parent = (ix - 1) / 2;
+            if (_heap[parent].deadline <= _heap[ix].deadline) break;
+            swap(parent, ix);
+            ix = parent;
+        }
+    }
+
+    void sift_down(size_t ix) {
+        while (true) {
+            size_t smallest = ix;
+            size_t left = (2 * ix) + 1;
+            size_t right = left + 1;
+
+            if (left < _count && _heap[left].deadline < _heap[smallest].deadline) smallest = left;
+            if (right < _count && _heap[right].deadline < _heap[smallest].deadline) smallest = right;
+            if (smallest == ix) break;
+
+            swap(smallest, ix);
+            ix = smallest;
+        }
+    }
+
+    /**
+     * Insert the nearest deadline in the ticker, must be called with interrupts disabled
+     */
+    void arm() {
+        if (_count == 0) {
+            if (_armed) {
+                remove();
+                _armed = false;
+#if !defined (DEVICE_LPTICKER)
+                sleep_manager_unlock_deep_sleep();
+#endif
+            }
+            return;
+        }
+
+        // already waiting for this deadline, re-inserting it would only cost a ticker reprogram
+        if (_armed && _armed_deadline == _heap[0].deadline) return;
+
+        if (_armed) {
+            remove();
+        }
+#if !defined (DEVICE_LPTICKER)
+        else {
+            // the microsecond ticker stops in deep sleep
+            sleep_manager_lock_deep_sleep();
+        }
+#endif
+
+        _armed = true;
+        _armed_deadline = _heap[0].deadline;
+        insert_absolute(_armed_deadline);
+    }
+
+    /**
+     * Ticker interrupt, hands all events that are due to the handler
+     */
+    virtual void handler() {
+        // the ticker already removed this event
+        core_util_critical_section_enter();
+        if (_armed) {
+            _armed = false;
+#if !defined (DEVICE_LPTICKER)
+            sleep_manager_unlock_deep_sleep();
+#endif
+        }
+        core_util_critical_section_exit();
+
+        while (true) {
+            core_util_critical_section_enter();
+
+            if (_count == 0 || _heap[0].deadline > now_us()) {
+                arm();
+                core_util_critical_section_exit();
+                break;
+            }
+
+            DeadlineEvent_t ev = _heap[0];
+            remove_at(0);
+
+            uint64_t fired_at = now_us();
+
+            core_util_critical_section_exit();
+
+            if (!_handler) continue;
+
+            // without a queue, or when the queue is full, run the handler here. A lost timeout would keep the device in class C
+            if (!_queue || _queue->call(callback(this, &DeadlineScheduler::dispatch), ev.owner, ev.type, fired_at) == 0) {
+                dispatch(ev.owner, ev.type, fired_at);
+            }
+        }
+    }
+
+    /**
+     * Hands an event to the handler, runs in the timer interrupt or in the context of the event queue
+     *
+     * @param fired_at Time at which the timer interrupt popped the event
+     */
+    void dispatch(uint8_t owner, uint8_t type, uint64_t fired_at) {
+        uint64_t latency = now_us() - fired_at;
+        if (latency > UINT32_MAX) latency = UINT32_MAX;
+
+        core_util_critical_section_enter();
+        _stats.count++;
+        _stats.last_latency_us = static_cast<uint32_t>(latency);
+        if (_stats.last_latency_us > _stats.max_latency_us) {
+            _stats.max_latency_us = _stats.last_latency_us;
+        }
+        core_util_critical_section_exit();
+
+        _handler(owner, type);
+    }
+
+    DeadlineEvent_t _heap[N];
+    size_t _count;
+
+    Callback<void(uint8_t, uint8_t)> _handler;
+    EventQueue *_queue;
+    DeadlineSchedulerStats_t _stats;
+
+    bool _armed;
+    uint64_t _armed_deadline;
+};
+
+#endif // _MBED_LORAWAN_UPDATE_CLIENT_DEADLINE_SCHEDULER
@@ -26,10 +26,14 @@
 #include "FragmentationEcdsaVerify.h"
 #include "FragmentationBlockDeviceWrapper.h"
 #include "FragmentationCrc32.h"
+#include "FragmentationAes.h"
+#include "FragmentationCmac.h"
+#include "FragmentationAesCtr.h"
 #include "arm_uc_metadata_header_v2.h"
 #include "update_signature.h"
 #include "update_types.h"
-#include "tiny-aes.h"   // @todo: replace by Mbed TLS / hw crypto?
+#include "DeadlineScheduler.h"
+#include "OutboundQueue.h"
 
 #if !MBED_CONF_RTOS_PRESENT && !defined(TARGET_SIMULATOR)
 #include "clock.h"
@@ -46,6 +50,11 @@
 #define NB_MC_GROUPS          1
 #endif // NB_MC_GROUPS
 
+// McGroupIDHeader is two bits
+#if NB_MC_GROUPS > 4
+#error "NB_MC_GROUPS can be at most 4"
+#endif
+
 #ifndef LW_UC_SHA256_BUFFER_SIZE
 #define LW_UC_SHA256_BUFFER_SIZE       128
 #endif // LW_UC_SHA256_BUFFER_SIZE
@@ -54,6 +63,71 @@
 #define LW_UC_JANPATCH_BUFFER_SIZE     528
 #endif // LW_UC_JANPATCH_BUFFER_SIZE
 
+// in-place delta updates write the new firmware over the old firmware in slot 2, otherwise it goes into slot 1
+#if defined(MBED_CONF_LORAWAN_UPDATE_CLIENT_IN_PLACE_DELTA_JOURNAL_ADDRESS)
+#define LW_UC_DELTA_TARGET_HEADER_ADDRESS   MBED_CONF_LORAWAN_UPDATE_CLIENT_SLOT2_HEADER_ADDRESS
+#define LW_UC_DELTA_TARGET_FW_ADDRESS       MBED_CONF_LORAWAN_UPDATE_CLIENT_SLOT2_FW_ADDRESS
+#else
+#define LW_UC_DELTA_TARGET_HEADER_ADDRESS   MBED_CONF_LORAWAN_UPDATE_CLIENT_SLOT1_HEADER_ADDRESS
+#define LW_UC_DELTA_TARGET_FW_ADDRESS       MBED_CONF_LORAWAN_UPDATE_CLIENT_SLOT1_FW_ADDRESS
+#endif
+
+// resuming replays the patch against the old firmware, so checkpoints are not used for in-place delta updates
+#if defined(MBED_CONF_LORAWAN_UPDATE_CLIENT_DELTA_CHECKPOINT_ADDRESS) && !defined(MBED_CONF_LORAWAN_UPDATE_CLIENT_IN_PLACE_DELTA_JOURNAL_ADDRESS)
+#define LW_UC_DELTA_CHECKPOINTS
+#endif
+
+// in-place delta updates always patch the baseline in slot 2, so slot roles are only rotated when slot 1 is used
+#if defined(MBED_CONF_LORAWAN_UPDATE_CLIENT_SLOT_TABLE_ADDRESS) && !defined(MBED_CONF_LORAWAN_UPDATE_CLIENT_IN_PLACE_DELTA_JOURNAL_ADDRESS)
+#define LW_UC_SLOT_TABLE
+#endif
+
+#ifndef LW_UC_DECOMPRESS_BUFFER_SIZE
+#define LW_UC_DECOMPRESS_BUFFER_SIZE   128
+#endif // LW_UC_DECOMPRESS_BUFFER_SIZE
+
+// upper bound for the size of a decompressed diff, janpatch escapes at most every byte of the new firmware
+#define LW_UC_COMPRESSED_DIFF_MAX_SIZE  (2 * MBED_CONF_LORAWAN_UPDATE_CLIENT_SLOT_SIZE)
+
+// minimum time between two clock syncs for them to be used to estimate the drift of the RTC
+#ifndef LW_UC_CLOCK_DRIFT_MIN_INTERVAL
+#define LW_UC_CLOCK_DRIFT_MIN_INTERVAL  3600
+#endif // LW_UC_CLOCK_DRIFT_MIN_INTERVAL
+
+// corrections that imply a larger drift than this are treated as a step of the clock, not as drift
+#ifndef LW_UC_CLOCK_DRIFT_MAX_PPM
+#define LW_UC_CLOCK_DRIFT_MAX_PPM       1000
+#endif // LW_UC_CLOCK_DRIFT_MAX_PPM
+
+// time between the AppTimeReq messages of a ForceDeviceResyncReq, plus a random 0..jitter seconds,
+// so the uplinks don't run into the duty cycle and devices that got the same request spread out
+#ifndef LW_UC_CLOCK_RESYNC_INTERVAL
+#define LW_UC_CLOCK_RESYNC_INTERVAL     20
+#endif // LW_UC_CLOCK_RESYNC_INTERVAL
+
+#ifndef LW_UC_CLOCK_RESYNC_JITTER
+#define LW_UC_CLOCK_RESYNC_JITTER       10
+#endif // LW_UC_CLOCK_RESYNC_JITTER
+
+// minimum time between automatic AppTimeReq messages (the shortest periodicity in the spec)
+#ifndef LW_UC_CLOCK_SYNC_MIN_INTERVAL
+#define LW_UC_CLOCK_SYNC_MIN_INTERVAL   128
+#endif // LW_UC_CLOCK_SYNC_MIN_INTERVAL
+
+// number of uplink messages that the outbound queue holds
+#ifndef LW_UC_OUTBOUND_QUEUE_SIZE
+#define LW_UC_OUTBOUND_QUEUE_SIZE       4
+#endif // LW_UC_OUTBOUND_QUEUE_SIZE
+
+// largest uplink payload, answers are only combined into one uplink up to this size
+#ifndef LW_UC_OUTBOUND_MAX_LENGTH
+#define LW_UC_OUTBOUND_MAX_LENGTH       51
+#endif // LW_UC_OUTBOUND_MAX_LENGTH
+
+#ifndef LW_UC_DATA_BLOCK_AUTH_BUFFER_SIZE
+#define LW_UC_DATA_BLOCK_AUTH_BUFFER_SIZE     528
+#endif // LW_UC_DATA_BLOCK_AUTH_BUFFER_SIZE
+
 enum LW_UC_STATUS {
     LW_UC_OK = 0,
     LW_UC_INVALID_PACKET_LENGTH = 1,
@@ -77,7 +151,18 @@ enum LW_UC_STATUS {
     LW_UC_INTERNALFLASH_DEINIT_ERROR = 19,
     LW_UC_INTERNALFLASH_SECTOR_SIZE_SMALLER = 20,
     LW_UC_INTERNALFLASH_HEADER_PARSE_FAILED = 21,
-    LW_UC_NOT_CLASS_C_SESSION_ANS = 22
+    LW_UC_NOT_CLASS_C_SESSION_ANS = 22,
+    LW_UC_DATA_BLOCK_AUTH_NOT_PENDING = 23,
+    LW_UC_DATA_BLOCK_AUTH_FAILED = 24,
+    LW_UC_DECRYPTION_KEY_MISSING = 25,
+    LW_UC_DECRYPTION_FAILED = 26,
+    LW_UC_DIFF_IN_PLACE_SOURCE_OVERWRITTEN = 27,
+    LW_UC_DIFF_IN_PLACE_INTERRUPTED = 28,
+    LW_UC_DECOMPRESSION_FAILED = 29,
+    LW_UC_DIFF_RESUME_FAILED = 30,
+    LW_UC_MC_FRAME_COUNTER_OUT_OF_WINDOW = 31,
+    LW_UC_MC_FRAME_COUNTER_REPLAYED = 32,
+    LW_UC_OUTBOUND_QUEUE_EMPTY = 33
 };
 
 enum LW_UC_EVENT {
@@ -103,23 +188,75 @@ public:
         // @todo: what if genAppKey is in secure element?
         memcpy(_genAppKey, genAppKey, 16);
 
+        memset(_fwDecryptionKey, 0, 16);
+        _fwDecryptionKeySet = false;
+        _mcKEKeyDerived = false;
+
+        seedRandom();
+
         for (size_t ix = 0; ix < NB_FRAG_GROUPS; ix++) {
             frag_sessions[ix].active = false;
             frag_sessions[ix].session = NULL;
+            frag_sessions[ix].dataBlockAuthPending = false;
         }
 
         for (size_t ix = 0; ix < NB_MC_GROUPS; ix++) {
             mc_groups[ix].active = false;
+            mc_groups[ix].classCActive = false;
+            mc_groups[ix].lastActivityMs = 0;
         }
 
-        _clockSync.correction = 0;
-        _clockSync.rtcValueAtLastRequest = 0;
+        _mcScheduler.set_handler(callback(this, &LoRaWANUpdateClient::mc_event));
+        memset(&_stats, 0, sizeof(LoRaWANUpdateClientStats_t));
+#if MBED_CONF_RTOS_PRESENT
+        // keep the user callbacks out of the timer interrupt, they reconfigure the LoRaWAN stack
+        _mcScheduler.set_event_queue(mbed_event_queue());
+#endif
+
+        _clockSync.synced = false;
+        _clockSync.correctionMs = 0;
+        _clockSync.timeAtLastRequestMs = 0;
+        _clockSync.deviceTimeAtLastRequestMs = 0;
+        _clockSync.timeAtLastSyncMs = 0;
+        _clockSync.driftPpm = 0;
+        _clockSync.driftUncertaintyPpm = MBED_CONF_LORAWAN_UPDATE_CLIENT_CLOCK_DRIFT_PPM;
+        _clockSync.driftEstimated = false;
+        _clockSync.driftBaseValid = false;
+        _clockSync.driftBaseTimeMs = 0;
+        _clockSync.driftBaseCorrectionMs = 0;
+        _clockSync.periodicity = 0;
+        _clockSync.resyncRemaining = 0;
+        _clockSync.periodicRequestQueued = false;
         _clockSyncTokenReq = 0;
 
+        _clockScheduler.set_handler(callback(this, &LoRaWANUpdateClient::clock_event));
+        _fragScheduler.set_handler(callback(this, &LoRaWANUpdateClient::frag_event));
+#if MBED_CONF_RTOS_PRESENT
+        _clockScheduler.set_event_queue(mbed_event_queue());
+        _fragScheduler.set_event_queue(mbed_event_queue());
+#endif
+
         callbacks.fragSessionComplete = NULL;
         callbacks.firmwareReady = NULL;
         callbacks.switchToClassC = NULL;
         callbacks.switchToClassA = NULL;
+        callbacks.outboundPending = NULL;
+
+        _progressPhase = LW_UC_PROGRESS_DECODE;
+        _progressPct = -1;
+        _patchProgressSize = 0;
+
+        _outboundDeferred = false;
+
+        resetSlotTable();
+#if defined(LW_UC_SLOT_TABLE)
+        _slotTableCopy = 1;
+#endif
+
+#if defined(MBED_CONF_LORAWAN_UPDATE_CLIENT_SLOT2_VERIFIED_RECORD_ADDRESS)
+        // any write to slot 2 (header or firmware) invalidates the verified record
+        watchSlot2VerifiedRecord();
+#endif
     }
 
     /**
@@ -145,7 +282,10 @@ public:
                 return handleFragmentationDeleteReq(buffer + 1, length - 1);
 
             case FRAG_SESSION_STATUS_REQ:
-                return handleFragmentationStatusReq(buffer + 1, length - 1);
+                return handleFragmentationStatusReq(devAddr, buffer + 1, length - 1);
+
+            case DATA_BLOCK_AUTH_ANS:
+                return handleDataBlockAuthAns(buffer + 1, length - 1);
 
             case PACKAGE_VERSION_REQ:
                 return handleFragmentationPackageVersionReq(buffer + 1, length - 1);
@@ -155,6 +295,38 @@ public:
         }
     }
 
+    /**
+     * Handle packets that came in on the fragmentation port, and check the frame counter of multicast frames.
+     * Frames on a multicast group are dropped, before they're processed, when their frame counter is outside of
+     * the window of the group (minFcFCount <= fCnt < maxFcFCount) or when a frame with this frame counter
+     * (or a later one) was already received.
+     *
+     * @param devAddr The device address that received this message (or 0x0 in unicast)
+     * @param buffer Data buffer
+     * @param length Length of the data buffer
+     * @param fCnt Frame counter of the downlink (McFCount for multicast frames)
+     */
+    LW_UC_STATUS handleFragmentationCommand(uint32_t devAddr, uint8_t *buffer, size_t length, uint32_t fCnt) {
+        MulticastGroupParams_t *mcGroup = mcGroupFromDevAddr(devAddr);
+        if (mcGroup != NULL) {
+            if (fCnt < mcGroup->minFcFCount || fCnt >= mcGroup->maxFcFCount) {
+                tr_debug("dropping frame, McFCount %lu outside of window [%lu, %lu)", fCnt, mcGroup->minFcFCount, mcGroup->maxFcFCount);
+                _stats.mcFramesOutOfWindow++;
+                return LW_UC_MC_FRAME_COUNTER_OUT_OF_WINDOW;
+            }
+
+            if (fCnt < mcGroup->nextFcFCount) {
+                tr_debug("dropping frame, McFCount %lu was already received", fCnt);
+                _stats.mcFramesReplayed++;
+                return LW_UC_MC_FRAME_COUNTER_REPLAYED;
+            }
+
+            mcGroup->nextFcFCount = fCnt + 1;
+        }
+
+        return handleFragmentationCommand(devAddr, buffer, length);
+    }
+
     /**
      * Handle packets that came in on the multicast control port (e.g. 200)
      */
@@ -163,6 +335,10 @@ public:
 
         switch (buffer[0]) {
             case MC_GROUP_SETUP_REQ:
+                // several McGroupSetupReq commands can be concatenated in one downlink
+                if (length > 1 + MC_GROUP_SETUP_REQ_LENGTH) {
+                    return handleMulticastSetupReqBatch(buffer, length);
+                }
                 return handleMulticastSetupReq(buffer + 1, length - 1);
 
             case MC_GROUP_DELETE_REQ:
@@ -209,25 +385,14 @@ public:
     /**
      * Request in band synchronisation between RTC and GPS clock.
      * The sync will happen in a downlink message (see handleClockAppTimeAns).
+     * Call this from the thread that handles downlinks.
      *
      * @param answerRequired Whether the network should also send a message when the clock is in sync,
      *                       if not enabled the network only replies when clock drift is >250 ms.
      */
     LW_UC_STATUS requestClockSync(bool answerRequired) {
-        uint32_t deviceTime = static_cast<uint32_t>(getCurrentTime_s() % 4294967296 /*pow(2, 32)*/);
-        uint8_t param = _clockSyncTokenReq % 16;
-        param += (answerRequired ? 0b10000 : 0);
-
-        uint8_t request[CLOCK_APP_TIME_REQ_LENGTH] = {
-            CLOCK_APP_TIME_REQ,
-            static_cast<uint8_t>(deviceTime & 0xff),
-            static_cast<uint8_t>(deviceTime >> 8 & 0xff),
-            static_cast<uint8_t>(deviceTime >> 16 & 0xff),
-            static_cast<uint8_t>(deviceTime >> 24 & 0xff),
-            param
-        };
-
-        _clockSync.rtcValueAtLastRequest = get_rtc_time_s();
+        uint8_t request[CLOCK_APP_TIME_REQ_LENGTH];
+        buildClockSyncRequest(request, answerRequired);
 
         // This message SHALL only be transmitted a single time with a given DeviceTime payload,
         // as the network reception time stamp will be used by the application server to compute
@@ -245,18 +410,37 @@ public:
      * RTC value is ready from the Mbed APIs, so no need to provide this (@todo: should be pluggable for external RTC).
      *
      * @param gpsTime   Current time in seconds since 00:00:00, Sunday 6th of January 1980 (start of the GPS epoch)
+     * @param gpsTimeMs Milliseconds part of the current time, if known (e.g. the fractional part of DeviceTimeAns)
      */
-    void outOfBandClockSync(uint32_t gpsTime) {
-        _clockSync.correction = gpsTime - get_rtc_time_s();
+    void outOfBandClockSync(uint32_t gpsTime, uint16_t gpsTimeMs = 0) {
+        uint64_t timeMs = get_time_ms();
+
+        applyClockCorrection((static_cast<int64_t>(gpsTime) * 1000) + gpsTimeMs - static_cast<int64_t>(timeMs), timeMs);
 
         updateMcGroupsBasedOnNewTime();
     }
 
     /**
      * Get the current time - in seconds since 00:00:00, Sunday 6th of January 1980 (start of the GPS epoch)
+     * The drift of the clock since the last clock sync is compensated for, once it has been estimated.
      */
     uint64_t getCurrentTime_s() {
-        return get_rtc_time_s() + _clockSync.correction;
+        return getCurrentTime_ms() / 1000;
+    }
+
+    /**
+     * Get the current time - in milliseconds since 00:00:00, Sunday 6th of January 1980 (start of the GPS epoch)
+     */
+    uint64_t getCurrentTime_ms() {
+        return getGpsTime_ms(get_time_ms());
+    }
+
+    /**
+     * Get the estimated drift of the RTC against GPS time in ppm (positive when the RTC runs slow),
+     * 0 until two clock syncs at least LW_UC_CLOCK_DRIFT_MIN_INTERVAL seconds apart were received
+     */
+    int32_t getClockDriftPpm() {
+        return _clockSync.driftPpm;
     }
 
     /**
@@ -280,28 +464,272 @@ public:
             return LW_UC_NOT_CLASS_C_SESSION_ANS;
         }
 
-        uint32_t originalTimeToStart = queued_message->data[2] + (queued_message->data[3] << 8) + (queued_message->data[4] << 16);
-
         // calculate delta between original send time and now
         uint32_t timeDelta = get_rtc_time_s() - queued_message->createdTimestamp;
 
-        uint32_t timeToStart;
-        if (timeDelta > originalTimeToStart) { // should already have started, send 0 back
-            timeToStart = 0;
+        rewriteClassCSessionAns(queued_message->data, timeDelta);
+
+        return LW_UC_OK;
+    }
+
+    /**
+     * Hand outbound messages to the send function only when the application asks for them (sendNextOutbound),
+     * e.g. when the duty cycle allows the next uplink. Messages wait in the outbound queue until then, and answers
+     * on the same port are combined. By default messages are sent after handling the downlink that caused them.
+     *
+     * @param deferred Whether to defer sending
+     */
+    void setOutboundDeferred(bool deferred) {
+        _outboundDeferred = deferred;
+
+        if (!deferred) {
+            flushOutbound();
+        }
+    }
+
+    /**
+     * Send the next message from the outbound queue through the send function.
+     * Time-relative fields (e.g. timeToStart in a ClassCSessionAns, DeviceTime in an AppTimeReq) are
+     * updated to the current time first.
+     *
+     * @returns LW_UC_OUTBOUND_QUEUE_EMPTY if there was nothing to send
+     */
+    LW_UC_STATUS sendNextOutbound() {
+        OutboundMessage_t message;
+        while (_outbound.pop(&message)) {
+            if (transmit(message)) {
+                return LW_UC_OK;
+            }
+        }
+
+        return LW_UC_OUTBOUND_QUEUE_EMPTY;
+    }
+
+    /**
+     * Number of messages waiting in the outbound queue
+     */
+    size_t getOutboundQueueDepth() {
+        return _outbound.size();
+    }
+
+    /**
+     * Set the key used to decrypt encrypted firmware packages (FOTA_DIFF_INFO_ENCRYPTED).
+     * This is a key shared with the signing tool, not a LoRaWAN session key.
+     *
+     * @param key 128 bits AES key
+     */
+    void setFirmwareDecryptionKey(const uint8_t key[16]) {
+        memcpy(_fwDecryptionKey, key, 16);
+        _fwDecryptionKeySet = true;
+    }
+
+#if defined(MBED_CONF_LORAWAN_UPDATE_CLIENT_IN_PLACE_DELTA_JOURNAL_ADDRESS)
+    /**
+     * Complete a page write of an in-place delta update that was interrupted by a power failure.
+     * Call this on startup, before copying the current firmware into slot 2.
+     *
+     * @returns LW_UC_OK if no in-place delta update was interrupted,
+     *          LW_UC_DIFF_IN_PLACE_INTERRUPTED if slot 2 was partially overwritten (so it needs to be filled again),
+     *          or another status if accessing the block device failed
+     */
+    LW_UC_STATUS recoverInPlaceDeltaUpdate() {
+        if (_bd.init() != BD_ERROR_OK) {
+            return LW_UC_BD_READ_ERROR;
+        }
+
+        bd_addr_t regionStart, committedEnd;
+        int r = FragmentationInPlaceWriter::recover(&_bd, MBED_CONF_LORAWAN_UPDATE_CLIENT_IN_PLACE_DELTA_JOURNAL_ADDRESS,
+            &regionStart, &committedEnd);
+        if (r < 0) {
+            tr_warn("Recovering in-place delta update failed (%d)", r);
+            return LW_UC_BD_WRITE_ERROR;
+        }
+        if (r == 0) {
+            return LW_UC_OK;
+        }
+
+        tr_warn("In-place delta update was interrupted, slot 2 holds new firmware up to 0x%llx", committedEnd);
+
+        // the header was invalidated before patching started, but make sure slot 2 is not used as delta source
+        LW_UC_STATUS status = invalidateSlot2Header();
+        if (status != LW_UC_OK) return status;
+
+        return LW_UC_DIFF_IN_PLACE_INTERRUPTED;
+    }
+#endif
+
+#if defined(LW_UC_DELTA_CHECKPOINTS)
+    /**
+     * Resume a delta update that was interrupted (e.g. by a power failure) from its last checkpoint.
+     * The patch is replayed, but the patched firmware that is in flash already is not written again.
+     * Call this on startup, the firmwareReady callback is invoked when the update completes.
+     *
+     * @returns LW_UC_OK if no delta update was interrupted, otherwise the result of the update
+     */
+    LW_UC_STATUS resumeDeltaUpdate() {
+        if (_bd.init() != BD_ERROR_OK) {
+            return LW_UC_BD_READ_ERROR;
+        }
+
+#if defined(LW_UC_SLOT_TABLE)
+        // the package is in the receive slot
+        loadSlotTable();
+#endif
+
+        FragmentationCheckpoint checkpoint;
+        if (checkpoint.init(&_bd, MBED_CONF_LORAWAN_UPDATE_CLIENT_DELTA_CHECKPOINT_ADDRESS) != BD_ERROR_OK) {
+            return LW_UC_OUT_OF_MEMORY;
+        }
+
+        FragmentationCheckpoint_t record;
+        int r = checkpoint.load(&record);
+        if (r < 0) {
+            return LW_UC_BD_READ_ERROR;
+        }
+        if (r == 0) {
+            return LW_UC_OK;
+        }
+
+        if (record.package_size <= FOTA_SIGNATURE_LENGTH || record.package_size > MBED_CONF_LORAWAN_UPDATE_CLIENT_SLOT_SIZE) {
+            checkpoint.clear();
+            return LW_UC_OK;
+        }
+
+        tr_info("Delta update was interrupted, resuming");
+
+        return processFirmwarePackage(record.package_size);
+    }
+#endif
+
+#if defined(LW_UC_SLOT_TABLE)
+    /**
+     * Load the slot table, and if firmware was handed to the bootloader, check whether that's the firmware
+     * that is running now. If so, its slot becomes the delta baseline and the old baseline slot takes over
+     * the role of that slot, so the application does not need to be copied into slot 2 again.
+     * Call this on startup, before resumeDeltaUpdate().
+     *
+     * @returns LW_UC_OK if the slot table is up to date, LW_UC_INTERNALFLASH_* if the running firmware
+     *          could not be read (the pending firmware is checked again on the next call)
+     */
+    LW_UC_STATUS promoteDeltaBaseline() {
+        if (_bd.init() != BD_ERROR_OK) {
+            return LW_UC_BD_READ_ERROR;
+        }
+
+        loadSlotTable();
+
+#if defined(MBED_CONF_LORAWAN_UPDATE_CLIENT_SLOT2_VERIFIED_RECORD_ADDRESS)
+        watchSlot2VerifiedRecord();
+#endif
+
+        if (_slots.pending_slot == LW_UC_NO_SLOT) {
+            return LW_UC_OK;
+        }
+
+        arm_uc_firmware_details_t running;
+        LW_UC_STATUS status = getCurrentFirmwareDetails(&running);
+        if (status != LW_UC_OK) {
+            return status;
+        }
+
+        if (running.size == _slots.pending_size && compare_buffers(running.hash, _slots.pending_hash, 32)) {
+            uint8_t oldBaseline = _slots.baseline_slot;
+
+            if (_slots.receive_slot == _slots.pending_slot) _slots.receive_slot = oldBaseline;
+            if (_slots.target_slot == _slots.pending_slot) _slots.target_slot = oldBaseline;
+
+            _slots.baseline_slot = _slots.pending_slot;
+            _slots.baseline_size = _slots.pending_size;
+            memcpy(_slots.baseline_hash, _slots.pending_hash, 32);
+
+            tr_info("Firmware in slot %u is running, promoted it to delta baseline (receive slot %u, target slot %u)",
+                _slots.baseline_slot, _slots.receive_slot, _slots.target_slot);
         }
         else {
-            timeToStart = originalTimeToStart - timeDelta;
+            tr_info("Firmware in slot %u was not installed, delta baseline stays in slot %u",
+                _slots.pending_slot, _slots.baseline_slot);
         }
 
-        tr_debug("updateClassCSessionAns, originalTimeToStart=%lu, delta=%lu, newTimeToStart=%lu",
-            originalTimeToStart, timeDelta, timeToStart);
+        _slots.pending_slot = LW_UC_NO_SLOT;
 
-        // update buffer
-        queued_message->data[2] = timeToStart & 0xff;
-        queued_message->data[3] = timeToStart >> 8 & 0xff;
-        queued_message->data[4] = timeToStart >> 16 & 0xff;
+        status = writeSlotTable();
 
-        return LW_UC_OK;
+#if defined(MBED_CONF_LORAWAN_UPDATE_CLIENT_SLOT2_VERIFIED_RECORD_ADDRESS)
+        watchSlot2VerifiedRecord();
+#endif
+
+        return status;
+    }
+
+    /**
+     * Whether the delta baseline is firmware that was installed through this client (see promoteDeltaBaseline()).
+     * If not, the application needs to be copied into slot 2 (and described in the slot 2 header) for delta updates.
+     */
+    bool isDeltaBaselinePromoted() {
+        return _slots.baseline_size != 0;
+    }
+#endif
+
+    /**
+     * Mix entropy into the generator for the random delays of uplinks (BlockAckDelay, clock sync jitter).
+     * The generator is seeded from GenAppKey, so every device already draws different delays.
+     * Pass a value from a hardware source, e.g. LoRaRadio::random(), so the delays don't repeat after a reboot.
+     *
+     * @param entropy Random value
+     */
+    void addRandomEntropy(uint32_t entropy) {
+        core_util_critical_section_enter();
+        _randomState ^= entropy;
+        if (_randomState == 0) {
+            _randomState = 1;
+        }
+        core_util_critical_section_exit();
+    }
+
+    /**
+     * Dispatch the start and timeout of class C sessions (switchToClassC / switchToClassA), periodic clock syncs
+     * and delayed FragSessionStatusAns messages through an event queue.
+     * With RTOS this defaults to the shared event queue, without RTOS to the timer interrupt.
+     * When the queue is full, the handlers run in the timer interrupt.
+     *
+     * @param queue Event queue that is dispatched by the application, or NULL to use the timer interrupt
+     */
+    void setEventQueue(EventQueue *queue) {
+        _mcScheduler.set_event_queue(queue);
+        _clockScheduler.set_event_queue(queue);
+        _fragScheduler.set_event_queue(queue);
+    }
+
+    /**
+     * Get statistics of the update client
+     *
+     * @param stats Receives the statistics
+     */
+    void getStats(LoRaWANUpdateClientStats_t *stats) {
+        DeadlineSchedulerStats_t mcStats;
+        _mcScheduler.get_stats(&mcStats);
+
+        *stats = _stats;
+        stats->mcEventCount = mcStats.count;
+        stats->mcEventLatencyUs = mcStats.last_latency_us;
+        stats->mcEventMaxLatencyUs = mcStats.max_latency_us;
+        stats->outboundQueueDepth = _outbound.size();
+    }
+
+    /**
+     * Reset the statistics of the update client
+     */
+    void resetStats() {
+        _mcScheduler.reset_stats();
+        memset(&_stats, 0, sizeof(LoRaWANUpdateClientStats_t));
+    }
+
+    /**
+     * Report progress of copying the application into slot 2 through the progress callback,
+     * pass this to copy_flash_to_blockdevice (as callback(&client, &LoRaWANUpdateClient::reportCopyProgress))
+     */
+    void reportCopyProgress(size_t processed, size_t total) {
+        reportProgress(LW_UC_PROGRESS_COPY, processed, total);
     }
 
     /**
@@ -312,6 +740,8 @@ public:
     LoRaWANUpdateClientCallbacks_t callbacks;
 
 private:
+    typedef OutboundQueue<LW_UC_OUTBOUND_QUEUE_SIZE, LW_UC_OUTBOUND_MAX_LENGTH>::Message OutboundMessage_t;
+
     /**
      * Used by the AS to request the package version implemented by the end-device
      */
@@ -353,10 +783,16 @@ private:
 
         tr_debug("handleClockAppTimeAns, correction=%ld", timeCorrection);
 
-        // delta between now and the time we sent the request out
-        uint64_t rx_tx_delta = get_rtc_time_s() - _clockSync.rtcValueAtLastRequest;
+        // in sync, no need for the remaining transmissions of a ForceDeviceResyncReq
+        _clockSync.resyncRemaining = 0;
+        _clockScheduler.cancel(0, LW_UC_CLOCK_EVENT_RESYNC);
 
-        _clockSync.correction = _clockSync.correction + timeCorrection - rx_tx_delta;
+        // the correction is relative to the device time in the request, so it applies at the moment the request was
+        // created. The time between the request and this answer doesn't matter, the time base kept running.
+        // DeviceTime went out in whole seconds, so the correction applies to the truncated device time.
+        int64_t deviceTimeSentMs = static_cast<int64_t>(_clockSync.deviceTimeAtLastRequestMs / 1000) * 1000;
+        int64_t gpsTimeMs = deviceTimeSentMs + (static_cast<int64_t>(timeCorrection) * 1000);
+        applyClockCorrection(gpsTimeMs - static_cast<int64_t>(_clockSync.timeAtLastRequestMs), _clockSync.timeAtLastRequestMs);
 
         updateMcGroupsBasedOnNewTime();
 
@@ -367,17 +803,29 @@ private:
      * The DeviceAppTimePeriodicityReq command is used by the application server to modify
      * this periodicity and/or get an instant reading of the end-device’s clock value.
      *
-     * Not supported by the update client
+     * AppTimeReq messages are then sent every 128*2^Period seconds (+/- 30 seconds).
      */
     LW_UC_STATUS handleClockAppTimePeriodicityReq(uint8_t *buffer, size_t length) {
         if (length != CLOCK_APP_TIME_PERIODICITY_REQ_LENGTH) {
             return LW_UC_INVALID_PACKET_LENGTH;
         }
 
+        uint8_t period = buffer[0] & 0b1111;
+        _clockSync.periodicity = 128UL << period;
+
+        tr_debug("handleClockAppTimePeriodicityReq, periodicity=%lu", _clockSync.periodicity);
+
+        scheduleClockSync();
+
+        uint32_t deviceTime = static_cast<uint32_t>(getCurrentTime_s() % 4294967296 /*pow(2, 32)*/);
+
         uint8_t response[CLOCK_APP_TIME_PERIODICITY_ANS_LENGTH] = {
             CLOCK_APP_TIME_PERIODICITY_ANS,
-            0b1, // not supported
-            0, 0, 0, 0 //time
+            0b0, // supported
+            static_cast<uint8_t>(deviceTime & 0xff),
+            static_cast<uint8_t>(deviceTime >> 8 & 0xff),
+            static_cast<uint8_t>(deviceTime >> 16 & 0xff),
+            static_cast<uint8_t>(deviceTime >> 24 & 0xff)
         };
 
         send(CLOCKSYNC_PORT, response, CLOCK_APP_TIME_PERIODICITY_ANS_LENGTH, true);
@@ -388,6 +836,9 @@ private:
     /**
      * The ForceDeviceResyncReq message is transmitted by the application server to
      * the end-device to trigger a clock resynchronization.
+     *
+     * The end-device sends up to NbTransmissions AppTimeReq messages, LW_UC_CLOCK_RESYNC_INTERVAL
+     * (+ random jitter) seconds apart, until a valid AppTimeAns comes in.
      */
     LW_UC_STATUS handleClockForceResyncReq(uint8_t *buffer, size_t length) {
         if (length != CLOCK_FORCE_RESYNC_REQ_LENGTH) {
@@ -396,13 +847,19 @@ private:
 
         uint8_t nbTransmissions = buffer[0] & 0b111;
 
-        if (nbTransmissions > 1) {
-            // @todo implement retries...
-            tr_debug("handleClockForceResyncReq - cannot handle nbTransmissions > 1");
+        tr_debug("handleClockForceResyncReq, nbTransmissions=%u", nbTransmissions);
+
+        if (nbTransmissions == 0) {
+            _clockSync.resyncRemaining = 0;
+            _clockScheduler.cancel(0, LW_UC_CLOCK_EVENT_RESYNC);
+            return LW_UC_OK;
         }
 
         requestClockSync(false);
 
+        _clockSync.resyncRemaining = nbTransmissions - 1;
+        scheduleClockResync();
+
         return LW_UC_OK;
     }
 
@@ -430,13 +887,64 @@ private:
             return LW_UC_INVALID_PACKET_LENGTH;
         }
 
+        bool error = !setupMulticastGroup(buffer);
+
+        return sendMulticastSetupAns(error, buffer[0] & 0b11);
+    }
+
+    /**
+     * Handle a downlink with multiple concatenated McGroupSetupReq commands.
+     * All groups are set up in one pass, and the answers are sent back in a single uplink.
+     *
+     * @param buffer Data buffer, including the command byte of the first command
+     * @param length Length of the data buffer
+     */
+    LW_UC_STATUS handleMulticastSetupReqBatch(uint8_t *buffer, size_t length) {
+        const size_t cmd_length = 1 + MC_GROUP_SETUP_REQ_LENGTH;
+
+        // group index is 2 bits, so there cannot be more than 4 different groups
+        if (length % cmd_length != 0 || length / cmd_length > 4) {
+            return LW_UC_INVALID_PACKET_LENGTH;
+        }
+
+        size_t count = length / cmd_length;
+
+        for (size_t ix = 0; ix < count; ix++) {
+            if (buffer[ix * cmd_length] != MC_GROUP_SETUP_REQ) {
+                return LW_UC_UNKNOWN_COMMAND;
+            }
+        }
+
+        uint8_t response[4 * MC_GROUP_SETUP_ANS_LENGTH];
+
+        for (size_t ix = 0; ix < count; ix++) {
+            uint8_t *cmd = buffer + (ix * cmd_length) + 1;
+            bool error = !setupMulticastGroup(cmd);
+
+            response[ix * MC_GROUP_SETUP_ANS_LENGTH] = MC_GROUP_SETUP_ANS;
+            response[ix * MC_GROUP_SETUP_ANS_LENGTH + 1] = (cmd[0] & 0b11) + (error ? 0b100 : 0);
+        }
+
+        send(MCCONTROL_PORT, response, count * MC_GROUP_SETUP_ANS_LENGTH, true);
+
+        return LW_UC_OK;
+    }
+
+    /**
+     * Set up a multicast group and derive its session keys
+     *
+     * @param buffer McGroupSetupReq payload (without the command byte), MC_GROUP_SETUP_REQ_LENGTH bytes
+     *
+     * @returns false if the group index is not supported
+     */
+    bool setupMulticastGroup(uint8_t *buffer) {
         uint8_t mcIx = buffer[0] & 0b11;
 
         tr_debug("handleMulticastSetupReq mcIx=%u", mcIx);
 
         if (mcIx > NB_MC_GROUPS - 1) {
             tr_debug("handleMulticastSetupReq: mcIx out of bounds");
-            return sendMulticastSetupAns(true, mcIx);
+            return false;
         }
 
         // @todo: so the spec allows us to modify a group
@@ -446,22 +954,16 @@ private:
         memcpy(mc_groups[mcIx].mcKey_Encrypted, buffer + 5, 16);
         mc_groups[mcIx].minFcFCount = (buffer[24] << 24) + (buffer[23] << 16) + (buffer[22] << 8) + buffer[21];
         mc_groups[mcIx].maxFcFCount = (buffer[28] << 24) + (buffer[27] << 16) + (buffer[26] << 8) + buffer[25];
+        mc_groups[mcIx].nextFcFCount = mc_groups[mcIx].minFcFCount;
 
-        // Derived from the GenAppKey. This differs between LoRaWAN 1.0 and LoRaWAN 1.1,
-        // but there's no knowledge in this library which version is used
-        // McRootKey = aes128_encrypt(GenAppKey, 0x00 | pad16)
-        const uint8_t mc_root_key_input[16] = { 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0 };
-        uint8_t mc_root_key_output[16] = {};
-        AES_ECB_encrypt(mc_root_key_input, _genAppKey, mc_root_key_output, 16);
-
-        // McKEKey = aes128_encrypt(McRootKey, 0x00 | pad16)
-        const uint8_t mc_e_key_input[16] = { 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0 };
-        uint8_t mc_e_key_output[16];
-        AES_ECB_encrypt(mc_e_key_input, mc_root_key_output, mc_e_key_output, 16);
+        // McKEKey does not change, so it's only derived once
+        if (!_mcKEKeyDerived) {
+            deriveMcKEKey();
+        }
 
         // McKey = aes128_encrypt(McKEKey, McKey_encrypted)
         uint8_t mc_key[16];
-        AES_ECB_encrypt(mc_groups[mcIx].mcKey_Encrypted, mc_e_key_output, mc_key, 16);
+        _mcKEKeyAes.encrypt(mc_groups[mcIx].mcKey_Encrypted, mc_key);
 
         // The McAppSKey and the McNetSKey are then derived from the group’s McKey as follow:
         // McAppSKey = aes128_encrypt(McKey, 0x01 | McAddr | pad16)
@@ -469,8 +971,12 @@ private:
         const uint8_t app_input[16] = { 0x01, buffer[1], buffer[2], buffer[3], buffer[4], 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0 };
         const uint8_t nwk_input[16] = { 0x02, buffer[1], buffer[2], buffer[3], buffer[4], 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0 };
 
-        AES_ECB_encrypt(nwk_input, mc_key, mc_groups[mcIx].nwkSKey, 16);
-        AES_ECB_encrypt(app_input, mc_key, mc_groups[mcIx].appSKey, 16);
+        // both session keys share one key schedule
+        FragmentationAes aes(mc_key);
+        aes.encrypt(nwk_input, mc_groups[mcIx].nwkSKey);
+        aes.encrypt(app_input, mc_groups[mcIx].appSKey);
+        aes.clear();
+        memset(mc_key, 0, 16);
 
         mc_groups[mcIx].active = true;
 
@@ -490,18 +996,45 @@ private:
         tr_debug("\tminFcFCount:    %lu", mc_groups[mcIx].minFcFCount);
         tr_debug("\tmaxFcFCount:    %lu", mc_groups[mcIx].maxFcFCount);
 
-        return sendMulticastSetupAns(false, mcIx);
+        return true;
     }
 
     /**
-     * Send FRAG_SESSION_ANS to network server with bits set depending on the error indicator
+     * Derive McKEKey from the GenAppKey, and keep its expanded key schedule around.
+     * The intermediate keys are wiped.
      */
-    LW_UC_STATUS sendMulticastSetupAns(bool error, uint8_t mcIx) {
-        uint8_t resp = mcIx;
-        resp += error ? 0b100 : 0;
+    void deriveMcKEKey() {
+        // Derived from the GenAppKey. This differs between LoRaWAN 1.0 and LoRaWAN 1.1,
+        // but there's no knowledge in this library which version is used
+        // McRootKey = aes128_encrypt(GenAppKey, 0x00 | pad16)
+        const uint8_t mc_root_key_input[16] = { 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0 };
+        uint8_t mc_root_key_output[16] = {};
+        _mcKEKeyAes.set_key(_genAppKey);
+        _mcKEKeyAes.encrypt(mc_root_key_input, mc_root_key_output);
 
-        uint8_t buffer[MC_GROUP_SETUP_ANS_LENGTH] = { MC_GROUP_SETUP_ANS, resp };
-        send(MCCONTROL_PORT, buffer, MC_GROUP_SETUP_ANS_LENGTH, true);
+        // McKEKey = aes128_encrypt(McRootKey, 0x00 | pad16)
+        const uint8_t mc_e_key_input[16] = { 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0 };
+        uint8_t mc_e_key_output[16];
+        _mcKEKeyAes.set_key(mc_root_key_output);
+        _mcKEKeyAes.encrypt(mc_e_key_input, mc_e_key_output);
+
+        _mcKEKeyAes.set_key(mc_e_key_output);
+        _mcKEKeyDerived = true;
+
+        // clear potentially sensitive details
+        memset(mc_root_key_output, 0, 16);
+        memset(mc_e_key_output, 0, 16);
+    }
+
+    /**
+     * Send FRAG_SESSION_ANS to network server with bits set depending on the error indicator
+     */
+    LW_UC_STATUS sendMulticastSetupAns(bool error, uint8_t mcIx) {
+        uint8_t resp = mcIx;
+        resp += error ? 0b100 : 0;
+
+        uint8_t buffer[MC_GROUP_SETUP_ANS_LENGTH] = { MC_GROUP_SETUP_ANS, resp };
+        send(MCCONTROL_PORT, buffer, MC_GROUP_SETUP_ANS_LENGTH, true);
 
         return LW_UC_OK;
     }
@@ -524,6 +1057,13 @@ private:
             // set error flag
             response[1] += 0b100;
         }
+        else {
+            // a class C session of this group ends with the group
+            _mcScheduler.cancel_all(mcIx);
+            if (mc_groups[mcIx].classCActive) {
+                mc_timeout(mcIx);
+            }
+        }
 
         mc_groups[mcIx].active = false;
 
@@ -534,6 +1074,7 @@ private:
         memset(mc_groups[mcIx].appSKey, 0, 16);
         mc_groups[mcIx].minFcFCount = 0;
         mc_groups[mcIx].maxFcFCount = 0;
+        mc_groups[mcIx].nextFcFCount = 0;
 
         send(MCCONTROL_PORT, response, MC_GROUP_DELETE_ANS_LENGTH, true);
 
@@ -619,15 +1160,16 @@ private:
         mc_groups[mcIx].params.dr = buffer[9];
 
         // ok... so now we need to know the current time based on clockSync and RTC
-        uint64_t currTime = getCurrentTime_s();
+        uint64_t currTimeMs = getCurrentTime_ms();
+        uint64_t currTime = currTimeMs / 1000;
 
         uint32_t timeToStart;
 
         // No clock synchronisation done - this means that we need a proper clock sync before the MC request starts
         // the response should indicate this to the network server (because timeToStart is gonna be way off)
-        if (_clockSync.correction == 0x0) {
+        if (!_clockSync.synced) {
 #if MBED_CONF_LORAWAN_UPDATE_CLIENT_TRUST_RTC == 1
-            tr_warn("no accurate time known (correction=%d)", _clockSync.correction);
+            tr_warn("no accurate time known (not synced)");
             timeToStart = 0xffffffff;
 #endif
         }
@@ -650,9 +1192,8 @@ private:
 
         // start timers (but only if clock sync was done before, otherwise the clock sync will start them)
         if (timeToStart != 0xffffffff) {
-            mc_groups[mcIx].startTimeout.attach(callback(this, &LoRaWANUpdateClient::mc_start_irq), static_cast<float>(timeToStart));
-            mc_groups[mcIx].timeoutTimeout.attach(callback(this, &LoRaWANUpdateClient::mc_timeout_irq),
-                static_cast<float>(timeToStart + mc_groups[mcIx].params.timeOut));
+            // the answer is in whole seconds, but the window opens on the millisecond
+            scheduleClassCSession(mcIx, getTimeToSessionStart_ms(mcIx, currTimeMs));
         }
 
         send(MCCONTROL_PORT, response, MC_CLASSC_SESSION_ANS_LENGTH, true);
@@ -685,6 +1226,9 @@ private:
             }
         }
 
+        // a status answer that is still waiting for its BlockAckDelay was about the old session
+        _fragScheduler.cancel(fragIx, LW_UC_FRAG_EVENT_STATUS_ANS);
+
         frag_sessions[fragIx].mcGroupBitMask = buffer[0] & 0b1111;
         frag_sessions[fragIx].nbFrag = (buffer[2] << 8) + buffer[1];
         frag_sessions[fragIx].fragSize = buffer[3];
@@ -711,7 +1255,7 @@ private:
         opts.RedundancyPackets = MBED_CONF_LORAWAN_UPDATE_CLIENT_MAX_REDUNDANCY - 1;
 
         // @todo, make this dependent on the frag index...
-        opts.FlashOffset = MBED_CONF_LORAWAN_UPDATE_CLIENT_SLOT0_FW_ADDRESS;
+        opts.FlashOffset = getSlotFwAddress(_slots.receive_slot);
 
         frag_sessions[fragIx].sessionOptions = opts;
 
@@ -727,6 +1271,9 @@ private:
 
         frag_sessions[fragIx].session = session;
         frag_sessions[fragIx].active = true;
+        frag_sessions[fragIx].dataBlockAuthPending = false;
+
+        reportDecodeProgress(fragIx, false);
 
         sendFragSessionAns(FSAE_None);
         return LW_UC_OK;
@@ -780,9 +1327,13 @@ private:
     }
 
     /**
-     * Get the status of a fragmentation session
+     * Get the status of a fragmentation session.
+     * When the request came in over multicast the answer is sent after a random delay of up to
+     * 2^(BlockAckDelay+4) seconds, so the devices in the group don't all answer at once.
+     *
+     * @param devAddr The device address that received this message (or 0x0 in unicast)
      */
-    LW_UC_STATUS handleFragmentationStatusReq(uint8_t *buffer, size_t length) {
+    LW_UC_STATUS handleFragmentationStatusReq(uint32_t devAddr, uint8_t *buffer, size_t length) {
         if (length != FRAG_SESSION_STATUS_REQ_LENGTH) {
             return LW_UC_INVALID_PACKET_LENGTH;
         }
@@ -808,30 +1359,58 @@ private:
             }
         }
 
-        // otherwise we need to send an update...
+        if (mcGroupFromDevAddr(devAddr) != NULL && frag_sessions[fragIx].active) {
+            // (As described in the “FragSessionStatusReq” command, the receivers MUST respond with a pseudo-random delay as specified by the BlockAckDelay field of the FragSessionSetupReq command.)
+            uint64_t maxDelayMs = (1ULL << (frag_sessions[fragIx].blockAckDelay + 4)) * 1000ULL;
+            uint64_t delayMs = getRandom() % (maxDelayMs + 1);
+
+            tr_debug("FragSessionStatusAns delayed by %llu ms", delayMs);
+
+            // the answer reflects the fragments received by the time it's sent
+            _fragScheduler.schedule(fragIx, LW_UC_FRAG_EVENT_STATUS_ANS, delayMs * 1000ULL);
+            return LW_UC_OK;
+        }
+
+        sendFragmentationStatusAns(fragIx);
+
+        return LW_UC_OK;
+    }
+
+    /**
+     * Send the status of a fragmentation session (FragSessionStatusAns)
+     */
+    void sendFragmentationStatusAns(uint8_t fragIx) {
+        // filled in when it's sent, see fillFragmentationStatusAns
+        uint8_t response[FRAG_SESSION_STATUS_ANS_LENGTH] = { FRAG_SESSION_STATUS_ANS, static_cast<uint8_t>(fragIx << 6), 0, 0, 0 };
+        send(FRAGSESSION_PORT, response, FRAG_SESSION_STATUS_ANS_LENGTH, false);
+    }
+
+    /**
+     * Fill in the status of a fragmentation session in a FragSessionStatusAns
+     *
+     * @param response FragSessionStatusAns message, with the fragIndex in the upper 2 bits of byte 1
+     *
+     * @returns false if the session is not active (anymore)
+     */
+    bool fillFragmentationStatusAns(uint8_t *response) {
+        uint8_t fragIx = response[1] >> 6;
+
         // @todo problem is that we don't have the info anymore after we reconstructed
         if (!frag_sessions[fragIx].active || frag_sessions[fragIx].session == NULL) {
             // @todo: this is wrong because I don't have the info...
-            return LW_UC_OK;
+            return false;
         }
 
         uint16_t nbReceived = frag_sessions[fragIx].session->get_received_frame_count();
         // upper 2 bits are for the fragIndex
         nbReceived += (fragIx << 14);
 
-        uint8_t response[FRAG_SESSION_STATUS_ANS_LENGTH] = {
-            FRAG_SESSION_STATUS_ANS,
-            static_cast<uint8_t>(nbReceived >> 8 & 0xff),
-            static_cast<uint8_t>(nbReceived & 0xff),
-            static_cast<uint8_t>(frag_sessions[fragIx].session->get_lost_frame_count()),
-            0 /* whether we're out of memory... i don't think this is possible, because we limit this at compile time */
-        };
-
-        // @todo: delay not implemented, q: does this only apply on multicast?
-        // (As described in the “FragSessionStatusReq” command, the receivers MUST respond with a pseudo-random delay as specified by the BlockAckDelay field of the FragSessionSetupReq command.)
-        send(FRAGSESSION_PORT, response, FRAG_SESSION_STATUS_ANS_LENGTH, false);
+        response[1] = static_cast<uint8_t>(nbReceived >> 8 & 0xff);
+        response[2] = static_cast<uint8_t>(nbReceived & 0xff);
+        response[3] = static_cast<uint8_t>(frag_sessions[fragIx].session->get_lost_frame_count());
+        response[4] = 0; /* whether we're out of memory... i don't think this is possible, because we limit this at compile time */
 
-        return LW_UC_OK;
+        return true;
     }
 
     /**
@@ -867,12 +1446,12 @@ private:
 
         tr_debug("processing frame %u", frameCounter);
 
-        // if this message was sent on a multicast group, make sure to reset the timeout
+        // if this message was sent on a multicast group, push out the timeout (checked when the timeout fires)
         MulticastGroupParams_t *mcGroup = mcGroupFromDevAddr(devAddr);
+        uint8_t mcIx = mcGroup != NULL ? static_cast<uint8_t>(mcGroup - mc_groups) : 0;
         if (mcGroup != NULL) {
-            // @todo: there's another check that we need to do here around the frame counter min/max...
-            mcGroup->timeoutTimeout.attach(callback(this, &LoRaWANUpdateClient::mc_timeout_irq),
-                static_cast<float>(mcGroup->params.timeOut));
+            // the frame counter is checked against the window of the group when it is passed to handleFragmentationCommand
+            mcGroup->lastActivityMs = getMcActivityTimestamp();
         }
 
         if (!frag_sessions[fragIx].active) return LW_UC_FRAG_SESSION_NOT_ACTIVE;
@@ -881,20 +1460,23 @@ private:
         FragResult result = frag_sessions[fragIx].session->process_frame(frameCounter, buffer + 2, length - 2);
 
         if (result == FRAG_OK) {
+            reportDecodeProgress(fragIx, false);
             return LW_UC_OK;
         }
 
         if (result == FRAG_COMPLETE) {
             tr_debug("FragSession complete");
 
-            // detach callbacks on the multicast group
+            reportDecodeProgress(fragIx, true);
+
+            // cancel the events of the multicast group, and close its class C window
             if (mcGroup != NULL) {
-                mcGroup->timeoutTimeout.detach();
-                mcGroup->startTimeout.detach();
+                _mcScheduler.cancel_all(mcIx);
+                mcGroup->classCActive = false;
             }
 
-            // switch back to class A
-            if (callbacks.switchToClassA) {
+            // switch back to class A, unless the class C window of another group is still open
+            if (!isClassCWindowOpen() && callbacks.switchToClassA) {
                 callbacks.switchToClassA();
             }
 
@@ -910,95 +1492,299 @@ private:
             // make the session inactive
             frag_sessions[fragIx].active = false;
 
-            // Options contain info on where the manifest is placed
-            FragmentationSessionOpts_t opts = frag_sessions[fragIx].sessionOptions;
+#if MBED_CONF_LORAWAN_UPDATE_CLIENT_DATA_BLOCK_AUTH == 1
+            // don't spend time on verification and patching until the network server confirmed the data block
+            return sendDataBlockAuthReq(fragIx);
+#else
+            return processDataBlock(frag_sessions[fragIx].sessionOptions);
+#endif
+        }
+
+        tr_warn("process_frame failed (%d)", result);
+        return LW_UC_PROCESS_FRAME_FAILED;
+    }
+
+    /**
+     * Send a DataBlockAuthReq to the network server, holding the MIC of a reconstructed data block.
+     * Verification of the data block continues when the DataBlockAuthAns comes in.
+     *
+     * MIC = aes128_cmac(DataBlockIntKey, B0 | data)[0..3]
+     * DataBlockIntKey = aes128_encrypt(GenAppKey, 0x30 | pad16)
+     * B0 = 0x49 | 0x00 x 4 | Dir = 0x00 | Descriptor (4) | 0x00 x 2 | DataSize (4)
+     *
+     * @param fragIx Index of the fragmentation session
+     */
+    LW_UC_STATUS sendDataBlockAuthReq(uint8_t fragIx) {
+        FragmentationSessionOpts_t opts = frag_sessions[fragIx].sessionOptions;
+        uint32_t descriptor = frag_sessions[fragIx].descriptor;
+        uint32_t dataSize = (opts.NumberOfFragments * opts.FragmentSize) - opts.Padding;
+
+        const uint8_t key_input[16] = { 0x30, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0 };
+        uint8_t data_block_int_key[16];
+        FragmentationAes aes(_genAppKey);
+        aes.encrypt(key_input, data_block_int_key);
+        aes.clear();
+
+        const uint8_t b0[16] = {
+            0x49, 0x0, 0x0, 0x0, 0x0, 0x0,
+            static_cast<uint8_t>(descriptor & 0xff),
+            static_cast<uint8_t>(descriptor >> 8 & 0xff),
+            static_cast<uint8_t>(descriptor >> 16 & 0xff),
+            static_cast<uint8_t>(descriptor >> 24 & 0xff),
+            0x0, 0x0,
+            static_cast<uint8_t>(dataSize & 0xff),
+            static_cast<uint8_t>(dataSize >> 8 & 0xff),
+            static_cast<uint8_t>(dataSize >> 16 & 0xff),
+            static_cast<uint8_t>(dataSize >> 24 & 0xff)
+        };
+
+        // stream the data block from flash in large chunks, so alloc on heap instead of stack
+        uint8_t *cmac_buffer = (uint8_t*)malloc(LW_UC_DATA_BLOCK_AUTH_BUFFER_SIZE);
+        if (!cmac_buffer) {
+            tr_error("Could not allocate %d bytes for DataBlockAuthReq", LW_UC_DATA_BLOCK_AUTH_BUFFER_SIZE);
+            memset(data_block_int_key, 0, 16);
+            return LW_UC_OUT_OF_MEMORY;
+        }
+
+        uint8_t cmac[16];
+        FragmentationCmac cmac_ctx(&_bd, cmac_buffer, LW_UC_DATA_BLOCK_AUTH_BUFFER_SIZE);
+        cmac_ctx.start(data_block_int_key);
+        cmac_ctx.update(b0, sizeof(b0));
+        int r = cmac_ctx.update_from_flash(opts.FlashOffset, dataSize);
+        cmac_ctx.finish(cmac);
 
+        free(cmac_buffer);
+        memset(data_block_int_key, 0, 16);
+
+        if (r != BD_ERROR_OK) {
+            return LW_UC_BD_READ_ERROR;
+        }
+
+        tr_debug("sendDataBlockAuthReq ix=%u, descriptor=%lu, MIC=%02x%02x%02x%02x", fragIx, descriptor,
+            cmac[0], cmac[1], cmac[2], cmac[3]);
+
+        frag_sessions[fragIx].dataBlockAuthPending = true;
+
+        uint8_t request[DATA_BLOCK_AUTH_REQ_LENGTH] = {
+            DATA_BLOCK_AUTH_REQ,
+            fragIx,
+            static_cast<uint8_t>(descriptor & 0xff),
+            static_cast<uint8_t>(descriptor >> 8 & 0xff),
+            static_cast<uint8_t>(descriptor >> 16 & 0xff),
+            static_cast<uint8_t>(descriptor >> 24 & 0xff),
+            cmac[0], cmac[1], cmac[2], cmac[3]
+        };
+        send(FRAGSESSION_PORT, request, DATA_BLOCK_AUTH_REQ_LENGTH, true);
+
+        return LW_UC_OK;
+    }
+
+    /**
+     * Answer from the network server on a DataBlockAuthReq.
+     * If the MIC matched we continue verifying and applying the data block, if not the data block is discarded.
+     */
+    LW_UC_STATUS handleDataBlockAuthAns(uint8_t *buffer, size_t length) {
+        if (length != DATA_BLOCK_AUTH_ANS_LENGTH) {
+            return LW_UC_INVALID_PACKET_LENGTH;
+        }
+
+        uint8_t fragIx = buffer[0] & 0b11;
+        bool authFailed = (buffer[0] >> 2) & 0b1;
+        uint32_t descriptor = (buffer[4] << 24) + (buffer[3] << 16) + (buffer[2] << 8) + buffer[1];
+
+        tr_debug("handleDataBlockAuthAns ix=%u, authFailed=%u", fragIx, authFailed);
+
+        if (fragIx > NB_FRAG_GROUPS - 1 || !frag_sessions[fragIx].dataBlockAuthPending) {
+            tr_debug("no data block waiting for authentication");
+            return LW_UC_DATA_BLOCK_AUTH_NOT_PENDING;
+        }
+
+        if (descriptor != frag_sessions[fragIx].descriptor) {
+            tr_debug("descriptor mismatch, expected %lu but was %lu", frag_sessions[fragIx].descriptor, descriptor);
+            return LW_UC_DATA_BLOCK_AUTH_NOT_PENDING;
+        }
+
+        frag_sessions[fragIx].dataBlockAuthPending = false;
+
+        if (authFailed) {
+            tr_warn("Data block authentication failed, discarding data block");
+            return LW_UC_DATA_BLOCK_AUTH_FAILED;
+        }
+
+        return processDataBlock(frag_sessions[fragIx].sessionOptions);
+    }
+
+    /**
+     * Verify and apply a reconstructed data block (full or delta update)
+     *
+     * @param opts Options of the fragmentation session, contain info on where the data block is placed
+     */
+    LW_UC_STATUS processDataBlock(FragmentationSessionOpts_t opts) {
 #if MBED_CONF_LORAWAN_UPDATE_CLIENT_INTEROP_TESTING == 1
-            // Internal buffer for reading from BD
-            uint8_t crc_buffer[LW_UC_SHA256_BUFFER_SIZE];
+        // Internal buffer for reading from BD
+        uint8_t crc_buffer[LW_UC_SHA256_BUFFER_SIZE];
 
-            FragmentationCrc32 crc32(&_bd, crc_buffer, LW_UC_SHA256_BUFFER_SIZE);
-            uint32_t crc = crc32.calculate(opts.FlashOffset, ((opts.NumberOfFragments * opts.FragmentSize) - opts.Padding));
+        FragmentationCrc32 crc32(&_bd, crc_buffer, LW_UC_SHA256_BUFFER_SIZE);
+        uint32_t crc = crc32.calculate(opts.FlashOffset, ((opts.NumberOfFragments * opts.FragmentSize) - opts.Padding));
 
-            if (callbacks.firmwareReady) {
-                callbacks.firmwareReady(crc);
-            }
+        if (callbacks.firmwareReady) {
+            callbacks.firmwareReady(crc);
+        }
 
-            return LW_UC_OK;
+        return LW_UC_OK;
 #else
+        return processFirmwarePackage((opts.NumberOfFragments * opts.FragmentSize) - opts.Padding);
+#endif
+    }
+
+    /**
+     * Verify and apply a firmware package (full or delta update) in slot 0 (the receive slot, see SlotTable_t)
+     *
+     * @param packageSize Size of the package, including the signature
+     */
+    LW_UC_STATUS processFirmwarePackage(size_t packageSize) {
+        // the signature is the last FOTA_SIGNATURE_LENGTH bytes of the package
+        size_t signatureOffset = getSlotFwAddress(_slots.receive_slot) + packageSize - FOTA_SIGNATURE_LENGTH;
+
+        // Manifest to read in
+        UpdateSignature_t header;
+        if (_bd.read(&header, signatureOffset, FOTA_SIGNATURE_LENGTH) != BD_ERROR_OK) {
+            return LW_UC_BD_READ_ERROR;
+        }
+
+        // So... now it depends on whether this is a delta update or not...
+        uint8_t* diff_info = (uint8_t*)&(header.diff_info);
 
-            // the signature is the last FOTA_SIGNATURE_LENGTH bytes of the package
-            size_t signatureOffset = opts.FlashOffset + ((opts.NumberOfFragments * opts.FragmentSize) - opts.Padding) - FOTA_SIGNATURE_LENGTH;
+        tr_debug("Diff info: is_diff=%u, encrypted=%u, compressed=%u, size_of_old_fw=%u",
+            (diff_info[0] & FOTA_DIFF_INFO_IS_DIFF) ? 1 : 0,
+            (diff_info[0] & FOTA_DIFF_INFO_ENCRYPTED) ? 1 : 0,
+            (diff_info[0] & FOTA_DIFF_INFO_COMPRESSED) ? 1 : 0,
+            (diff_info[1] << 16) + (diff_info[2] << 8) + diff_info[3]);
 
-            // Manifest to read in
-            UpdateSignature_t header;
-            if (_bd.read(&header, signatureOffset, FOTA_SIGNATURE_LENGTH) != BD_ERROR_OK) {
-                return LW_UC_BD_READ_ERROR;
+        // the session stays valid for the whole package (a delta update can be retried), the key is cleared when it goes out of scope
+        FragmentationAesCtr aes_ctr;
+        FragmentationAesCtr *decryptor = NULL;
+
+        if (diff_info[0] & FOTA_DIFF_INFO_ENCRYPTED) {
+            if (!_fwDecryptionKeySet) {
+                tr_warn("Firmware package is encrypted, but no decryption key was set");
+                return LW_UC_DECRYPTION_KEY_MISSING;
             }
 
-            // So... now it depends on whether this is a delta update or not...
-            uint8_t* diff_info = (uint8_t*)&(header.diff_info);
+            // the nonce is not sent separately, but is the tail of the (unique) ECDSA signature
+            if (header.signature_length < 16 || header.signature_length > sizeof(header.signature)) {
+                return LW_UC_DECRYPTION_FAILED;
+            }
 
-            tr_debug("Diff info: is_diff=%u, size_of_old_fw=%u", diff_info[0], (diff_info[1] << 16) + (diff_info[2] << 8) + diff_info[3]);
+            if (!aes_ctr.setup(_fwDecryptionKey, header.signature + header.signature_length - 16)) {
+                return LW_UC_DECRYPTION_FAILED;
+            }
+            decryptor = &aes_ctr;
+        }
+
+        // compressed or encrypted full images are unpacked into the target slot, so the package in slot 0 stays intact
+        if ((diff_info[0] & FOTA_DIFF_INFO_IS_DIFF) == 0 && ((diff_info[0] & FOTA_DIFF_INFO_COMPRESSED) || decryptor)) {
+            bool compressed = (diff_info[0] & FOTA_DIFF_INFO_COMPRESSED) != 0;
+            uint32_t unpackedSize;
+            unsigned char unpackedHash[32];
+            LW_UC_STATUS unpackStatus = unpackSlot0Update(
+                packageSize - FOTA_SIGNATURE_LENGTH,
+                compressed ? (diff_info[1] << 16) + (diff_info[2] << 8) + diff_info[3] : packageSize - FOTA_SIGNATURE_LENGTH,
+                &unpackedSize,
+                decryptor,
+                unpackedHash,
+                compressed
+            );
+
+            if (unpackStatus != LW_UC_OK) return unpackStatus;
+
+            LW_UC_STATUS authStatus = verifyAuthenticityAndWriteBootloader(
+                getSlotHeaderAddress(_slots.target_slot),
+                &header,
+                getSlotFwAddress(_slots.target_slot),
+                unpackedSize,
+                unpackedHash);
+
+            if (authStatus != LW_UC_OK) return authStatus;
 
-            if (diff_info[0] == 0) { // Not a diff...
-                // last FOTA_SIGNATURE_LENGTH bytes should be ignored because the signature is not part of the firmware
-                size_t fwSize = (opts.NumberOfFragments * opts.FragmentSize) - opts.Padding - FOTA_SIGNATURE_LENGTH;
-                LW_UC_STATUS authStatus = verifyAuthenticityAndWriteBootloader(
-                    MBED_CONF_LORAWAN_UPDATE_CLIENT_SLOT0_HEADER_ADDRESS,
-                    &header,
-                    opts.FlashOffset,
-                    fwSize);
+            if (callbacks.firmwareReady) {
+                callbacks.firmwareReady();
+            }
 
-                if (authStatus != LW_UC_OK) return authStatus;
+            return LW_UC_OK;
+        }
+        else if ((diff_info[0] & FOTA_DIFF_INFO_IS_DIFF) == 0) { // Not a diff...
+            // last FOTA_SIGNATURE_LENGTH bytes should be ignored because the signature is not part of the firmware
+            size_t fwSize = packageSize - FOTA_SIGNATURE_LENGTH;
+            LW_UC_STATUS authStatus = verifyAuthenticityAndWriteBootloader(
+                getSlotHeaderAddress(_slots.receive_slot),
+                &header,
+                getSlotFwAddress(_slots.receive_slot),
+                fwSize);
 
-                if (callbacks.firmwareReady) {
-                    callbacks.firmwareReady();
-                }
+            if (authStatus != LW_UC_OK) return authStatus;
 
-                return LW_UC_OK;
+            if (callbacks.firmwareReady) {
+                callbacks.firmwareReady();
             }
-            else {
-                uint32_t slot1Size;
-                LW_UC_STATUS deltaStatus = applySlot0Slot2DeltaUpdate(
-                    (opts.NumberOfFragments * opts.FragmentSize) - opts.Padding - FOTA_SIGNATURE_LENGTH,
+
+            return LW_UC_OK;
+        }
+        else {
+            uint32_t slot1Size;
+            unsigned char slot1Hash[32];
+            LW_UC_STATUS deltaStatus = applySlot0Slot2DeltaUpdate(
+                packageSize - FOTA_SIGNATURE_LENGTH,
+                (diff_info[1] << 16) + (diff_info[2] << 8) + diff_info[3],
+                &slot1Size,
+                decryptor,
+                slot1Hash,
+                (diff_info[0] & FOTA_DIFF_INFO_COMPRESSED) != 0
+            );
+
+            if (deltaStatus == LW_UC_DIFF_RESUME_FAILED) {
+                // checkpoint was cleared, start over
+                deltaStatus = applySlot0Slot2DeltaUpdate(
+                    packageSize - FOTA_SIGNATURE_LENGTH,
                     (diff_info[1] << 16) + (diff_info[2] << 8) + diff_info[3],
-                    &slot1Size
+                    &slot1Size,
+                    decryptor,
+                    slot1Hash,
+                    (diff_info[0] & FOTA_DIFF_INFO_COMPRESSED) != 0
                 );
+            }
 
-                if (deltaStatus != LW_UC_OK) return deltaStatus;
-
-                LW_UC_STATUS authStatus = verifyAuthenticityAndWriteBootloader(
-                    MBED_CONF_LORAWAN_UPDATE_CLIENT_SLOT1_HEADER_ADDRESS,
-                    &header,
-                    MBED_CONF_LORAWAN_UPDATE_CLIENT_SLOT1_FW_ADDRESS,
-                    slot1Size);
+            if (deltaStatus != LW_UC_OK) return deltaStatus;
 
-                if (authStatus != LW_UC_OK) return authStatus;
+            LW_UC_STATUS authStatus = verifyAuthenticityAndWriteBootloader(
+                getSlotHeaderAddress(_slots.target_slot),
+                &header,
+                getSlotFwAddress(_slots.target_slot),
+                slot1Size,
+                slot1Hash);
 
-                if (callbacks.firmwareReady) {
-                    callbacks.firmwareReady();
-                }
+            if (authStatus != LW_UC_OK) return authStatus;
 
-                return LW_UC_OK;
+            if (callbacks.firmwareReady) {
+                callbacks.firmwareReady();
             }
-#endif
-        }
 
-        tr_warn("process_frame failed (%d)", result);
-        return LW_UC_PROCESS_FRAME_FAILED;
+            return LW_UC_OK;
+        }
     }
 
     /**
      * Verify the authenticity (SHA hash and ECDSA hash) of a firmware package,
      * and after passing verification write the bootloader header
      *
-     * @param addr Address of firmware slot (MBED_CONF_LORAWAN_UPDATE_CLIENT_SLOT0_HEADER_ADDRESS or MBED_CONF_LORAWAN_UPDATE_CLIENT_SLOT1_HEADER_ADDRESS)
+     * @param addr Address of firmware slot (header of the receive slot or of the target slot, see SlotTable_t)
      * @param header Firmware manifest
      * @param flashOffset Offset in flash of the firmware
      * @param flashLength Length in flash of the firmware
+     * @param precalculatedHash If set, SHA256 hash of the firmware that was calculated while writing it, skips reading it back
      */
-    LW_UC_STATUS verifyAuthenticityAndWriteBootloader(uint32_t addr, UpdateSignature_t *header, size_t flashOffset, size_t flashLength) {
+    LW_UC_STATUS verifyAuthenticityAndWriteBootloader(uint32_t addr, UpdateSignature_t *header, size_t flashOffset, size_t flashLength,
+                                                      const unsigned char *precalculatedHash = NULL) {
 
         if (!compare_buffers(header->manufacturer_uuid, UPDATE_CERT_MANUFACTURER_UUID, 16)) {
             return LW_UC_SIGNATURE_MANUFACTURER_UUID_MISMATCH;
@@ -1019,8 +1805,14 @@ private:
 
         // SHA256 requires a large buffer, alloc on heap instead of stack
         FragmentationSha256* sha256 = new FragmentationSha256(&_bd, sha_buffer, sizeof(sha_buffer));
+        sha256->set_progress(callback(this, &LoRaWANUpdateClient::reportHashProgress));
 
-        sha256->calculate(flashOffset, flashLength, sha_out_buffer);
+        if (precalculatedHash) {
+            memcpy(sha_out_buffer, precalculatedHash, 32);
+        }
+        else {
+            sha256->calculate(flashOffset, flashLength, sha_out_buffer);
+        }
 
         delete sha256;
 
@@ -1072,7 +1864,7 @@ private:
      * @returns LW_UC_OK if all went well, or non-0 status when something went wrong
      */
     LW_UC_STATUS writeBootloaderHeader(uint32_t addr, uint32_t version, size_t fwSize, unsigned char sha_hash[32]) {
-        if (addr != MBED_CONF_LORAWAN_UPDATE_CLIENT_SLOT0_HEADER_ADDRESS && addr != MBED_CONF_LORAWAN_UPDATE_CLIENT_SLOT1_HEADER_ADDRESS) {
+        if (addr != getSlotHeaderAddress(_slots.receive_slot) && addr != getSlotHeaderAddress(_slots.target_slot)) {
             return LW_UC_INVALID_SLOT;
         }
 
@@ -1097,6 +1889,25 @@ private:
         memset(details.campaign, 0, ARM_UC_GUID_SIZE); // todo, add campaign info
         details.signatureSize = 0; // not sure what this is used for
 
+#if defined(LW_UC_SLOT_TABLE)
+        // slot 2 can take the role of any slot, and the bootloader header is written in front of it
+        uint8_t slot = (addr == getSlotHeaderAddress(_slots.receive_slot)) ? _slots.receive_slot : _slots.target_slot;
+        if (getSlotFwAddress(slot) - addr < ARM_UC_EXTERNAL_HEADER_SIZE_V2) {
+            tr_error("Slot %u header needs %u bytes", slot, ARM_UC_EXTERNAL_HEADER_SIZE_V2);
+            return LW_UC_INVALID_SLOT;
+        }
+
+        // record the new firmware before the bootloader can pick it up, it becomes the delta baseline once it runs
+        _slots.pending_slot = slot;
+        _slots.pending_size = fwSize;
+        memcpy(_slots.pending_hash, sha_hash, 32);
+
+        LW_UC_STATUS tableStatus = writeSlotTable();
+        if (tableStatus != LW_UC_OK) {
+            return tableStatus;
+        }
+#endif
+
         tr_debug("writeBootloaderHeader:\n\taddr: %lu\n\tversion: %llu\n\tsize: %llu", addr, details.version, details.size);
 
         uint8_t *fw_header_buff = (uint8_t*)malloc(ARM_UC_EXTERNAL_HEADER_SIZE_V2);
@@ -1115,6 +1926,8 @@ private:
             return LW_UC_CREATE_BOOTLOADER_HEADER_FAILED;
         }
 
+        reportProgress(LW_UC_PROGRESS_HEADER, 0, buff.size);
+
         int r = _bd.program(buff.ptr, addr, buff.size);
         if (r != BD_ERROR_OK) {
             tr_error("Failed to program firmware header: %lu bytes at address 0x%lx", buff.size, addr);
@@ -1122,6 +1935,8 @@ private:
             return LW_UC_BD_WRITE_ERROR;
         }
 
+        reportProgress(LW_UC_PROGRESS_HEADER, buff.size, buff.size);
+
         tr_debug("Stored the update parameters in flash on 0x%lx. Reset the board to apply update.", addr);
 
         free(fw_header_buff);
@@ -1135,6 +1950,27 @@ private:
      */
     LW_UC_STATUS getCurrentVersion(uint64_t* version) {
 #if DEVICE_FLASH
+        arm_uc_firmware_details_t details;
+        LW_UC_STATUS status = getCurrentFirmwareDetails(&details);
+        if (status != LW_UC_OK) {
+            return status;
+        }
+
+        *version = details.version;
+        tr_debug("Version (from internal flash) is %llu", details.version);
+        return LW_UC_OK;
+#else
+        *version = (uint64_t)MBED_BUILD_TIMESTAMP;
+        return LW_UC_OK;
+#endif
+    }
+#endif
+
+#if DEVICE_FLASH && (MBED_CONF_LORAWAN_UPDATE_CLIENT_OVERWRITE_VERSION == 1 || defined(LW_UC_SLOT_TABLE))
+    /**
+     * Get the details (version, size and hash) of the application from the header in internal flash
+     */
+    LW_UC_STATUS getCurrentFirmwareDetails(arm_uc_firmware_details_t *details) {
         int r;
         if ((r = _internalFlash.init()) != 0) {
             tr_warn("Could not initialize internal flash (%d)", r);
@@ -1151,7 +1987,7 @@ private:
 
         uint8_t *buffer = (uint8_t*)malloc(sectorSize);
         if (!buffer) {
-            tr_warn("getCurrentVersion() - Could not allocate %lu bytes", sectorSize);
+            tr_warn("getCurrentFirmwareDetails() - Could not allocate %lu bytes", sectorSize);
             return LW_UC_OUT_OF_MEMORY;
         }
 
@@ -1167,39 +2003,103 @@ private:
             return LW_UC_INTERNALFLASH_DEINIT_ERROR;
         }
 
-        arm_uc_firmware_details_t details;
-
-        arm_uc_error_t err = arm_uc_parse_internal_header_v2(const_cast<uint8_t*>(buffer), &details);
+        arm_uc_error_t err = arm_uc_parse_internal_header_v2(const_cast<uint8_t*>(buffer), details);
         if (err.error != ERR_NONE) {
             tr_warn("Internal header parsing failed (%d)", err.error);
             free(buffer);
             return LW_UC_INTERNALFLASH_HEADER_PARSE_FAILED;
         }
 
-        *version = details.version;
-        tr_debug("Version (from internal flash) is %llu", details.version);
         free(buffer);
         return LW_UC_OK;
-#else
-        *version = (uint64_t)MBED_BUILD_TIMESTAMP;
-        return LW_UC_OK;
+    }
+#elif defined(LW_UC_SLOT_TABLE)
+    LW_UC_STATUS getCurrentFirmwareDetails(arm_uc_firmware_details_t *details) {
+        tr_warn("No internal flash, cannot check which firmware is running");
+        return LW_UC_INTERNALFLASH_INIT_ERROR;
+    }
 #endif
+
+#if defined(MBED_CONF_LORAWAN_UPDATE_CLIENT_IN_PLACE_DELTA_JOURNAL_ADDRESS) && MBED_CONF_LORAWAN_UPDATE_CLIENT_IN_PLACE_DELTA_DRY_RUN == 1
+    /**
+     * Run the patcher over slot 2 and the diff without writing anything. The write cursor and the committed pages
+     * are tracked exactly like they are during in-place patching, so this finds out whether the diff reads old
+     * firmware that would already be overwritten, before slot 2 is touched.
+     *
+     * @param sizeOfFwInSlot0 Size of the diff image that we just received
+     * @param sizeOfFwInSlot2 Size of the firmware in slot 2
+     * @param decryptor If set, the diff file is decrypted while it's being read by the patcher
+     * @param compressedDiff If set, the diff file is heatshrink compressed
+     *
+     * @returns LW_UC_OK if the diff can be applied in place, LW_UC_DIFF_IN_PLACE_SOURCE_OVERWRITTEN if not,
+     *          LW_UC_DIFF_DELTA_UPDATE_FAILED if the patcher failed for another reason,
+     *          LW_UC_OUT_OF_MEMORY if the decompressor could not be set up
+     */
+    LW_UC_STATUS dryRunInPlaceDeltaUpdate(size_t sizeOfFwInSlot0, size_t sizeOfFwInSlot2,
+                                          FragmentationAesCtr *decryptor, bool compressedDiff) {
+        FragmentationHeatshrinkDecoder decoder;
+        BDFILE source(&_bd, getSlotFwAddress(_slots.baseline_slot), sizeOfFwInSlot2);
+        BDFILE diff(&_bd, getSlotFwAddress(_slots.receive_slot),
+            compressedDiff ? LW_UC_COMPRESSED_DIFF_MAX_SIZE : sizeOfFwInSlot0);
+
+        diff.set_decryption(decryptor);
+
+        if (compressedDiff) {
+            if (decoder.init(MBED_CONF_LORAWAN_UPDATE_CLIENT_COMPRESSION_MAX_WINDOW_BITS) != 0) {
+                return LW_UC_OUT_OF_MEMORY;
+            }
+
+            diff.set_decompression(&decoder, sizeOfFwInSlot0);
+        }
+
+        FragmentationInPlaceWriter target_writer;
+        BDFILE target(&_bd, LW_UC_DELTA_TARGET_FW_ADDRESS, 0);
+
+        if (target_writer.start_dry_run(&_bd, LW_UC_DELTA_TARGET_FW_ADDRESS,
+                LW_UC_DELTA_TARGET_FW_ADDRESS + MBED_CONF_LORAWAN_UPDATE_CLIENT_SLOT_SIZE,
+                MBED_CONF_LORAWAN_UPDATE_CLIENT_IN_PLACE_DELTA_WINDOW) != BD_ERROR_OK) {
+            return LW_UC_DIFF_DELTA_UPDATE_FAILED;
+        }
+        target.set_in_place_writer(&target_writer);
+        source.set_overwritten_by(&target_writer);
+
+        int v = apply_delta_update(&_bd, LW_UC_JANPATCH_BUFFER_SIZE, &source, &diff, &target);
+
+        if (source.read_overwritten_data()) {
+            tr_warn("Patch reads old firmware that would already be overwritten, it's not suitable for in-place patching");
+            return LW_UC_DIFF_IN_PLACE_SOURCE_OVERWRITTEN;
+        }
+
+        if (v != MBED_DELTA_UPDATE_OK) {
+            tr_warn("apply_delta_update dry run failed %d", v);
+            return LW_UC_DIFF_DELTA_UPDATE_FAILED;
+        }
+
+        return LW_UC_OK;
     }
 #endif
 
     /**
      * Apply a delta update between slot 2 (source file) and slot 0 (diff file) and place in slot 1
+     * (or over the source file in slot 2 when in-place delta updates are enabled, see LW_UC_DELTA_TARGET_FW_ADDRESS).
+     * With a slot table these are the baseline, receive and target slots, see SlotTable_t.
      *
      * @param sizeOfFwInSlot0 Size of the diff image that we just received
      * @param sizeOfFwInSlot2 Expected size of firmware in slot 2 (will do sanity check)
-     * @param sizeOfFwInSlot1 Out parameter which will be set to the size of the new firmware in slot 1
+     * @param sizeOfFwInSlot1 Out parameter which will be set to the size of the new firmware
+     * @param decryptor If set, the diff file is decrypted while it's being read by the patcher
+     * @param sha256OfFwInSlot1 If set, out parameter which will be set to the SHA256 hash of the new firmware
+     * @param compressedDiff If set, the diff file is heatshrink compressed and is decompressed while it's being read by the patcher
      */
-    LW_UC_STATUS applySlot0Slot2DeltaUpdate(size_t sizeOfFwInSlot0, size_t sizeOfFwInSlot2, uint32_t *sizeOfFwInSlot1) {
-        // read details about the current firmware, it's in the slot2 header
+    LW_UC_STATUS applySlot0Slot2DeltaUpdate(size_t sizeOfFwInSlot0, size_t sizeOfFwInSlot2, uint32_t *sizeOfFwInSlot1,
+                                            FragmentationAesCtr *decryptor = NULL,
+                                            unsigned char *sha256OfFwInSlot1 = NULL,
+                                            bool compressedDiff = false) {
+        // read details about the current firmware, it's in the slot2 header (or in the slot table once it was promoted)
         arm_uc_firmware_details_t curr_details;
-        int bd_status = _bd.read(&curr_details, MBED_CONF_LORAWAN_UPDATE_CLIENT_SLOT2_HEADER_ADDRESS, sizeof(arm_uc_firmware_details_t));
-        if (bd_status != BD_ERROR_OK) {
-            return LW_UC_BD_READ_ERROR;
+        LW_UC_STATUS details_status = getDeltaBaselineDetails(&curr_details);
+        if (details_status != LW_UC_OK) {
+            return details_status;
         }
 
         // so... sanity check, do we have the same size in both places
@@ -1208,14 +2108,23 @@ private:
             return LW_UC_DIFF_SIZE_MISMATCH;
         }
 
-        // calculate sha256 hash for current fw & diff file (for debug purposes)
-        {
+        bool slot2Verified = false;
+#if defined(MBED_CONF_LORAWAN_UPDATE_CLIENT_SLOT2_VERIFIED_RECORD_ADDRESS)
+        slot2Verified = isSlot2Verified(sizeOfFwInSlot2, curr_details.hash);
+#endif
+
+        // calculate sha256 hash for current fw, unless we already verified this exact image before
+        if (slot2Verified) {
+            tr_debug("Firmware in slot 2 was verified before, skipping hash calculation");
+        }
+        else {
             unsigned char sha_out_buffer[32];
             uint8_t sha_buffer[LW_UC_SHA256_BUFFER_SIZE];
             FragmentationSha256* sha256 = new FragmentationSha256(&_bd, sha_buffer, sizeof(sha_buffer));
+            sha256->set_progress(callback(this, &LoRaWANUpdateClient::reportHashProgress));
 
             tr_debug("Firmware hash in slot 2 (current firmware): ");
-            sha256->calculate(MBED_CONF_LORAWAN_UPDATE_CLIENT_SLOT2_FW_ADDRESS, sizeOfFwInSlot2, sha_out_buffer);
+            sha256->calculate(getSlotFwAddress(_slots.baseline_slot), sizeOfFwInSlot2, sha_out_buffer);
             print_buffer(sha_out_buffer, 32, false);
             printf("\n");
 
@@ -1223,89 +2132,857 @@ private:
             print_buffer(curr_details.hash, 32, false);
             printf("\n");
 
+            delete sha256;
+
             if (!compare_buffers(curr_details.hash, sha_out_buffer, 32)) {
                 tr_info("Firmware in slot 2 hash incorrect hash");
-                delete sha256;
                 return LW_UC_DIFF_INCORRECT_SLOT2_HASH;
             }
 
+#if defined(MBED_CONF_LORAWAN_UPDATE_CLIENT_SLOT2_VERIFIED_RECORD_ADDRESS)
+            writeSlot2VerifiedRecord(true, sizeOfFwInSlot2, curr_details.hash);
+#endif
+        }
+
+#if MBED_CONF_MBED_TRACE_ENABLE
+        // calculate sha256 hash for the diff file (for debug purposes)
+        {
+            unsigned char sha_out_buffer[32];
+            uint8_t sha_buffer[LW_UC_SHA256_BUFFER_SIZE];
+            FragmentationSha256* sha256 = new FragmentationSha256(&_bd, sha_buffer, sizeof(sha_buffer));
+
             tr_debug("Firmware hash in slot 0 (diff file): ");
-            sha256->calculate(MBED_CONF_LORAWAN_UPDATE_CLIENT_SLOT0_FW_ADDRESS, sizeOfFwInSlot0, sha_out_buffer);
+            sha256->calculate(getSlotFwAddress(_slots.receive_slot), sizeOfFwInSlot0, sha_out_buffer);
             print_buffer(sha_out_buffer, 32, false);
             printf("\n");
 
             delete sha256;
         }
+#endif
+
+#if defined(MBED_CONF_LORAWAN_UPDATE_CLIENT_IN_PLACE_DELTA_JOURNAL_ADDRESS) && MBED_CONF_LORAWAN_UPDATE_CLIENT_IN_PLACE_DELTA_DRY_RUN == 1
+        // patching in place destroys the old firmware, so only start if we know the diff never reads what's already overwritten.
+        // This reads slot 2 and the diff one extra time, roughly doubling the time to patch
+        LW_UC_STATUS dryRunStatus = dryRunInPlaceDeltaUpdate(sizeOfFwInSlot0, sizeOfFwInSlot2, decryptor, compressedDiff);
+        if (dryRunStatus != LW_UC_OK) return dryRunStatus;
+#endif
 
         // now run the diff...
-        BDFILE source(&_bd, MBED_CONF_LORAWAN_UPDATE_CLIENT_SLOT2_FW_ADDRESS, sizeOfFwInSlot2);
-        BDFILE diff(&_bd, MBED_CONF_LORAWAN_UPDATE_CLIENT_SLOT0_FW_ADDRESS, sizeOfFwInSlot0);
-        BDFILE target(&_bd, MBED_CONF_LORAWAN_UPDATE_CLIENT_SLOT1_FW_ADDRESS, 0);
+        FragmentationHeatshrinkDecoder decoder;
+        BDFILE source(&_bd, getSlotFwAddress(_slots.baseline_slot), sizeOfFwInSlot2);
+        BDFILE diff(&_bd, getSlotFwAddress(_slots.receive_slot),
+            compressedDiff ? LW_UC_COMPRESSED_DIFF_MAX_SIZE : sizeOfFwInSlot0);
 
-        int v = apply_delta_update(&_bd, LW_UC_JANPATCH_BUFFER_SIZE, &source, &diff, &target);
+        diff.set_decryption(decryptor);
 
-        if (v != MBED_DELTA_UPDATE_OK) {
-            tr_warn("apply_delta_update failed %d", v);
-            return LW_UC_DIFF_DELTA_UPDATE_FAILED;
+        if (compressedDiff) {
+            if (decoder.init(MBED_CONF_LORAWAN_UPDATE_CLIENT_COMPRESSION_MAX_WINDOW_BITS) != 0) {
+                return LW_UC_OUT_OF_MEMORY;
+            }
+
+            // the decompressed size is not sent, janpatch reads the diff until the compressed data runs out
+            diff.set_decompression(&decoder, sizeOfFwInSlot0);
         }
 
-        tr_debug("Patched firmware length is %ld", target.ftell());
+#if defined(MBED_CONF_LORAWAN_UPDATE_CLIENT_IN_PLACE_DELTA_JOURNAL_ADDRESS)
+        // the bootloader header for the new firmware is written in front of slot 2
+        if (MBED_CONF_LORAWAN_UPDATE_CLIENT_SLOT2_FW_ADDRESS - MBED_CONF_LORAWAN_UPDATE_CLIENT_SLOT2_HEADER_ADDRESS < ARM_UC_EXTERNAL_HEADER_SIZE_V2) {
+            tr_error("Slot 2 header needs %u bytes for in-place delta updates", ARM_UC_EXTERNAL_HEADER_SIZE_V2);
+            return LW_UC_INVALID_SLOT;
+        }
 
-        *sizeOfFwInSlot1 = target.ftell();
+        // patched firmware overwrites the source, pages are held back in RAM until the patcher is done reading them
+        FragmentationInPlaceWriter target_writer;
+        BDFILE target(&_bd, LW_UC_DELTA_TARGET_FW_ADDRESS, 0);
 
-        return LW_UC_OK;
-    }
+        if (target_writer.start(&_bd, LW_UC_DELTA_TARGET_FW_ADDRESS,
+                LW_UC_DELTA_TARGET_FW_ADDRESS + MBED_CONF_LORAWAN_UPDATE_CLIENT_SLOT_SIZE,
+                MBED_CONF_LORAWAN_UPDATE_CLIENT_IN_PLACE_DELTA_JOURNAL_ADDRESS,
+                MBED_CONF_LORAWAN_UPDATE_CLIENT_IN_PLACE_DELTA_WINDOW) != BD_ERROR_OK) {
+            return LW_UC_OUT_OF_MEMORY;
+        }
+        target.set_in_place_writer(&target_writer);
+        source.set_overwritten_by(&target_writer);
 
-    /**
-     * Find an active multicast group based on device address
-     */
-    MulticastGroupParams_t *mcGroupFromDevAddr(uint32_t devAddr) {
-        if (devAddr == 0x0) return NULL;
+        // from here on slot 2 no longer holds the firmware described in its header
+        LW_UC_STATUS invalidateStatus = invalidateSlot2Header();
+        if (invalidateStatus != LW_UC_OK) return invalidateStatus;
+#else
+#if defined(LW_UC_DELTA_CHECKPOINTS)
+        // pick up where we were if this update was interrupted by a power failure
+        FragmentationCheckpoint checkpoint;
+        FragmentationCheckpoint_t resume;
+        bool checkpointing = loadDeltaCheckpoint(&checkpoint, sizeOfFwInSlot0 + FOTA_SIGNATURE_LENGTH, &resume);
+        size_t resumeLength = checkpointing ? resume.target_length : 0;
+#else
+        size_t resumeLength = 0;
+#endif
 
-        for (size_t ix = 0; ix < NB_MC_GROUPS; ix++) {
-            if (mc_groups[ix].active && mc_groups[ix].mcAddr == devAddr) {
-                return &(mc_groups[ix]);
-            }
+        // patched firmware is written in order, so skip the read-modify-erase-program cycle
+        FragmentationSequentialWriter target_writer;
+        uint32_t targetAddress = getSlotFwAddress(_slots.target_slot);
+        BDFILE target(&_bd, targetAddress, 0);
+
+        if (target_writer.start(&_bd, targetAddress + resumeLength,
+                targetAddress + MBED_CONF_LORAWAN_UPDATE_CLIENT_SLOT_SIZE) == BD_ERROR_OK) {
+            target.set_sequential_writer(&target_writer);
         }
 
-        return NULL;
-    }
+#if defined(LW_UC_DELTA_CHECKPOINTS)
+        if (checkpointing) {
+            target.set_checkpoint(&checkpoint, resume,
+                MBED_CONF_LORAWAN_UPDATE_CLIENT_DELTA_CHECKPOINT_INTERVAL * _bd.get_page_size());
+        }
+#endif
+#endif
 
-    /**
-     * Update multicast group start dates based on an incoming clock sync
-     */
-    void updateMcGroupsBasedOnNewTime() {
-         uint64_t currTime = getCurrentTime_s();
+        // hash the patched firmware while it's written, so it does not need to be read back
+        uint8_t sha_buffer[LW_UC_SHA256_BUFFER_SIZE];
+        FragmentationSha256* sha256 = NULL;
+        if (sha256OfFwInSlot1) {
+            sha256 = new FragmentationSha256(&_bd, sha_buffer, sizeof(sha_buffer));
+            sha256->start();
+            target.set_hash(sha256);
+        }
+
+        _patchProgressSize = sizeOfFwInSlot0;
+        reportProgress(LW_UC_PROGRESS_PATCH, 0, sizeOfFwInSlot0);
+
+        int v = apply_delta_update(&_bd, LW_UC_JANPATCH_BUFFER_SIZE, &source, &diff, &target,
+            callback(this, &LoRaWANUpdateClient::reportPatchProgress));
+
+#if defined(LW_UC_DELTA_CHECKPOINTS)
+        // done with this update (one way or another), nothing to resume anymore
+        if (checkpointing) {
+            checkpoint.clear();
+        }
+#endif
+
+        if (v != MBED_DELTA_UPDATE_OK) {
+            if (sha256) {
+                sha256->finish(sha256OfFwInSlot1);
+                delete sha256;
+            }
+            tr_warn("apply_delta_update failed %d", v);
+
+#if defined(LW_UC_DELTA_CHECKPOINTS)
+            if (target.checkpoint_mismatch()) {
+                tr_warn("Patched firmware does not match the checkpoint, the update needs to start over");
+                return LW_UC_DIFF_RESUME_FAILED;
+            }
+#endif
+
+            if (source.read_overwritten_data()) {
+                tr_warn("Patch reads old firmware that was already overwritten, it's not suitable for in-place patching");
+                return LW_UC_DIFF_IN_PLACE_SOURCE_OVERWRITTEN;
+            }
+            return LW_UC_DIFF_DELTA_UPDATE_FAILED;
+        }
+
+        reportProgress(LW_UC_PROGRESS_PATCH, sizeOfFwInSlot0, sizeOfFwInSlot0);
+
+        tr_debug("Patched firmware length is %ld", target.ftell());
+
+        *sizeOfFwInSlot1 = target.ftell();
+
+        if (sha256) {
+            sha256->finish(sha256OfFwInSlot1);
+
+            // janpatch did not write the target in order, fall back to reading it back
+            if (target.hashed_length() != target.ftell()) {
+                tr_debug("Target was not written sequentially, reading it back to calculate the hash");
+                sha256->calculate(getSlotFwAddress(_slots.target_slot), *sizeOfFwInSlot1, sha256OfFwInSlot1);
+            }
+
+            delete sha256;
+        }
+
+        return LW_UC_OK;
+    }
+
+    /**
+     * Decompress and/or decrypt a full image in slot 0 and place it in slot 1
+     * (or over slot 2 when in-place delta updates are enabled, see LW_UC_DELTA_TARGET_FW_ADDRESS).
+     * The target is written in order, so every page is erased once, and the package in slot 0 is not modified.
+     *
+     * @param packedSize Size of the image that we just received
+     * @param unpackedSize Size of the image after decompression (from the manifest), or packedSize if it's not compressed
+     * @param sizeOfFw Out parameter which will be set to the size of the unpacked firmware
+     * @param decryptor If set, the image is decrypted while it's being read
+     * @param sha256OfFw Out parameter which will be set to the SHA256 hash of the unpacked firmware
+     * @param compressed If set, the image is heatshrink compressed
+     */
+    LW_UC_STATUS unpackSlot0Update(size_t packedSize, size_t unpackedSize, uint32_t *sizeOfFw,
+                                   FragmentationAesCtr *decryptor, unsigned char *sha256OfFw, bool compressed) {
+        LW_UC_STATUS readError = compressed ? LW_UC_DECOMPRESSION_FAILED : LW_UC_DECRYPTION_FAILED;
+
+        if (unpackedSize > MBED_CONF_LORAWAN_UPDATE_CLIENT_SLOT_SIZE) {
+            tr_warn("Unpacked firmware (%u bytes) does not fit in a slot", unpackedSize);
+            return readError;
+        }
+
+        FragmentationHeatshrinkDecoder decoder;
+        if (compressed && decoder.init(MBED_CONF_LORAWAN_UPDATE_CLIENT_COMPRESSION_MAX_WINDOW_BITS) != 0) {
+            return LW_UC_OUT_OF_MEMORY;
+        }
+
+        BDFILE source(&_bd, getSlotFwAddress(_slots.receive_slot), unpackedSize);
+        source.set_decryption(decryptor);
+        if (compressed) {
+            source.set_decompression(&decoder, packedSize);
+        }
+
+#if defined(MBED_CONF_LORAWAN_UPDATE_CLIENT_IN_PLACE_DELTA_JOURNAL_ADDRESS)
+        // the old firmware in slot 2 is not needed, but it's going to be overwritten
+        LW_UC_STATUS invalidateStatus = invalidateSlot2Header();
+        if (invalidateStatus != LW_UC_OK) return invalidateStatus;
+#endif
+
+        FragmentationSequentialWriter target_writer;
+        uint32_t targetAddress = getSlotFwAddress(_slots.target_slot);
+        BDFILE target(&_bd, targetAddress, 0);
+
+        if (target_writer.start(&_bd, targetAddress,
+                targetAddress + MBED_CONF_LORAWAN_UPDATE_CLIENT_SLOT_SIZE) == BD_ERROR_OK) {
+            target.set_sequential_writer(&target_writer);
+        }
+
+        // hash the unpacked firmware while it's written, so it does not need to be read back
+        uint8_t sha_buffer[LW_UC_SHA256_BUFFER_SIZE];
+        FragmentationSha256* sha256 = new FragmentationSha256(&_bd, sha_buffer, sizeof(sha_buffer));
+        sha256->start();
+        target.set_hash(sha256);
+
+        uint8_t buffer[LW_UC_DECOMPRESS_BUFFER_SIZE];
+        size_t bytes_left = unpackedSize;
+        LW_UC_STATUS status = LW_UC_OK;
+
+        // decrypting is reported as part of hashing, like it was when images were decrypted in slot 0
+        LW_UC_PROGRESS_PHASE phase = compressed ? LW_UC_PROGRESS_DECOMPRESS : LW_UC_PROGRESS_HASH;
+        reportProgress(phase, 0, unpackedSize);
+
+        while (bytes_left > 0) {
+            size_t length = bytes_left > sizeof(buffer) ? sizeof(buffer) : bytes_left;
+
+            if (bd_fread(buffer, 1, length, &source) != length) {
+                tr_warn("Unpacking firmware failed at offset %u", unpackedSize - bytes_left);
+                status = readError;
+                break;
+            }
+
+            if (bd_fwrite(buffer, 1, length, &target) != length) {
+                status = LW_UC_BD_WRITE_ERROR;
+                break;
+            }
+
+            bytes_left -= length;
+
+            reportProgress(phase, unpackedSize - bytes_left, unpackedSize);
+        }
+
+        if (bd_fflush(&target) != 0 && status == LW_UC_OK) {
+            status = LW_UC_BD_WRITE_ERROR;
+        }
+
+        sha256->finish(sha256OfFw);
+        delete sha256;
+
+        if (status != LW_UC_OK) return status;
+
+        tr_debug("Unpacked %u bytes into %u bytes", packedSize, unpackedSize);
+
+        *sizeOfFw = unpackedSize;
+
+        return LW_UC_OK;
+    }
+
+#if defined(MBED_CONF_LORAWAN_UPDATE_CLIENT_IN_PLACE_DELTA_JOURNAL_ADDRESS)
+    /**
+     * Overwrite the slot 2 header with an empty one (size 0), so slot 2 is not used as delta source anymore
+     */
+    LW_UC_STATUS invalidateSlot2Header() {
+        arm_uc_firmware_details_t details;
+        memset(&details, 0, sizeof(arm_uc_firmware_details_t));
+
+        if (_bd.program(&details, MBED_CONF_LORAWAN_UPDATE_CLIENT_SLOT2_HEADER_ADDRESS, sizeof(arm_uc_firmware_details_t)) != BD_ERROR_OK) {
+            tr_warn("Failed to invalidate slot 2 header");
+            return LW_UC_BD_WRITE_ERROR;
+        }
+
+        return LW_UC_OK;
+    }
+#endif
+
+#if defined(LW_UC_DELTA_CHECKPOINTS)
+    /**
+     * Set up the checkpoint log for a delta update, and find the checkpoint to resume from
+     *
+     * @param checkpoint Checkpoint log
+     * @param packageSize Size of the package in slot 0, including the signature
+     * @param resume Out parameter, checkpoint of this package to resume from (target_length 0 to start at the beginning)
+     *
+     * @returns true if checkpoints can be saved
+     */
+    bool loadDeltaCheckpoint(FragmentationCheckpoint *checkpoint, size_t packageSize, FragmentationCheckpoint_t *resume) {
+        memset(resume, 0, sizeof(FragmentationCheckpoint_t));
+        resume->package_size = packageSize;
+
+        // the signature identifies the package
+        uint8_t crc_buffer[LW_UC_SHA256_BUFFER_SIZE];
+        FragmentationCrc32 crc32(&_bd, crc_buffer, LW_UC_SHA256_BUFFER_SIZE);
+        resume->package_crc = crc32.calculate(getSlotFwAddress(_slots.receive_slot) + packageSize - FOTA_SIGNATURE_LENGTH,
+            FOTA_SIGNATURE_LENGTH);
+
+        if (checkpoint->init(&_bd, MBED_CONF_LORAWAN_UPDATE_CLIENT_DELTA_CHECKPOINT_ADDRESS) != BD_ERROR_OK) {
+            tr_warn("Could not set up delta update checkpoints");
+            return false;
+        }
+
+        FragmentationCheckpoint_t last;
+        int r = checkpoint->load(&last);
+        if (r < 0) return false;
+
+        if (r == 1 && last.package_size == resume->package_size && last.package_crc == resume->package_crc) {
+            tr_info("Resuming delta update, %lu bytes of the patched firmware are in flash already", last.target_length);
+            memcpy(resume, &last, sizeof(FragmentationCheckpoint_t));
+            return true;
+        }
+
+        // left over from another update
+        if (r == 1 && checkpoint->clear() != BD_ERROR_OK) return false;
+
+        return true;
+    }
+#endif
+
+    /**
+     * Default slot roles: fragments go into slot 0, delta updates are patched from slot 2 into slot 1
+     * (or into slot 2 itself for in-place delta updates)
+     */
+    void resetSlotTable() {
+        memset(&_slots, 0, sizeof(SlotTable_t));
+        _slots.receive_slot = 0;
+#if defined(MBED_CONF_LORAWAN_UPDATE_CLIENT_IN_PLACE_DELTA_JOURNAL_ADDRESS)
+        _slots.target_slot = 2;
+#else
+        _slots.target_slot = 1;
+#endif
+        _slots.baseline_slot = 2;
+        _slots.pending_slot = LW_UC_NO_SLOT;
+    }
+
+    /**
+     * Address of the header of a slot
+     */
+    uint32_t getSlotHeaderAddress(uint8_t slot) {
+        switch (slot) {
+            case 0: return MBED_CONF_LORAWAN_UPDATE_CLIENT_SLOT0_HEADER_ADDRESS;
+            case 1: return MBED_CONF_LORAWAN_UPDATE_CLIENT_SLOT1_HEADER_ADDRESS;
+            default: return MBED_CONF_LORAWAN_UPDATE_CLIENT_SLOT2_HEADER_ADDRESS;
+        }
+    }
+
+    /**
+     * Address of the firmware in a slot
+     */
+    uint32_t getSlotFwAddress(uint8_t slot) {
+        switch (slot) {
+            case 0: return MBED_CONF_LORAWAN_UPDATE_CLIENT_SLOT0_FW_ADDRESS;
+            case 1: return MBED_CONF_LORAWAN_UPDATE_CLIENT_SLOT1_FW_ADDRESS;
+            default: return MBED_CONF_LORAWAN_UPDATE_CLIENT_SLOT2_FW_ADDRESS;
+        }
+    }
+
+    /**
+     * Size and hash of the firmware in the delta baseline slot
+     *
+     * @param details Out parameter, only size and hash are set when the baseline was promoted
+     */
+    LW_UC_STATUS getDeltaBaselineDetails(arm_uc_firmware_details_t *details) {
+        // promoted slots have a bootloader header, the firmware is described in the slot table instead
+        if (_slots.baseline_size != 0) {
+            memset(details, 0, sizeof(arm_uc_firmware_details_t));
+            details->size = _slots.baseline_size;
+            memcpy(details->hash, _slots.baseline_hash, 32);
+            return LW_UC_OK;
+        }
+
+        if (_bd.read(details, getSlotHeaderAddress(_slots.baseline_slot), sizeof(arm_uc_firmware_details_t)) != BD_ERROR_OK) {
+            return LW_UC_BD_READ_ERROR;
+        }
+
+        return LW_UC_OK;
+    }
+
+#if defined(LW_UC_SLOT_TABLE)
+    /**
+     * Address of one of the two copies of the slot table, every copy lives in its own page
+     * so a power loss while one copy is written leaves the other intact
+     *
+     * @param copy Copy (0 or 1)
+     */
+    uint32_t getSlotTableAddress(uint8_t copy) {
+        return MBED_CONF_LORAWAN_UPDATE_CLIENT_SLOT_TABLE_ADDRESS + (copy * _bd.get_page_size());
+    }
+
+    /**
+     * Read one copy of the slot table from flash
+     *
+     * @param copy Copy (0 or 1)
+     * @param table Out parameter, the table
+     *
+     * @returns true if the copy has a valid CRC and valid slot roles
+     */
+    bool readSlotTable(uint8_t copy, SlotTable_t *table) {
+        if (_bd.read(table, getSlotTableAddress(copy), sizeof(SlotTable_t)) != BD_ERROR_OK) {
+            return false;
+        }
+
+        return table->magic == LW_UC_SLOT_TABLE_MAGIC
+            && table->crc == crc32(0, (uint8_t*)table, sizeof(SlotTable_t) - sizeof(table->crc))
+            && table->receive_slot < 3 && table->target_slot < 3 && table->baseline_slot < 3
+            && table->receive_slot != table->target_slot && table->receive_slot != table->baseline_slot
+            && table->target_slot != table->baseline_slot
+            && (table->pending_slot < 3 || table->pending_slot == LW_UC_NO_SLOT);
+    }
+
+    /**
+     * Read the slot table from flash, uses the valid copy with the highest generation,
+     * falls back to the default slot roles if there is no valid copy
+     */
+    void loadSlotTable() {
+        SlotTable_t tables[2];
+        bool valid[2] = { readSlotTable(0, &tables[0]), readSlotTable(1, &tables[1]) };
+
+        if (valid[0] && valid[1]) {
+            // generation wraps around, compare the distance rather than the absolute value
+            _slotTableCopy = (int32_t)(tables[1].generation - tables[0].generation) > 0 ? 1 : 0;
+            memcpy(&_slots, &tables[_slotTableCopy], sizeof(SlotTable_t));
+        }
+        else if (valid[0] || valid[1]) {
+            _slotTableCopy = valid[0] ? 0 : 1;
+            memcpy(&_slots, &tables[_slotTableCopy], sizeof(SlotTable_t));
+        }
+        else {
+            // no valid copy, the first write goes to copy 0
+            _slotTableCopy = 1;
+            resetSlotTable();
+        }
+
+        tr_debug("Slot table: copy=%u, generation=%lu, receive=%u, target=%u, baseline=%u, pending=%u",
+            _slotTableCopy, _slots.generation, _slots.receive_slot, _slots.target_slot, _slots.baseline_slot, _slots.pending_slot);
+    }
+
+    /**
+     * Write the slot table to flash, always overwrites the older copy
+     * (the copy that was not loaded or written last), so the current table survives a failed write
+     */
+    LW_UC_STATUS writeSlotTable() {
+        uint8_t copy = _slotTableCopy == 0 ? 1 : 0;
+
+        _slots.magic = LW_UC_SLOT_TABLE_MAGIC;
+        _slots.generation++;
+        _slots.crc = crc32(0, (uint8_t*)&_slots, sizeof(SlotTable_t) - sizeof(_slots.crc));
+
+        if (_bd.program(&_slots, getSlotTableAddress(copy), sizeof(SlotTable_t)) != BD_ERROR_OK) {
+            tr_warn("Failed to write slot table (copy %u)", copy);
+            return LW_UC_BD_WRITE_ERROR;
+        }
+
+        _slotTableCopy = copy;
+
+        return LW_UC_OK;
+    }
+#endif
+
+#if defined(MBED_CONF_LORAWAN_UPDATE_CLIENT_SLOT2_VERIFIED_RECORD_ADDRESS)
+    /**
+     * Read the verified record for slot 2 from flash
+     * (the delta baseline, which moves to another slot when the slot table promotes new firmware)
+     *
+     * @param record Out parameter, the record
+     *
+     * @returns true if a record with a valid CRC was found
+     */
+    bool readSlot2VerifiedRecord(VerifiedSlotRecord_t *record) {
+        if (_bd.read(record, MBED_CONF_LORAWAN_UPDATE_CLIENT_SLOT2_VERIFIED_RECORD_ADDRESS, sizeof(VerifiedSlotRecord_t)) != BD_ERROR_OK) {
+            return false;
+        }
+
+        if (record->magic != LW_UC_VERIFIED_RECORD_MAGIC) {
+            return false;
+        }
+
+        return record->crc == crc32(0, (uint8_t*)record, sizeof(VerifiedSlotRecord_t) - sizeof(record->crc));
+    }
+
+    /**
+     * Whether the firmware in slot 2 was verified before, and has not been written to since
+     *
+     * @param size Size of the firmware in slot 2 (from the slot 2 header)
+     * @param hash SHA256 hash of the firmware in slot 2 (from the slot 2 header)
+     */
+    bool isSlot2Verified(size_t size, const uint8_t hash[32]) {
+        VerifiedSlotRecord_t record;
+        if (!readSlot2VerifiedRecord(&record)) {
+            return false;
+        }
+
+        tr_debug("Slot 2 verified record: generation=%lu, verified=%lu", record.generation, record.verified);
+
+        return record.verified == 1
+            && record.address == getSlotFwAddress(_slots.baseline_slot)
+            && record.size == size
+            && compare_buffers(record.hash, hash, 32);
+    }
+
+    /**
+     * Write the verified record for slot 2 to flash
+     *
+     * @param verified Whether the firmware is verified, or whether the record is invalidated
+     * @param size Size of the firmware in slot 2
+     * @param hash SHA256 hash of the firmware in slot 2
+     */
+    LW_UC_STATUS writeSlot2VerifiedRecord(bool verified, size_t size, const uint8_t hash[32]) {
+        VerifiedSlotRecord_t record;
+        uint32_t generation = readSlot2VerifiedRecord(&record) ? record.generation + 1 : 0;
+
+        record.magic = LW_UC_VERIFIED_RECORD_MAGIC;
+        record.generation = generation;
+        record.address = getSlotFwAddress(_slots.baseline_slot);
+        record.size = size;
+        memcpy(record.hash, hash, 32);
+        record.verified = verified ? 1 : 0;
+        record.crc = crc32(0, (uint8_t*)&record, sizeof(VerifiedSlotRecord_t) - sizeof(record.crc));
+
+        if (_bd.program(&record, MBED_CONF_LORAWAN_UPDATE_CLIENT_SLOT2_VERIFIED_RECORD_ADDRESS, sizeof(VerifiedSlotRecord_t)) != BD_ERROR_OK) {
+            tr_warn("Failed to write slot 2 verified record");
+            return LW_UC_BD_WRITE_ERROR;
+        }
+
+        tr_debug("Wrote slot 2 verified record: generation=%lu, verified=%u", generation, verified);
+
+        // re-arm the watch, the next write to slot 2 invalidates this record again
+        if (verified) {
+            watchSlot2VerifiedRecord();
+        }
+
+        return LW_UC_OK;
+    }
+
+    /**
+     * Invalidate the verified record on the next write to the baseline slot (header or firmware)
+     */
+    void watchSlot2VerifiedRecord() {
+        uint32_t headerAddress = getSlotHeaderAddress(_slots.baseline_slot);
+        _bd.set_write_watch(headerAddress,
+            (getSlotFwAddress(_slots.baseline_slot) - headerAddress) + MBED_CONF_LORAWAN_UPDATE_CLIENT_SLOT_SIZE,
+            callback(this, &LoRaWANUpdateClient::invalidateSlot2VerifiedRecord));
+    }
+
+    /**
+     * Invoked by the block device wrapper right before something is written to slot 2
+     */
+    void invalidateSlot2VerifiedRecord() {
+        VerifiedSlotRecord_t record;
+        if (!readSlot2VerifiedRecord(&record) || record.verified != 1) {
+            return;
+        }
+
+        writeSlot2VerifiedRecord(false, record.size, record.hash);
+    }
+#endif
+
+    /**
+     * Invoke the progress callback. A phase starts when it's reported with 0 bytes processed (or when another
+     * phase is reported), after that the callback only fires when another percent is done.
+     *
+     * @param phase Phase that is in progress
+     * @param processed Number of bytes processed so far
+     * @param total Number of bytes this phase processes
+     */
+    void reportProgress(LW_UC_PROGRESS_PHASE phase, size_t processed, size_t total) {
+        if (!callbacks.progress) return;
+
+        if (phase != _progressPhase || processed == 0) {
+            _progressPhase = phase;
+            _progressPct = -1;
+            _progressTimer.reset();
+            _progressTimer.start();
+        }
+
+        int pct = total == 0 ? 100 : static_cast<int>((static_cast<uint64_t>(processed) * 100) / total);
+        if (pct == _progressPct && processed != total) return;
+        _progressPct = pct;
+
+        LoRaWANUpdateClientProgress_t progress;
+        progress.phase = phase;
+        progress.processed = processed;
+        progress.total = total;
+        progress.elapsed_us = _progressTimer.read_high_resolution_us();
+
+        callbacks.progress(&progress);
+    }
+
+    /**
+     * Report the number of bytes of the data block that were received in a fragmentation session
+     *
+     * @param fragIx Index of the fragmentation session
+     * @param complete Whether the data block was reconstructed
+     */
+    void reportDecodeProgress(uint8_t fragIx, bool complete) {
+        FragmentationSessionOpts_t opts = frag_sessions[fragIx].sessionOptions;
+        size_t total = (opts.NumberOfFragments * opts.FragmentSize) - opts.Padding;
+
+        // with redundancy packets more fragments than the data block holds can come in before it's complete
+        size_t processed = complete ? total : frag_sessions[fragIx].session->get_received_frame_count() * opts.FragmentSize;
+        if (processed > total) processed = total;
+
+        reportProgress(LW_UC_PROGRESS_DECODE, processed, total);
+    }
+
+    void reportHashProgress(size_t processed, size_t total) {
+        reportProgress(LW_UC_PROGRESS_HASH, processed, total);
+    }
+
+    void reportPatchProgress(uint8_t pct) {
+        // janpatch reports a percentage of the patch file
+        reportProgress(LW_UC_PROGRESS_PATCH, (_patchProgressSize * pct) / 100, _patchProgressSize);
+    }
+
+    /**
+     * Find an active multicast group based on device address
+     */
+    MulticastGroupParams_t *mcGroupFromDevAddr(uint32_t devAddr) {
+        if (devAddr == 0x0) return NULL;
+
+        for (size_t ix = 0; ix < NB_MC_GROUPS; ix++) {
+            if (mc_groups[ix].active && mc_groups[ix].mcAddr == devAddr) {
+                return &(mc_groups[ix]);
+            }
+        }
+
+        return NULL;
+    }
+
+    /**
+     * Update multicast group start dates based on an incoming clock sync
+     */
+    void updateMcGroupsBasedOnNewTime() {
+        uint64_t currTimeMs = getCurrentTime_ms();
+        uint64_t currTime = currTimeMs / 1000;
 
         tr_debug("updateMcGroupsBasedOnNewTime - time is now %llu", currTime);
 
         // look at all the multicast groups and see if there are active timers which are dependent on the time...
         for (size_t mcIx = 0; mcIx < NB_MC_GROUPS; mcIx++) {
             if (mc_groups[mcIx].active && mc_groups[mcIx].params.sessionTime > currTime) {
-                uint32_t timeToStart = mc_groups[mcIx].params.sessionTime - static_cast<uint32_t>(currTime % 4294967296 /*pow(2, 32)*/);
+                uint64_t timeToStartMs = getTimeToSessionStart_ms(mcIx, currTimeMs);
 
-                tr_debug("adjusted time to start for mc group %u to %u", mcIx, timeToStart);
+                tr_debug("adjusted time to start for mc group %u to %llu ms", mcIx, timeToStartMs);
 
-                mc_groups[mcIx].startTimeout.attach(callback(this, &LoRaWANUpdateClient::mc_start_irq), static_cast<float>(timeToStart));
-                mc_groups[mcIx].timeoutTimeout.attach(callback(this, &LoRaWANUpdateClient::mc_timeout_irq),
-                    static_cast<float>(timeToStart + mc_groups[mcIx].params.timeOut));
+                scheduleClassCSession(mcIx, timeToStartMs);
             }
         }
     }
 
     /**
-     * Relay message back to network server - to be provided by the caller of this client
+     * Relay message back to network server - to be provided by the caller of this client.
+     * The message goes through the outbound queue, which is flushed right away unless sending is deferred.
+     * Only call this from the thread that handles downlinks, see sendFromScheduler for scheduler events.
      */
     void send(uint8_t port, uint8_t *data, size_t length, bool confirmed = true, bool retriesAllowed = true) {
+        // make room by sending the next message, unless the application decides when to send
+        if (_outbound.size() == LW_UC_OUTBOUND_QUEUE_SIZE && !_outboundDeferred) {
+            sendNextOutbound();
+        }
+
+        if (!enqueue(port, data, length, confirmed, retriesAllowed)) return;
+
+        if (!_outboundDeferred) {
+            flushOutbound();
+        }
+    }
+
+    /**
+     * Queue a message from a scheduler event, which runs in an event queue or in the timer interrupt.
+     * The send function is not called from here, callbacks.outboundPending asks the application
+     * to call sendNextOutbound from its own thread.
+     */
+    void sendFromScheduler(uint8_t port, uint8_t *data, size_t length, bool confirmed = true, bool retriesAllowed = true) {
+        if (!enqueue(port, data, length, confirmed, retriesAllowed)) return;
+
+        if (callbacks.outboundPending) {
+            callbacks.outboundPending();
+        }
+    }
+
+    /**
+     * Put a message in the outbound queue
+     *
+     * @returns false if the message was dropped
+     */
+    bool enqueue(uint8_t port, uint8_t *data, size_t length, bool confirmed, bool retriesAllowed) {
+        if (length > LW_UC_OUTBOUND_MAX_LENGTH) {
+            tr_warn("Message on port %u too large for the outbound queue (%u bytes)", port, length);
+            _stats.outboundDropped++;
+            return false;
+        }
+
+        OutboundMessage_t message;
+        message.port = port;
+        memcpy(message.data, data, length);
+        message.length = length;
+        message.confirmed = confirmed;
+        message.retriesAllowed = retriesAllowed;
+        message.createdMs = get_time_ms();
+
+        // these messages are (partly) filled in when they're sent, so they need to stay on their own
+        if (isTimeRelative(message)) {
+            message.priority = OUTBOUND_PRIORITY_HIGH;
+            message.coalesce = false;
+        }
+        else if (isFragSessionStatusAns(message)) {
+            message.priority = OUTBOUND_PRIORITY_NORMAL;
+            message.coalesce = false;
+        }
+        else {
+            message.priority = data[0] == PACKAGE_VERSION_ANS ? OUTBOUND_PRIORITY_LOW : OUTBOUND_PRIORITY_NORMAL;
+            message.coalesce = true;
+        }
+
+        bool appended;
+        if (!_outbound.push(message, &appended)) {
+            tr_warn("Outbound queue full, dropping message on port %u", port);
+            _stats.outboundDropped++;
+            return false;
+        }
+
+        if (appended) {
+            _stats.outboundCoalesced++;
+        }
+
+        return true;
+    }
+
+    /**
+     * Whether a message contains a field relative to the time it's sent at
+     * (AppTimeReq, AppTimePeriodicityAns or ClassCSessionAns with timeToStart)
+     */
+    bool isTimeRelative(const OutboundMessage_t &message) {
+        if (message.port == CLOCKSYNC_PORT) {
+            return (message.data[0] == CLOCK_APP_TIME_REQ && message.length == CLOCK_APP_TIME_REQ_LENGTH)
+                || (message.data[0] == CLOCK_APP_TIME_PERIODICITY_ANS && message.length == CLOCK_APP_TIME_PERIODICITY_ANS_LENGTH);
+        }
+        if (message.port == MCCONTROL_PORT) {
+            return message.data[0] == MC_CLASSC_SESSION_ANS && message.length == MC_CLASSC_SESSION_ANS_LENGTH;
+        }
+        return false;
+    }
+
+    /**
+     * Whether a message is a FragSessionStatusAns, which is filled in from the session when it's sent
+     */
+    bool isFragSessionStatusAns(const OutboundMessage_t &message) {
+        return message.port == FRAGSESSION_PORT && message.data[0] == FRAG_SESSION_STATUS_ANS
+            && message.length == FRAG_SESSION_STATUS_ANS_LENGTH;
+    }
+
+    /**
+     * Hand a message from the outbound queue to the send function, after updating time-relative fields
+     * and filling in the status of fragmentation sessions. Runs in the thread that calls sendNextOutbound,
+     * so it doesn't race the handlers over the clock and the sessions.
+     *
+     * @returns false if the message has become obsolete and was not sent
+     */
+    bool transmit(OutboundMessage_t &message) {
+        uint64_t timeMs = get_time_ms();
+
+        if (isFragSessionStatusAns(message)) {
+            if (!fillFragmentationStatusAns(message.data)) return false;
+        }
+        else if (isTimeRelative(message)) {
+            if (message.data[0] == CLOCK_APP_TIME_REQ) {
+                // the network compares DeviceTime against the reception time, so it has to be the time of sending
+                uint64_t deviceTimeMs = getGpsTime_ms(timeMs);
+                writeDeviceTime(message.data + 1, static_cast<uint32_t>((deviceTimeMs / 1000) % 4294967296 /*pow(2, 32)*/));
+
+                // keep the AnsRequired bit, the token is the one that the next AppTimeAns has to carry
+                message.data[5] = (message.data[5] & 0b10000) + (_clockSyncTokenReq % 16);
+
+                _clockSync.timeAtLastRequestMs = timeMs;
+                _clockSync.deviceTimeAtLastRequestMs = deviceTimeMs;
+                _clockSync.periodicRequestQueued = false;
+
+                // the next request goes out one interval after this one was actually sent
+                scheduleClockSync();
+            }
+            else if (message.data[0] == CLOCK_APP_TIME_PERIODICITY_ANS) {
+                writeDeviceTime(message.data + 2, static_cast<uint32_t>(getCurrentTime_s() % 4294967296 /*pow(2, 32)*/));
+            }
+            else {
+                rewriteClassCSessionAns(message.data, static_cast<uint32_t>((timeMs - message.createdMs) / 1000));
+            }
+        }
+
         LoRaWANUpdateClientSendParams_t params;
-        params.port = port;
-        params.data = data;
-        params.length = length;
-        params.confirmed = confirmed;
-        params.retriesAllowed = retriesAllowed;
+        params.port = message.port;
+        params.data = message.data;
+        params.length = message.length;
+        params.confirmed = message.confirmed;
+        params.retriesAllowed = message.retriesAllowed;
+        // time-relative fields are up to date now, updateClassCSessionAns only needs to correct for later delays
         params.createdTimestamp = get_rtc_time_s();
 
         _send_fn(params);
+
+        return true;
+    }
+
+    /**
+     * Send all messages in the outbound queue
+     */
+    void flushOutbound() {
+        while (sendNextOutbound() == LW_UC_OK) {}
+    }
+
+    /**
+     * Write a 32 bits time in little endian
+     */
+    void writeDeviceTime(uint8_t *buffer, uint32_t time) {
+        buffer[0] = time & 0xff;
+        buffer[1] = time >> 8 & 0xff;
+        buffer[2] = time >> 16 & 0xff;
+        buffer[3] = time >> 24 & 0xff;
+    }
+
+    /**
+     * Update timeToStart of a ClassCSessionAns
+     *
+     * @param data ClassCSessionAns message
+     * @param timeDelta Seconds since the message was created
+     */
+    void rewriteClassCSessionAns(uint8_t *data, uint32_t timeDelta) {
+        uint32_t originalTimeToStart = data[2] + (data[3] << 8) + (data[4] << 16);
+
+        // no synchronised clock when the request came in, there's no start time to update
+        if (originalTimeToStart == 0xffffff) return;
+
+        uint32_t timeToStart;
+        if (timeDelta > originalTimeToStart) { // should already have started, send 0 back
+            timeToStart = 0;
+        }
+        else {
+            timeToStart = originalTimeToStart - timeDelta;
+        }
+
+        tr_debug("updateClassCSessionAns, originalTimeToStart=%lu, delta=%lu, newTimeToStart=%lu",
+            originalTimeToStart, timeDelta, timeToStart);
+
+        // update buffer
+        data[2] = timeToStart & 0xff;
+        data[3] = timeToStart >> 8 & 0xff;
+        data[4] = timeToStart >> 16 & 0xff;
     }
 
     /**
@@ -1341,52 +3018,414 @@ private:
     }
 
     /**
-     * Multicast starting IRQ - indicates when to switch to Class C
+     * Get the value of the time base in milliseconds: the kernel tick with RTOS, the Clock without RTOS
+     */
+    uint64_t get_time_ms() {
+#if MBED_CONF_RTOS_PRESENT
+        return Kernel::get_ms_count();
+#elif !defined(TARGET_SIMULATOR)
+        return _clock.read_ms();
+#else
+        return static_cast<uint64_t>(time(NULL)) * 1000;
+#endif
+    }
+
+    /**
+     * Convert a value of the time base into GPS time in milliseconds. Before the first clock sync this is the RTC.
      *
-     * @todo: the way that this is designed right now makes it impossible to have multiple class C sessions active
-     *        one way around would be to use an eventqueue and add some state to the event...
-     *        or we can bind this to the MulticastGroupParams_t object (but would need to be a class, not a struct)
-     *        - not really a problem in the current implementation as we limit to 1 group, but should be fixed
+     * @param timeMs Value of the time base
      */
-    void mc_start_irq() {
-        for (size_t ix = 0; ix < NB_MC_GROUPS; ix++) {
-            if (mc_groups[ix].active && callbacks.switchToClassC) {
-
-                // copy the credentials so the user application can use them
-                LoRaWANUpdateClientClassCSession_t session;
-                session.deviceAddr = mc_groups[ix].mcAddr;
-                memcpy(session.nwkSKey, mc_groups[ix].nwkSKey, 16);
-                memcpy(session.appSKey, mc_groups[ix].appSKey, 16);
-                session.minFcFCount = mc_groups[ix].minFcFCount;
-                session.maxFcFCount = mc_groups[ix].maxFcFCount;
-                session.downlinkFreq = mc_groups[ix].params.dlFreq;
-                session.datarate = mc_groups[ix].params.dr;
-
-                callbacks.switchToClassC(&session);
+    uint64_t getGpsTime_ms(uint64_t timeMs) {
+        if (!_clockSync.synced) {
+            return static_cast<uint64_t>(get_rtc_time_s()) * 1000;
+        }
+
+        return timeMs + _clockSync.correctionMs + getPredictedDrift_ms(timeMs);
+    }
+
+    /**
+     * Drift of the clock since the last clock sync that is predicted by the drift estimate, in milliseconds
+     *
+     * @param timeMs Value of the time base
+     */
+    int64_t getPredictedDrift_ms(uint64_t timeMs) {
+        int64_t elapsed = static_cast<int64_t>(timeMs - _clockSync.timeAtLastSyncMs);
+        return (elapsed * _clockSync.driftPpm) / 1000000;
+    }
+
+    /**
+     * Milliseconds until the class C window of a multicast group opens, 0 if the session time is in the past
+     *
+     * @param currTimeMs Current GPS time in milliseconds
+     */
+    uint64_t getTimeToSessionStart_ms(uint8_t mcIx, uint64_t currTimeMs) {
+        // the session time is modulo 2^32 seconds
+        uint64_t now = currTimeMs % (4294967296ULL * 1000);
+        uint64_t start = static_cast<uint64_t>(mc_groups[mcIx].params.sessionTime) * 1000;
+
+        return start > now ? start - now : 0;
+    }
+
+    /**
+     * Set a new correction of the time base, and update the drift estimate from the change of the correction
+     * since the start of the measurement interval
+     *
+     * @param correctionMs New correction (GPS time - time base) in milliseconds
+     * @param timeMs Value of the time base at which the correction was measured
+     */
+    void applyClockCorrection(int64_t correctionMs, uint64_t timeMs) {
+        uint64_t elapsed = timeMs - _clockSync.driftBaseTimeMs;
+
+        if (!_clockSync.driftBaseValid) {
+            _clockSync.driftBaseValid = true;
+            _clockSync.driftBaseTimeMs = timeMs;
+            _clockSync.driftBaseCorrectionMs = correctionMs;
+        }
+        else if (elapsed >= LW_UC_CLOCK_DRIFT_MIN_INTERVAL * 1000ULL) {
+            int64_t observed = (correctionMs - _clockSync.driftBaseCorrectionMs) * 1000000 / static_cast<int64_t>(elapsed);
+
+            if (observed > LW_UC_CLOCK_DRIFT_MAX_PPM || observed < -LW_UC_CLOCK_DRIFT_MAX_PPM) {
+                tr_warn("clock correction implies %ld ppm drift, treating it as a step", static_cast<int32_t>(observed));
             }
+            else {
+                // clock sync answers have a resolution of one second
+                uint32_t resolution = static_cast<uint32_t>(1000000000ULL / elapsed);
+                uint32_t innovation = static_cast<uint32_t>(observed > _clockSync.driftPpm ?
+                    observed - _clockSync.driftPpm : _clockSync.driftPpm - observed);
+
+                if (!_clockSync.driftEstimated) {
+                    _clockSync.driftPpm = static_cast<int32_t>(observed);
+                    _clockSync.driftEstimated = true;
+                    innovation = 0;
+                }
+                else {
+                    _clockSync.driftPpm = static_cast<int32_t>(((3 * static_cast<int64_t>(_clockSync.driftPpm)) + observed) / 4);
+                }
+
+                _clockSync.driftUncertaintyPpm = innovation > resolution ? innovation : resolution;
+
+                tr_debug("clock drift %ld ppm (observed %ld ppm, uncertainty %lu ppm)",
+                    _clockSync.driftPpm, static_cast<int32_t>(observed), _clockSync.driftUncertaintyPpm);
+            }
+
+            _clockSync.driftBaseTimeMs = timeMs;
+            _clockSync.driftBaseCorrectionMs = correctionMs;
+        }
+
+        _clockSync.synced = true;
+        _clockSync.correctionMs = correctionMs;
+        _clockSync.timeAtLastSyncMs = timeMs;
+
+        scheduleClockSync();
+    }
+
+    /**
+     * Schedule the next AppTimeReq. With a periodicity requested by the application server that is used,
+     * otherwise (if lorawan-update-client.clock-sync-max-error-ms is set) the next sync is scheduled when the
+     * predicted error of the clock reaches the maximum error.
+     */
+    void scheduleClockSync() {
+        uint64_t interval = 0;
+
+        if (_clockSync.periodicity != 0) {
+            // +/- 30 seconds, so devices that received the same request don't all transmit at once
+            interval = _clockSync.periodicity - 30 + (getRandom() % 61);
+        }
+#ifdef MBED_CONF_LORAWAN_UPDATE_CLIENT_CLOCK_SYNC_MAX_ERROR_MS
+        else if (_clockSync.driftBaseValid) {
+            uint32_t uncertainty = _clockSync.driftUncertaintyPpm > 0 ? _clockSync.driftUncertaintyPpm : 1;
+            interval = (static_cast<uint64_t>(MBED_CONF_LORAWAN_UPDATE_CLIENT_CLOCK_SYNC_MAX_ERROR_MS) * 1000) / uncertainty;
+            if (interval < LW_UC_CLOCK_SYNC_MIN_INTERVAL) {
+                interval = LW_UC_CLOCK_SYNC_MIN_INTERVAL;
+            }
+        }
+#endif
+
+        if (interval == 0) {
+            _clockScheduler.cancel(0, LW_UC_CLOCK_EVENT_SYNC);
+            return;
+        }
+
+        tr_debug("next clock sync in %lu seconds", static_cast<uint32_t>(interval));
+
+        _clockScheduler.schedule(0, LW_UC_CLOCK_EVENT_SYNC, interval * 1000000ULL);
+    }
+
+    /**
+     * Schedule the next AppTimeReq of a ForceDeviceResyncReq, if any are left
+     */
+    void scheduleClockResync() {
+        if (_clockSync.resyncRemaining == 0) {
+            _clockScheduler.cancel(0, LW_UC_CLOCK_EVENT_RESYNC);
+            return;
+        }
+
+        uint64_t delay_ms = (LW_UC_CLOCK_RESYNC_INTERVAL * 1000ULL) + (getRandom() % ((LW_UC_CLOCK_RESYNC_JITTER * 1000) + 1));
+
+        _clockScheduler.schedule(0, LW_UC_CLOCK_EVENT_RESYNC, delay_ms * 1000ULL);
+    }
+
+    /**
+     * Seed the generator for the random delays from GenAppKey, which is unique per device.
+     * rand() is not seeded by the library, so all devices with the same firmware would draw the same delays.
+     */
+    void seedRandom() {
+        const uint8_t input[16] = { 'r', 'a', 'n', 'd', 'o', 'm', ' ', 's', 'e', 'e', 'd' };
+        uint8_t output[16];
+
+        FragmentationAes aes(_genAppKey);
+        aes.encrypt(input, output);
+
+        _randomState = (output[0] << 24) + (output[1] << 16) + (output[2] << 8) + output[3];
+        if (_randomState == 0) {
+            _randomState = 1;
         }
+
+        memset(output, 0, sizeof(output));
     }
 
     /**
-     * Multicast timeout IRQ - indicates when to switch back to Class A
+     * Next number of the generator for random delays (xorshift32), safe to call from the scheduler
+     */
+    uint32_t getRandom() {
+        core_util_critical_section_enter();
+        uint32_t x = _randomState;
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        _randomState = x;
+        core_util_critical_section_exit();
+        return x;
+    }
+
+    /**
+     * Build an AppTimeReq, DeviceTime and the token are filled in when it's sent (see transmit)
      *
-     * @todo: see mc_start_irq - same problems arise here
+     * @param request Receives the message, CLOCK_APP_TIME_REQ_LENGTH bytes
+     * @param answerRequired Whether the network should also answer when the clock is in sync
      */
-    void mc_timeout_irq() {
-        for (size_t ix = 0; ix < NB_MC_GROUPS; ix++) {
-            if (mc_groups[ix].active && callbacks.switchToClassA) {
-                callbacks.switchToClassA();
+    void buildClockSyncRequest(uint8_t *request, bool answerRequired) {
+        memset(request, 0, CLOCK_APP_TIME_REQ_LENGTH);
+        request[0] = CLOCK_APP_TIME_REQ;
+        request[5] = answerRequired ? 0b10000 : 0;
+    }
+
+    /**
+     * Clock sync event handler, invoked by the scheduler
+     */
+    void clock_event(uint8_t, uint8_t event) {
+        switch (event) {
+            case LW_UC_CLOCK_EVENT_SYNC: {
+                // reschedule from here, the application might not send anything until the next interval
+                // (sending the request reschedules relative to the time it went out, see transmit)
+                scheduleClockSync();
+
+                // the previous request has not gone out yet, it gets the current DeviceTime when it does
+                if (_clockSync.periodicRequestQueued) break;
+
+                // without AnsRequired the network only answers when the clock needs a correction,
+                // the drift is estimated from those corrections
+                uint8_t request[CLOCK_APP_TIME_REQ_LENGTH];
+                buildClockSyncRequest(request, MBED_CONF_LORAWAN_UPDATE_CLIENT_CLOCK_SYNC_ANS_REQUIRED == 1);
+
+                if (!enqueue(CLOCKSYNC_PORT, request, CLOCK_APP_TIME_REQ_LENGTH, false, false)) {
+                    // queue full, try again later
+                    _clockScheduler.schedule(0, LW_UC_CLOCK_EVENT_SYNC, LW_UC_CLOCK_SYNC_MIN_INTERVAL * 1000000ULL);
+                    break;
+                }
+
+                _clockSync.periodicRequestQueued = true;
+
+                if (callbacks.outboundPending) {
+                    callbacks.outboundPending();
+                }
+                break;
+            }
+
+            case LW_UC_CLOCK_EVENT_RESYNC: {
+                // the application thread clears this when an AppTimeAns comes in
+                core_util_critical_section_enter();
+                bool resync = _clockSync.resyncRemaining > 0;
+                if (resync) {
+                    _clockSync.resyncRemaining--;
+                }
+                core_util_critical_section_exit();
+
+                if (!resync) break;
+
+                uint8_t request[CLOCK_APP_TIME_REQ_LENGTH];
+                buildClockSyncRequest(request, false);
+                sendFromScheduler(CLOCKSYNC_PORT, request, CLOCK_APP_TIME_REQ_LENGTH, false, false);
+
+                scheduleClockResync();
+                break;
+            }
+        }
+    }
+
+    /**
+     * Fragmentation session event handler, invoked by the scheduler
+     */
+    void frag_event(uint8_t fragIx, uint8_t event) {
+        switch (event) {
+            case LW_UC_FRAG_EVENT_STATUS_ANS: {
+                // the session is only read when the answer is sent, in the application thread
+                uint8_t response[FRAG_SESSION_STATUS_ANS_LENGTH] = { FRAG_SESSION_STATUS_ANS, static_cast<uint8_t>(fragIx << 6), 0, 0, 0 };
+                sendFromScheduler(FRAGSESSION_PORT, response, FRAG_SESSION_STATUS_ANS_LENGTH, false);
+                break;
             }
         }
     }
 
+    /**
+     * Schedule the start and the timeout of the class C window of a multicast group
+     *
+     * @param mcIx Index of the multicast group
+     * @param timeToStartMs Milliseconds until the class C window opens
+     */
+    void scheduleClassCSession(uint8_t mcIx, uint64_t timeToStartMs) {
+        // absolute ticker deadlines, so the timeout is not shifted by the time it takes to schedule the start
+        uint64_t start = _mcScheduler.now_us() + (timeToStartMs * 1000ULL);
+        uint64_t end = start + (static_cast<uint64_t>(mc_groups[mcIx].params.timeOut) * 1000000ULL);
+
+        _mcScheduler.schedule_at(mcIx, LW_UC_MC_EVENT_START, start);
+        _mcScheduler.schedule_at(mcIx, LW_UC_MC_EVENT_TIMEOUT, end);
+
+        // no activity yet, the window lasts timeOut seconds from the start
+        mc_groups[mcIx].lastActivityMs = static_cast<uint32_t>(start / 1000);
+    }
+
+    /**
+     * Timestamp for lastActivityMs, milliseconds of the scheduler's ticker (wraps around after 49 days)
+     */
+    uint32_t getMcActivityTimestamp() {
+        return static_cast<uint32_t>(_mcScheduler.now_us() / 1000);
+    }
+
+    /**
+     * Whether the class C window of any multicast group is open
+     */
+    bool isClassCWindowOpen() {
+        for (size_t ix = 0; ix < NB_MC_GROUPS; ix++) {
+            if (mc_groups[ix].active && mc_groups[ix].classCActive) return true;
+        }
+        return false;
+    }
+
+    /**
+     * Multicast event handler, invoked by the scheduler (from the event queue, or from the timer interrupt if there is none)
+     *
+     * @param mcIx Index of the multicast group
+     * @param event LW_UC_MC_EVENT
+     */
+    void mc_event(uint8_t mcIx, uint8_t event) {
+        if (mcIx > NB_MC_GROUPS - 1) return;
+
+        switch (event) {
+            case LW_UC_MC_EVENT_START:
+                mc_start(mcIx);
+                break;
+            case LW_UC_MC_EVENT_TIMEOUT:
+                mc_timeout_due(mcIx);
+                break;
+        }
+    }
+
+    /**
+     * Class C window of a multicast group opens - indicates when to switch to Class C
+     */
+    void mc_start(uint8_t mcIx) {
+        if (!mc_groups[mcIx].active) return;
+
+        mc_groups[mcIx].classCActive = true;
+
+        if (callbacks.switchToClassC) {
+            // copy the credentials so the user application can use them
+            LoRaWANUpdateClientClassCSession_t session;
+            session.deviceAddr = mc_groups[mcIx].mcAddr;
+            memcpy(session.nwkSKey, mc_groups[mcIx].nwkSKey, 16);
+            memcpy(session.appSKey, mc_groups[mcIx].appSKey, 16);
+            session.minFcFCount = mc_groups[mcIx].minFcFCount;
+            session.maxFcFCount = mc_groups[mcIx].maxFcFCount;
+            session.downlinkFreq = mc_groups[mcIx].params.dlFreq;
+            session.datarate = mc_groups[mcIx].params.dr;
+
+            callbacks.switchToClassC(&session);
+        }
+    }
+
+    /**
+     * Timeout event of a multicast group fired, closes the class C window unless a fragment was received
+     * in the last timeOut seconds. In that case the timeout is scheduled again, timeOut seconds after that fragment.
+     */
+    void mc_timeout_due(uint8_t mcIx) {
+        if (!mc_groups[mcIx].active) return;
+
+        uint32_t timeoutMs = static_cast<uint32_t>(mc_groups[mcIx].params.timeOut) * 1000;
+        // unsigned, so a timestamp in the future (before the window started) counts as idle for a long time
+        uint32_t idleMs = getMcActivityTimestamp() - mc_groups[mcIx].lastActivityMs;
+
+        if (idleMs < timeoutMs) {
+            _mcScheduler.schedule(mcIx, LW_UC_MC_EVENT_TIMEOUT, static_cast<uint64_t>(timeoutMs - idleMs) * 1000ULL);
+            return;
+        }
+
+        mc_timeout(mcIx);
+    }
+
+    /**
+     * Class C window of a multicast group closes - switch back to Class A when no other window is open
+     */
+    void mc_timeout(uint8_t mcIx) {
+        if (!mc_groups[mcIx].active) return;
+
+        mc_groups[mcIx].classCActive = false;
+
+        if (!isClassCWindowOpen() && callbacks.switchToClassA) {
+            callbacks.switchToClassA();
+        }
+    }
+
     // store fragmentation groups here...
     FragmentationSessionParams_t frag_sessions[NB_FRAG_GROUPS];
     MulticastGroupParams_t mc_groups[NB_MC_GROUPS];
 
+    // start and timeout events of the multicast groups
+    DeadlineScheduler<NB_MC_GROUPS * 2> _mcScheduler;
+
+    // counters for getStats, the multicast event counters come from the scheduler
+    LoRaWANUpdateClientStats_t _stats;
+
+    // uplinks that wait for the send function
+    OutboundQueue<LW_UC_OUTBOUND_QUEUE_SIZE, LW_UC_OUTBOUND_MAX_LENGTH> _outbound;
+    bool _outboundDeferred;
+
     ClockSync_t _clockSync;
     uint32_t _clockSyncTokenReq;
 
+    // state of the generator for random delays, see getRandom
+    uint32_t _randomState;
+
+    // AppTimeReq messages that are sent periodically, when the predicted clock error grows too large,
+    // or as retransmissions of a ForceDeviceResyncReq
+    DeadlineScheduler<2> _clockScheduler;
+
+    // FragSessionStatusAns messages that wait for their BlockAckDelay
+    DeadlineScheduler<NB_FRAG_GROUPS> _fragScheduler;
+
+    // roles of the firmware slots, only persisted when the slot table is enabled
+    SlotTable_t _slots;
+#if defined(LW_UC_SLOT_TABLE)
+    // copy of the slot table that holds _slots in flash (0 or 1), the next write goes to the other copy
+    uint8_t _slotTableCopy;
+#endif
+
+    // state of the phase that is reported through the progress callback
+    Timer _progressTimer;
+    LW_UC_PROGRESS_PHASE _progressPhase;
+    int _progressPct;
+    size_t _patchProgressSize;
+
 #if DEVICE_FLASH
     FlashIAP _internalFlash;
 #endif
@@ -1398,6 +3437,11 @@ private:
     // external storage
     FragmentationBlockDeviceWrapper _bd;
     uint8_t _genAppKey[16];
+    // expanded key schedule for McKEKey, derived on first McGroupSetupReq, wiped on destruction
+    FragmentationAes _mcKEKeyAes;
+    bool _mcKEKeyDerived;
+    uint8_t _fwDecryptionKey[16];
+    bool _fwDecryptionKeySet;
     Callback<void(LoRaWANUpdateClientSendParams_t&)> _send_fn;
 };
 
@@ -0,0 +1,156 @@
+/*
+* PackageLicenseDeclared: Apache-2.0
+* Copyright (c) 2018 ARM Limited
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*     http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+#ifndef _MBED_LORAWAN_UPDATE_CLIENT_OUTBOUND_QUEUE
+#define _MBED_LORAWAN_UPDATE_CLIENT_OUTBOUND_QUEUE
+
+#include "mbed.h"
+#include "platform/mbed_critical.h"
+
+// Priority of an outbound message, lower values are sent first
+enum OUTBOUND_PRIORITY {
+    OUTBOUND_PRIORITY_HIGH = 0,         // time-relative messages, e.g. AppTimeReq
+    OUTBOUND_PRIORITY_NORMAL = 1,
+    OUTBOUND_PRIORITY_LOW = 2
+};
+
+template <size_t MAX_LENGTH>
+struct OutboundMessage {
+    uint8_t port;
+    uint8_t data[MAX_LENGTH];
+    size_t length;
+    bool confirmed;
+    bool retriesAllowed;
+    uint8_t priority;
+    // whether other messages may be appended to this one
+    bool coalesce;
+    // when the message was created, for rewriting time-relative fields when it's sent
+    uint64_t createdMs;
+    // order in which messages were queued, so messages of the same priority go out first in, first out
+    uint32_t sequence;
+};
+
+/**
+ * Queue of uplink messages, owns a copy of every message.
+ *
+ * Messages that allow it are appended to a queued message on the same port (with the same confirmed and
+ * retry flags) as long as the result fits in MAX_LENGTH bytes, so several answers share one uplink.
+ * Messages are taken out by priority, and in order within a priority.
+ */
+template <size_t N, size_t MAX_LENGTH>
+class OutboundQueue {
+public:
+    typedef OutboundMessage<MAX_LENGTH> Message;
+
+    OutboundQueue() : _count(0), _sequence(0) {
+    }
+
+    /**
+     * Queue a message, or append it to a queued message
+     *
+     * @param message Message to queue, the content is copied
+     * @param appended If not NULL, set to whether the message was appended to a queued message
+     *
+     * @returns false if the message is too large or the queue is full
+     */
+    bool push(const Message &message, bool *appended = NULL) {
+        if (appended) *appended = false;
+
+        if (message.length > MAX_LENGTH) return false;
+
+        core_util_critical_section_enter();
+
+        bool queued = false;
+
+        if (message.coalesce) {
+            for (size_t ix = 0; ix < _count; ix++) {
+                Message &m = _messages[ix];
+                if (m.coalesce && m.port == message.port && m.confirmed == message.confirmed
+                        && m.retriesAllowed == message.retriesAllowed && m.length + message.length <= MAX_LENGTH) {
+                    memcpy(m.data + m.length, message.data, message.length);
+                    m.length += message.length;
+                    if (message.priority < m.priority) {
+                        m.priority = message.priority;
+                    }
+                    queued = true;
+                    if (appended) *appended = true;
+                    break;
+                }
+            }
+        }
+
+        if (!queued && _count < N) {
+            _messages[_count] = message;
+            _messages[_count].sequence = _sequence++;
+            _count++;
+            queued = true;
+        }
+
+        core_util_critical_section_exit();
+
+        return queued;
+    }
+
+    /**
+     * Take the next message out of the queue
+     *
+     * @param message Receives the message
+     *
+     * @returns false if the queue is empty
+     */
+    bool pop(Message *message) {
+        core_util_critical_section_enter();
+
+        if (_count == 0) {
+            core_util_critical_section_exit();
+            return false;
+        }
+
+        size_t next = 0;
+        for (size_t ix = 1; ix < _count; ix++) {
+            if (_messages[ix].priority < _messages[next].priority ||
+                    (_messages[ix].priority == _messages[next].priority && _messages[ix].sequence < _messages[next].sequence)) {
+                next = ix;
+            }
+        }
+
+        *message = _messages[next];
+
+        _count--;
+        if (next != _count) {
+            _messages[next] = _messages[_count];
+        }
+
+        core_util_critical_section_exit();
+
+        return true;
+    }
+
+    /**
+     * Number of queued messages
+     */
+    size_t size() {
+        return _count;
+    }
+
+private:
+    Message _messages[N];
+    size_t _count;
+    uint32_t _sequence;
+};
+
+#endif // _MBED_LORAWAN_UPDATE_CLIENT_OUTBOUND_QUEUE
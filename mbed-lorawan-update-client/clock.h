@@ -24,16 +24,19 @@
 
 /**
  * We don't have access to the Kernel::get_ms_count() function when running in non-RTOS mode
- * This uses Timer interrupts underneath.
- *
- * NOTE: Need to check if we can use the Low-Power timer when it's available!
+ * This uses Timer interrupts underneath, on the low power ticker when the target has one,
+ * so the clock keeps running in deep sleep.
  *
  * Based on https://os.mbed.com/questions/61002/Equivalent-to-Arduino-millis/
  */
 class Clock : public TimerEvent {
 public:
+#if defined (DEVICE_LPTICKER)
+	Clock() : TimerEvent(get_lp_ticker_data()) {
+#else
 	Clock() {
-		// This also starts the us ticker.
+#endif
+		// This also starts the ticker.
 		insert(0x40000000);
 	}
 
@@ -26,6 +26,7 @@
 #include "BDFile.h"
 #include "janpatch.h"
 #include "FragmentationBlockDeviceWrapper.h"
+#include "FragmentationSha256.h"
 #include "FlashIAP.h"
 
 #include "mbed_trace.h"
@@ -33,66 +34,125 @@
 
 enum MBED_DELTA_UPDATE {
     MBED_DELTA_UPDATE_OK        = 0,
-    MBED_DELTA_UPDATE_NO_MEMORY = -8401
+    MBED_DELTA_UPDATE_NO_MEMORY = -8401,
+    MBED_DELTA_UPDATE_WRITE_ERROR = -8402
 };
 
 /**
- * Copy the content of the current running application to a block device
- * @param flash_page_size Size of a flash page, will also be allocated as a buffer
+ * Copy the content of the current running application to a block device.
+ * Every page of the block device is compared against the application first, and only pages that
+ * differ are erased and programmed, so copying the same application again does not write anything.
+ * @param flash_page_size Size of a flash page, the application is read in chunks of this size
  * @param flash_address Start of the application
  * @param flash_size Size of the application
  * @param bd Instance of block device
  * @param bd_address Offset for block device to store the application in
+ * @param sha256 If set, out parameter which will be set to the SHA256 hash of the application
+ * @param pages_written If set, out parameter which will be set to the number of block device pages that were rewritten
+ * @param progress If set, invoked with the number of bytes copied and the size of the application whenever another percent is done
+ *                 (e.g. LoRaWANUpdateClient::reportCopyProgress)
  * @returns 0 if OK, negative value if not OK
  */
-int copy_flash_to_blockdevice(const uint32_t flash_page_size, size_t flash_address, size_t flash_size, FragmentationBlockDeviceWrapper *bd, size_t bd_address) {
+int copy_flash_to_blockdevice(const uint32_t flash_page_size, size_t flash_address, size_t flash_size, FragmentationBlockDeviceWrapper *bd, size_t bd_address,
+                              unsigned char *sha256 = NULL, size_t *pages_written = NULL,
+                              Callback<void(size_t, size_t)> progress = NULL) {
     int r;
 
+    if (pages_written) *pages_written = 0;
+
+    size_t page_size = bd->get_page_size();
+    if (page_size == 0 || flash_page_size == 0) {
+        return BD_ERROR_NOT_INITIALIZED;
+    }
+
     FlashIAP flash;
     if ((r = flash.init()) != 0) {
         return r;
     }
 
-    char *page_buffer = (char*)malloc(flash_page_size);
-    if (!page_buffer) {
+    // one page with what's on the block device, one with what should be there
+    uint8_t *current_page = (uint8_t*)malloc(page_size);
+    uint8_t *new_page = (uint8_t*)malloc(page_size);
+    if (!current_page || !new_page) {
+        if (current_page) free(current_page);
+        if (new_page) free(new_page);
+        flash.deinit();
         return MBED_DELTA_UPDATE_NO_MEMORY;
     }
 
-    int bytes_left = (int)flash_size;
+    // the hash is fed from the pages that are read anyway, so it does not need a buffer of its own
+    FragmentationSha256 hash(bd, NULL, 0);
+    if (sha256) hash.start();
+
+    size_t bytes_left = flash_size;
 
     int prv_pct = 0;
 
+    if (progress) progress(0, flash_size);
+
     while (bytes_left > 0) {
-        int to_read = flash_page_size;
-        if (to_read > bytes_left) to_read = bytes_left;
-
-        // copy it over
-        int v = flash.read(page_buffer, flash_address, to_read);
-        if (v != 0) {
-            free(page_buffer);
-            return r;
+        size_t page_address = (bd_address / page_size) * page_size;
+        size_t page_offset = bd_address - page_address;
+        size_t length = page_size - page_offset;
+        if (length > bytes_left) length = bytes_left;
+
+        if ((r = bd->read(current_page, page_address, page_size)) != 0) {
+            break;
         }
-        bd->program(page_buffer, bd_address, to_read);
+
+        for (size_t offset = 0; offset < length; offset += flash_page_size) {
+            size_t chunk = length - offset;
+            if (chunk > flash_page_size) chunk = flash_page_size;
+
+            if ((r = flash.read(new_page + page_offset + offset, flash_address + offset, chunk)) != 0) {
+                break;
+            }
+        }
+        if (r != 0) break;
+
+        if (sha256) hash.update(new_page + page_offset, length);
+
+        if (memcmp(current_page + page_offset, new_page + page_offset, length) != 0) {
+            // keep whatever is in the page outside of the application
+            memcpy(new_page, current_page, page_offset);
+            memcpy(new_page + page_offset + length, current_page + page_offset + length, page_size - page_offset - length);
+
+            if (bd->erase(page_address, page_size) != 0 || bd->program_erased(new_page, page_address, page_size) != 0) {
+                r = MBED_DELTA_UPDATE_WRITE_ERROR;
+                break;
+            }
+
+            if (pages_written) (*pages_written)++;
+        }
+
+        bytes_left -= length;
+        bd_address += length;
+        flash_address += length;
 
         int pct = ((flash_size - bytes_left) * 100) / flash_size;
         if (pct != prv_pct) {
-            tr_debug("Copying from flash to blockdevice: %u%%", ((flash_size - bytes_left) * 100) / flash_size);
+            tr_debug("Copying from flash to blockdevice: %u%%", pct);
+
+            if (progress) progress(flash_size - bytes_left, flash_size);
 
             prv_pct = pct;
         }
-
-        bytes_left -= to_read;
-        bd_address += to_read;
-        flash_address += to_read;
     }
 
-    free(page_buffer);
+    free(current_page);
+    free(new_page);
+
+    if (sha256) hash.finish(sha256);
+
+    if (r != 0) {
+        flash.deinit();
+        return r;
+    }
 
     if ((r = flash.deinit()) != 0) {
         return r;
     }
 
-    tr_debug("Copying from flash to blockdevice: 100%%");
     return MBED_DELTA_UPDATE_OK;
 }
 
@@ -134,12 +194,17 @@ int print_blockdevice_content(FragmentationBlockDeviceWrapper *bd, size_t addres
     return MBED_DELTA_UPDATE_OK;
 }
 
+// janpatch reports progress through a plain function pointer, this is where apply_delta_update forwards it to
+static Callback<void(uint8_t)> patch_progress_callback;
+
 static void patch_progress(uint8_t pct) {
     static uint8_t last_patch_pct = 0;
 
     if (last_patch_pct != pct) {
         tr_debug("Patch progress: %d%%", pct);
         last_patch_pct = pct;
+
+        if (patch_progress_callback) patch_progress_callback(pct);
     }
 }
 
@@ -147,12 +212,15 @@ static void patch_progress(uint8_t pct) {
  * Apply the delta update
  * @param bd BlockDevice instance
  * @param buffer_size Size of the r/w buffer. Note that this will be alocated three times!
+ *                    Every BDFILE also allocates a page buffer of its own on first access.
  * @param source Source file on block device
  * @param patch  Patch file on block device
  * @param target Target file on block device
+ * @param progress If set, invoked with the percentage of the patch that was applied whenever it changes
  * @returns 0 if OK, a negative value if not OK
  */
-int apply_delta_update(FragmentationBlockDeviceWrapper *bd, size_t buffer_size, BDFILE *source, BDFILE *patch, BDFILE *target) {
+int apply_delta_update(FragmentationBlockDeviceWrapper *bd, size_t buffer_size, BDFILE *source, BDFILE *patch, BDFILE *target,
+                       Callback<void(uint8_t)> progress = NULL) {
     unsigned char *source_buffer = (unsigned char*)malloc(buffer_size);
     if (!source_buffer) {
         return MBED_DELTA_UPDATE_NO_MEMORY;
@@ -183,12 +251,19 @@ int apply_delta_update(FragmentationBlockDeviceWrapper *bd, size_t buffer_size,
     };
 
     /* Go... */
+    patch_progress_callback = progress;
     int j = janpatch(ctx, source, patch, target);
+    patch_progress_callback = NULL;
 
     free(source_buffer);
     free(patch_buffer);
     free(target_buffer);
 
+    // the last page of the target is still in its write buffer
+    if (bd_fflush(target) != 0) {
+        return MBED_DELTA_UPDATE_WRITE_ERROR;
+    }
+
     return j;
 }
 
@@ -29,7 +29,12 @@ typedef struct __attribute__((__packed__)) {
     uint8_t device_class_uuid[16];      // Device Class UUID
     uint32_t version;                   // Firmware version (typically the build timestamp)
 
-    uint32_t diff_info;                 // first byte indicates whether this is a diff, last three bytes are the size of the *old* file
+    uint32_t diff_info;                 // first byte holds the FOTA_DIFF_INFO_* flags, last three bytes are the size of the *old* file
 } UpdateSignature_t;
 
+// Flags in the first byte of diff_info
+#define     FOTA_DIFF_INFO_IS_DIFF      0x01    // Package is a delta update against the firmware in slot 2
+#define     FOTA_DIFF_INFO_ENCRYPTED    0x02    // Package (full image or patch) is AES-128-CTR encrypted, nonce is the last 16 bytes of the signature
+#define     FOTA_DIFF_INFO_COMPRESSED   0x04    // Full image or patch is heatshrink compressed, for full images the last three bytes of diff_info are the size of the *decompressed* file
+
 #endif
@@ -71,6 +71,8 @@
 #define FRAG_SESSION_DELETE_ANS_LENGTH 2
 #define FRAG_SESSION_STATUS_REQ_LENGTH 1
 #define FRAG_SESSION_STATUS_ANS_LENGTH 5
+#define DATA_BLOCK_AUTH_REQ_LENGTH 10
+#define DATA_BLOCK_AUTH_ANS_LENGTH 5
 
 #define CLOCK_APP_TIME_REQ 0x1
 #define CLOCK_APP_TIME_ANS 0x1
@@ -165,31 +167,35 @@ typedef struct {
      */
     uint32_t maxFcFCount;
 
+    /**
+     * Lowest frame counter that is still accepted, frames below it were already received (or are below minFcFCount)
+     */
+    uint32_t nextFcFCount;
+
     /**
      * Class C session parameters
      */
     McClassCSessionParams_t params;
 
     /**
-     * Timeout to start the multicast session
+     * Whether the class C window of this group is open (between the start and timeout events)
      */
-#if defined (DEVICE_LPTICKER)
-    LowPowerTimeout startTimeout;
-#else
-    Timeout startTimeout;
-#endif
+    bool classCActive;
 
     /**
-     * Ticker for the timeout, will switch out of the multicast session
+     * Time of the last data fragment received on this group, in milliseconds of the scheduler's ticker.
+     * Fragments only update this timestamp, the timeout checks it when it fires.
      */
-#if defined (DEVICE_LPTICKER)
-    LowPowerTimeout timeoutTimeout;
-#else
-    Timeout timeoutTimeout;
-#endif
+    volatile uint32_t lastActivityMs;
 
 } MulticastGroupParams_t;
 
+// Events of a multicast group, scheduled when a class C session is set up (see DeadlineScheduler)
+enum LW_UC_MC_EVENT {
+    LW_UC_MC_EVENT_START = 0,           // open the class C window
+    LW_UC_MC_EVENT_TIMEOUT = 1          // close the class C window
+};
+
 typedef struct {
     /**
      * Whether the session is active
@@ -272,20 +278,181 @@ typedef struct {
      */
     FragmentationSession* session;
 
+    /**
+     * Whether the data block was reconstructed and we're waiting for the network server
+     * to confirm the MIC (DataBlockAuthAns) before verifying and applying it
+     */
+    bool dataBlockAuthPending;
+
 } FragmentationSessionParams_t;
 
 typedef struct {
     /**
-     * The correction that needs to be applied to the RTC value
+     * Whether the clock was synchronised (in band or out of band), until then the RTC is used as is
+     */
+    bool synced;
+
+    /**
+     * The correction that needs to be applied to the time base (see get_time_ms), in milliseconds
+     */
+    int64_t correctionMs;
+
+    /**
+     * Time base value and device time (GPS time, in milliseconds) when the last clock sync request was created,
+     * the correction in the answer is applied to this device time
+     */
+    uint64_t timeAtLastRequestMs;
+    uint64_t deviceTimeAtLastRequestMs;
+
+    /**
+     * Time base value at which the correction was last set, the drift is extrapolated from here
+     */
+    uint64_t timeAtLastSyncMs;
+
+    /**
+     * Estimated drift of the time base against GPS time, in ppm (positive when the clock runs slow)
+     */
+    int32_t driftPpm;
+
+    /**
+     * Uncertainty of the drift estimate in ppm, used to predict the error of the clock between syncs
+     */
+    uint32_t driftUncertaintyPpm;
+
+    /**
+     * Whether driftPpm holds an estimate
+     */
+    bool driftEstimated;
+
+    /**
+     * Time base value and correction at the start of the interval over which the drift is measured
+     */
+    bool driftBaseValid;
+    uint64_t driftBaseTimeMs;
+    int64_t driftBaseCorrectionMs;
+
+    /**
+     * AppTimeReq periodicity requested by the application server (DeviceAppTimePeriodicityReq) in seconds, 0 if not set
      */
-    int32_t correction;
+    uint32_t periodicity;
 
     /**
-     * The current time during the last clock sync request
+     * Number of AppTimeReq retransmissions left from the last ForceDeviceResyncReq
      */
-    uint64_t rtcValueAtLastRequest;
+    uint8_t resyncRemaining;
+
+    /**
+     * Whether a periodic AppTimeReq waits in the outbound queue, so idle periods don't fill the queue
+     */
+    bool periodicRequestQueued;
 } ClockSync_t;
 
+// Events of the clock synchronisation
+enum LW_UC_CLOCK_EVENT {
+    LW_UC_CLOCK_EVENT_SYNC = 0,         // send an AppTimeReq
+    LW_UC_CLOCK_EVENT_RESYNC = 1        // send the next AppTimeReq of a ForceDeviceResyncReq
+};
+
+// Events of the fragmentation sessions
+enum LW_UC_FRAG_EVENT {
+    LW_UC_FRAG_EVENT_STATUS_ANS = 0     // send a FragSessionStatusAns after the BlockAckDelay
+};
+
+#define LW_UC_VERIFIED_RECORD_MAGIC 0x56524543 // 'VREC'
+
+/**
+ * Record persisted in flash after the firmware in a slot was hashed and the hash matched the slot header.
+ * Lets us skip hashing the full slot again on the next delta update.
+ */
+typedef struct __attribute__((__packed__)) {
+    /**
+     * Always LW_UC_VERIFIED_RECORD_MAGIC
+     */
+    uint32_t magic;
+
+    /**
+     * Incremented every time the record is (re-)written
+     */
+    uint32_t generation;
+
+    /**
+     * Address and size of the firmware that was verified
+     */
+    uint32_t address;
+    uint32_t size;
+
+    /**
+     * SHA256 hash of the firmware that was verified
+     */
+    uint8_t hash[32];
+
+    /**
+     * 1 if the firmware was verified, 0 if the record was invalidated (because the range was written to)
+     */
+    uint32_t verified;
+
+    /**
+     * CRC32 over all previous fields
+     */
+    uint32_t crc;
+} VerifiedSlotRecord_t;
+
+#define LW_UC_SLOT_TABLE_MAGIC 0x5354424c // 'STBL'
+#define LW_UC_NO_SLOT          0xff
+
+/**
+ * Roles of the three firmware slots, persisted in flash so the slot that holds the active
+ * firmware can be used as the delta source directly, instead of copying the application into slot 2.
+ */
+typedef struct __attribute__((__packed__)) {
+    /**
+     * Always LW_UC_SLOT_TABLE_MAGIC
+     */
+    uint32_t magic;
+
+    /**
+     * Incremented every time the table is (re-)written
+     */
+    uint32_t generation;
+
+    /**
+     * Slot that fragments are written to, full images are installed from this slot
+     */
+    uint8_t receive_slot;
+
+    /**
+     * Slot that delta updates (and compressed or encrypted images) are written to
+     */
+    uint8_t target_slot;
+
+    /**
+     * Slot that holds the active firmware, the source for delta updates
+     */
+    uint8_t baseline_slot;
+
+    /**
+     * Slot with firmware that was handed to the bootloader but did not boot yet, LW_UC_NO_SLOT if none
+     */
+    uint8_t pending_slot;
+
+    /**
+     * Size and SHA256 hash of the firmware in the baseline slot, size 0 if the slot 2 header describes it
+     */
+    uint32_t baseline_size;
+    uint8_t baseline_hash[32];
+
+    /**
+     * Size and SHA256 hash of the firmware in the pending slot
+     */
+    uint32_t pending_size;
+    uint8_t pending_hash[32];
+
+    /**
+     * CRC32 over all previous fields
+     */
+    uint32_t crc;
+} SlotTable_t;
+
 enum FragmenationSessionAnswerErrors {
     FSAE_WrongDescriptor = 3,
     FSAE_IndexNotSupported = 2,
@@ -329,11 +496,10 @@ typedef struct {
     bool retriesAllowed;
 
     /**
-     * Timestamp when this message was created.
-     * If for some reason the application layer cannot send immediately it could re-calculate
-     * package content (e.g. timeToStart for Class C group).
-     * Not a perfect solution, as this requires the application layer to know about the message format,
-     * but will be fixed properly when DevTimeReq and multicast are implemented in the MAC layer.
+     * Timestamp when this message was handed to the send function.
+     * Time-relative fields (e.g. timeToStart for Class C group) are up to date at this moment, also when
+     * the message waited in the outbound queue (setOutboundDeferred). If for some reason the application layer
+     * cannot send immediately it could re-calculate them from here (see updateClassCSessionAns).
      */
     uint32_t createdTimestamp;
 
@@ -386,6 +552,84 @@ typedef struct {
 
 } LoRaWANUpdateClientClassCSession_t;
 
+// Long running phases of an update, reported through the progress callback
+enum LW_UC_PROGRESS_PHASE {
+    LW_UC_PROGRESS_DECODE = 0,          // receiving and decoding fragments, bytes of the data block
+    LW_UC_PROGRESS_HASH = 1,            // hashing (and decrypting) firmware in flash
+    LW_UC_PROGRESS_PATCH = 2,           // applying a delta update, bytes of the patch
+    LW_UC_PROGRESS_DECOMPRESS = 3,      // decompressing a compressed image, bytes of the decompressed firmware
+    LW_UC_PROGRESS_COPY = 4,            // copying the application into slot 2 (see copy_flash_to_blockdevice)
+    LW_UC_PROGRESS_HEADER = 5           // writing the bootloader header
+};
+
+typedef struct {
+
+    /**
+     * Phase that is in progress
+     */
+    LW_UC_PROGRESS_PHASE phase;
+
+    /**
+     * Number of bytes processed in this phase so far
+     */
+    size_t processed;
+
+    /**
+     * Number of bytes that this phase processes in total
+     */
+    size_t total;
+
+    /**
+     * Time since the phase started, in microseconds
+     */
+    uint64_t elapsed_us;
+
+} LoRaWANUpdateClientProgress_t;
+
+typedef struct {
+
+    /**
+     * Number of multicast start and timeout events that were handled
+     */
+    uint32_t mcEventCount;
+
+    /**
+     * Time between the timer interrupt and the handler of the last multicast event, in microseconds
+     */
+    uint32_t mcEventLatencyUs;
+
+    /**
+     * Worst case time between the timer interrupt and the handler of a multicast event, in microseconds
+     */
+    uint32_t mcEventMaxLatencyUs;
+
+    /**
+     * Number of multicast frames dropped because their frame counter was outside of [minFcFCount, maxFcFCount)
+     */
+    uint32_t mcFramesOutOfWindow;
+
+    /**
+     * Number of multicast frames dropped because their frame counter was already received
+     */
+    uint32_t mcFramesReplayed;
+
+    /**
+     * Number of messages waiting in the outbound queue
+     */
+    uint32_t outboundQueueDepth;
+
+    /**
+     * Number of answers that were appended to another queued message, instead of taking their own uplink
+     */
+    uint32_t outboundCoalesced;
+
+    /**
+     * Number of messages dropped because the outbound queue was full
+     */
+    uint32_t outboundDropped;
+
+} LoRaWANUpdateClientStats_t;
+
 typedef struct {
 
     /**
@@ -405,13 +649,15 @@ typedef struct {
 
     /**
      * Switch to Class C callback.
-     * **Note: This runs in an ISR!**
+     * Runs in the shared event queue (RTOS) or the event queue set through setEventQueue.
+     * **Note: Without RTOS and without an event queue, or when the event queue is full, this runs in an ISR!**
      */
     Callback<void(LoRaWANUpdateClientClassCSession_t*)> switchToClassC;
 
     /**
      * Switch to Class A callback
-     * **Note: This runs in an ISR!**
+     * Runs in the shared event queue (RTOS) or the event queue set through setEventQueue.
+     * **Note: Without RTOS and without an event queue, or when the event queue is full, this runs in an ISR!**
      */
     Callback<void()> switchToClassA;
 
@@ -427,6 +673,20 @@ typedef struct {
      */
     Callback<void()> verificationFinished;
 
+    /**
+     * Progress of a long running phase. Fired when a phase starts, when it completes and whenever
+     * another percent of the phase is done. Keep this short, it runs in the middle of flash operations.
+     */
+    Callback<void(LoRaWANUpdateClientProgress_t*)> progress;
+
+    /**
+     * A scheduled message (periodic AppTimeReq, retransmission of a ForceDeviceResyncReq or a
+     * FragSessionStatusAns after its BlockAckDelay) was put in the outbound queue.
+     * Call sendNextOutbound() from the thread that handles downlinks, not from this callback.
+     * Runs in the same context as switchToClassC.
+     */
+    Callback<void()> outboundPending;
+
 } LoRaWANUpdateClientCallbacks_t;
 
 #endif // _MBED_LORAWAN_UPDATE_CLIENT_UPDATE_TYPES